@@ -34,16 +34,41 @@ extern "C" {
  */
 
 /**
- * Number of FM operators supported. Changing this will break ABI
- * and SIMD implementations.
+ * Maximum number of FM operators per voice.
+ * Can be overridden at build time to 4, 8, 12 or 16, e.g. with `make OPERATORS=16`.
+ * Changing this breaks ABI, so applications must be built with the same value as the library.
+ * Check it against \ref fmsynth_get_max_operators at startup to detect a mismatch.
+ * Instances can use fewer operators than this, see \ref fmsynth_set_operators.
  */
+#ifndef FMSYNTH_OPERATORS
 #define FMSYNTH_OPERATORS 8
+#endif
+
+#if FMSYNTH_OPERATORS < 4 || FMSYNTH_OPERATORS > 16 || FMSYNTH_OPERATORS % 4 != 0
+#error "FMSYNTH_OPERATORS must be 4, 8, 12 or 16."
+#endif
 
 /**
  * Opaque type which encapsulates FM synth state.
  */
 typedef struct fmsynth fmsynth_t;
 
+/**
+ * Opaque type which encapsulates a pre-parsed patch.
+ * A patch holds a full set of operator and global parameters.
+ */
+typedef struct fmsynth_patch fmsynth_patch_t;
+
+/**
+ * Number of MIDI programs which can have a patch registered.
+ */
+#define FMSYNTH_PROGRAMS 128
+
+/**
+ * Number of parts in multi-timbral mode, one per MIDI channel.
+ */
+#define FMSYNTH_PARTS 16
+
 /**
  * Parameters for the synth which are unique per FM operator.
  */
@@ -126,6 +151,8 @@ typedef enum fmsynth_status
 
    FMSYNTH_STATUS_MESSAGE_UNKNOWN,  /**< Provided MIDI message is unknown. */
 
+   FMSYNTH_STATUS_UNSUPPORTED,      /**< Requested feature is not supported by this build. */
+
    FMSYNTH_STATUS_ENSURE_INT = INT_MAX /**< Ensure the enum is sizeof(int). */
 } fmsynth_status_t;
 
@@ -143,6 +170,17 @@ typedef enum fmsynth_status
  * @returns Version of libfmsynth.
  */
 unsigned fmsynth_get_version(void);
+
+/** \brief Returns the maximum number of operators the library was built with.
+ *
+ * Parameter arrays, patches and the runtime state are laid out for this many operators.
+ * If this differs from \ref FMSYNTH_OPERATORS as seen by the application, the library and the application
+ * were built with different operator counts and must not be used together.
+ * The operator count of an instance can only be lowered from this, see \ref fmsynth_set_operators.
+ *
+ * @returns FMSYNTH_OPERATORS of the library build.
+ */
+unsigned fmsynth_get_max_operators(void);
 /** @} */
 
 /** \addtogroup libfmsynthLifetime Lifetime */
@@ -151,21 +189,157 @@ unsigned fmsynth_get_version(void);
  *
  * Must be freed later with \ref fmsynth_free.
  *
- * @param sample_rate Sample rate in Hz for the synthesizer. Cannot be changed once initialized.
- * @param max_voices The maximum number of simultaneous voices (polyphony) the synth can support. Cannot be changed once initialized.
+ * @param sample_rate Sample rate in Hz for the synthesizer. Can be changed later with \ref fmsynth_set_sample_rate.
+ * @param max_voices The maximum number of simultaneous voices (polyphony) the synth can support. Cannot be changed once initialized,
+ *                   but polyphony can be limited further with \ref fmsynth_set_active_voice_limit.
  *
  * @returns Newly allocated instance if successful, otherwise NULL.
  */
 fmsynth_t *fmsynth_new(float sample_rate, unsigned max_voices);
 
+/**
+ * Allocation callback for \ref fmsynth_new_with_allocator.
+ * Returns a pointer to at least size bytes, or NULL on failure. No particular alignment is required.
+ */
+typedef void *(*fmsynth_alloc_cb)(void *userdata, size_t size);
+
+/**
+ * Deallocation callback for \ref fmsynth_new_with_allocator.
+ * Frees memory previously returned by the matching \ref fmsynth_alloc_cb.
+ */
+typedef void (*fmsynth_free_cb)(void *userdata, void *ptr);
+
+/** \brief Allocate a new instance of an FM synth with a custom allocator.
+ *
+ * Works like \ref fmsynth_new, but memory is allocated with alloc_cb and later freed with free_cb
+ * when calling \ref fmsynth_free.
+ *
+ * @param sample_rate Sample rate in Hz for the synthesizer.
+ * @param max_voices The maximum number of simultaneous voices (polyphony) the synth can support.
+ * @param alloc_cb Allocation callback. Called once with a size of \ref fmsynth_instance_size.
+ * @param free_cb Deallocation callback. Can be NULL if memory should not be freed by \ref fmsynth_free.
+ * @param userdata Opaque pointer passed to the callbacks.
+ *
+ * @returns Newly allocated instance if successful, otherwise NULL.
+ */
+fmsynth_t *fmsynth_new_with_allocator(float sample_rate, unsigned max_voices,
+      fmsynth_alloc_cb alloc_cb, fmsynth_free_cb free_cb, void *userdata);
+
+/** \brief Size in bytes required to hold an FM synth instance in memory.
+ *
+ * @param max_voices The maximum number of simultaneous voices (polyphony) the synth can support.
+ *
+ * @returns Required size for \ref fmsynth_init_in_place.
+ */
+size_t fmsynth_instance_size(unsigned max_voices);
+
+/** \brief Initialize an FM synth instance in caller-provided memory.
+ *
+ * No memory is allocated, so this function can be called from a real-time thread.
+ * The memory does not need any particular alignment.
+ * The instance does not own the memory. Calling \ref fmsynth_free on it is a no-op,
+ * and the memory can be reused once the instance is no longer in use.
+ *
+ * @param memory Pointer to memory where instance is placed.
+ * @param size Size of memory. Must be at least \ref fmsynth_instance_size.
+ * @param sample_rate Sample rate in Hz for the synthesizer.
+ * @param max_voices The maximum number of simultaneous voices (polyphony) the synth can support.
+ *
+ * @returns Handle to the instance, which is not necessarily equal to memory, or NULL if memory is too small.
+ */
+fmsynth_t *fmsynth_init_in_place(void *memory, size_t size,
+      float sample_rate, unsigned max_voices);
+
 /** \brief Reset FM synth state to initial values.
  *
  * Resets the internal state as if the instance had just been created using \ref fmsynth_new.
+ * Sample rate, kernel, operator count, render governor and active voice limit are kept.
  *
  * @param fm Handle to an FM synth instance.
  */
 void fmsynth_reset(fmsynth_t *fm);
 
+/** \brief Change sample rate of an FM synth instance.
+ *
+ * Active voices are rescaled to the new sample rate and keep playing.
+ * No memory is allocated.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param sample_rate Sample rate in Hz for the synthesizer.
+ */
+void fmsynth_set_sample_rate(fmsynth_t *fm, float sample_rate);
+
+/** \brief Limit the number of simultaneous voices.
+ *
+ * Trades polyphony for CPU time at runtime. When the limit is reached,
+ * \ref fmsynth_note_on returns \ref FMSYNTH_STATUS_BUSY.
+ * Lowering the limit does not stop voices which are already active.
+ * Initial limit is the max_voices the instance was created with. The limit is kept across \ref fmsynth_reset.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param limit Maximum number of active voices. Clamped to the max_voices the instance was created with.
+ */
+void fmsynth_set_active_voice_limit(fmsynth_t *fm, unsigned limit);
+
+/** \brief Size in bytes required to save the runtime state of an FM synth instance.
+ *
+ * @param fm Handle to an FM synth instance.
+ *
+ * @returns Required size for \ref fmsynth_state_save.
+ */
+size_t fmsynth_state_size(const fmsynth_t *fm);
+
+/** \brief Save the full runtime state of an FM synth instance.
+ *
+ * The state covers everything which affects future output:
+ * parameters, programs, parts with their sustain, pitch bend and mod wheel, every voice mid-note,
+ * sample rate, operator count, global LFO and multi-timbral modes, and render governor.
+ * Together with \ref fmsynth_state_load, this allows checkpoints to seek in or parallelize long renders,
+ * and rolling back speculative renders when late events arrive.
+ *
+ * The state is a memory image. It is only valid in the same process and with the same build of libfmsynth,
+ * and registered patches it refers to must stay alive.
+ * No memory is allocated, so this function can be called from a real-time thread.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param buffer Buffer to write state to.
+ * @param size Size of buffer. Must be at least \ref fmsynth_state_size.
+ *
+ * @returns Status code. \ref FMSYNTH_STATUS_BUFFER_TOO_SMALL if buffer is too small.
+ */
+fmsynth_status_t fmsynth_state_save(const fmsynth_t *fm, void *buffer, size_t size);
+
+/** \brief Restore runtime state previously saved with \ref fmsynth_state_save.
+ *
+ * The state can be loaded into the instance which saved it, or into another instance
+ * with at least as many voices. The kernel selection, allocator and runtime statistics of fm are kept.
+ * Voices which used JIT generated code continue with the static kernel until they are triggered again.
+ * No memory is allocated, so this function can be called from a real-time thread.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param buffer Buffer with state.
+ * @param size Size of buffer.
+ *
+ * @returns Status code.
+ * \ref FMSYNTH_STATUS_BUFFER_TOO_SMALL if buffer is truncated,
+ * \ref FMSYNTH_STATUS_INVALID_FORMAT if the buffer does not contain state from this build of libfmsynth,
+ * or \ref FMSYNTH_STATUS_BUSY if the state has more voices than fm.
+ */
+fmsynth_status_t fmsynth_state_load(fmsynth_t *fm, const void *buffer, size_t size);
+
+/** \brief Create a copy of an FM synth instance, including its full runtime state.
+ *
+ * Equivalent to creating an instance with the same sample rate, voices and kernel, and loading the state of fm into it,
+ * without going through a buffer.
+ * The clone is allocated with the allocator fm was created with, or with malloc if fm was initialized in place.
+ * Must be freed later with \ref fmsynth_free.
+ *
+ * @param fm Handle to an FM synth instance.
+ *
+ * @returns Newly allocated instance if successful, otherwise NULL.
+ */
+fmsynth_t *fmsynth_clone(const fmsynth_t *fm);
+
 /** \brief Free an FM synth instance.
  *
  * @param fm Handle to an FM synth instance.
@@ -180,6 +354,8 @@ void fmsynth_free(fmsynth_t *fm);
  *
  * If either parameter or operator_index is out of bounds, this functions is a no-op.
  * Updated parameters will not generally be reflected in audio output until a new voice has started.
+ * To change parameters of playing voices smoothly, use \ref fmsynth_set_parameter_ramp.
+ * Cancels a ramp of the same parameter and operator.
  *
  * @param fm Handle to an FM synth instance.
  * @param parameter Which parameter to modify. See \ref fmsynth_parameter for which parameters can be used.
@@ -189,6 +365,35 @@ void fmsynth_free(fmsynth_t *fm);
 void fmsynth_set_parameter(fmsynth_t *fm,
       unsigned parameter, unsigned operator_index, float value);
 
+/** \brief Ramp a parameter specific to an operator linearly to a new value.
+ *
+ * The parameter moves from its current value to target over the next frames rendered frames.
+ * It is updated every 32 frames, and the change is applied to playing voices as well as to new voices.
+ * Amplitude, pan, carriers, frequency, mod wheel and LFO sensitivity and the modulation matrix follow ramps in playing voices.
+ * Parameters which shape the start of a note, like envelopes, keyboard scaling and velocity sensitivity,
+ * only affect voices started after they change.
+ *
+ * Ramps apply to the parameters set with \ref fmsynth_set_parameter.
+ * Voices playing patches registered with \ref fmsynth_set_program are not affected.
+ * A new ramp replaces a running ramp of the same parameter and operator.
+ * \ref fmsynth_set_parameter, \ref fmsynth_set_parameters, \ref fmsynth_preset_load, \ref fmsynth_patch_apply
+ * and \ref fmsynth_reset cancel ramps.
+ * Up to 32 ramps can run at the same time.
+ * \ref FMSYNTH_PARAM_ENABLE is a switch and cannot be ramped.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param parameter Which parameter to ramp. See \ref fmsynth_parameter for which parameters can be used.
+ * @param operator_index Which operator to modify. Valid range is 0 to \ref FMSYNTH_OPERATORS - 1.
+ * @param target Value the parameter reaches at the end of the ramp.
+ * @param frames Length of the ramp in frames. If 0, target is applied immediately, including to playing voices.
+ *
+ * @returns Status code. \ref FMSYNTH_STATUS_BUSY if too many ramps are running.
+ *          \ref FMSYNTH_STATUS_UNSUPPORTED if parameter or operator_index is out of bounds,
+ *          or parameter is \ref FMSYNTH_PARAM_ENABLE.
+ */
+fmsynth_status_t fmsynth_set_parameter_ramp(fmsynth_t *fm,
+      unsigned parameter, unsigned operator_index, float target, unsigned frames);
+
 float fmsynth_get_parameter(fmsynth_t *fm,
                             unsigned parameter, unsigned operator_index);
 
@@ -200,6 +405,62 @@ float fmsynth_convert_to_normalized_parameter(fmsynth_t *fm,
                                               unsigned parameter,
                                               float value);
 
+/** \brief Set several parameters for every operator at once.
+ *
+ * values is laid out like the parameters of a preset, with the value for parameter p and operator o
+ * at values[(p - first_parameter) * \ref FMSYNTH_OPERATORS + o].
+ * Equivalent to calling \ref fmsynth_set_parameter for every parameter and operator in the range,
+ * but copies the range at once and updates voices only once.
+ * Parameters past \ref FMSYNTH_PARAM_END are ignored.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param first_parameter First parameter to modify. See \ref fmsynth_parameter.
+ * @param parameters Number of parameters to modify.
+ * @param values Values for parameters * \ref FMSYNTH_OPERATORS parameters.
+ */
+void fmsynth_set_parameters(fmsynth_t *fm,
+      unsigned first_parameter, unsigned parameters, const float *values);
+
+/** \brief Get several parameters for every operator at once.
+ *
+ * values has the same layout as in \ref fmsynth_set_parameters.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param first_parameter First parameter to read. See \ref fmsynth_parameter.
+ * @param parameters Number of parameters to read.
+ * @param values Receives parameters * \ref FMSYNTH_OPERATORS values.
+ */
+void fmsynth_get_parameters(fmsynth_t *fm,
+      unsigned first_parameter, unsigned parameters, float *values);
+
+/** \brief Convert several normalized parameters in [0, 1] to their plain values at once.
+ *
+ * in and out have the same layout as in \ref fmsynth_set_parameters, and may point to the same buffer.
+ * The conversion is vectorized, and for logarithmic parameters differs from
+ * \ref fmsynth_convert_from_normalized_parameter by less than 1e-6 relative error.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param first_parameter First parameter to convert. See \ref fmsynth_parameter.
+ * @param parameters Number of parameters to convert.
+ * @param in Normalized values.
+ * @param out Receives plain values.
+ */
+void fmsynth_convert_from_normalized_parameters(fmsynth_t *fm,
+      unsigned first_parameter, unsigned parameters, const float *in, float *out);
+
+/** \brief Convert several plain parameter values to normalized values in [0, 1] at once.
+ *
+ * The inverse of \ref fmsynth_convert_from_normalized_parameters.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param first_parameter First parameter to convert. See \ref fmsynth_parameter.
+ * @param parameters Number of parameters to convert.
+ * @param in Plain values.
+ * @param out Receives normalized values.
+ */
+void fmsynth_convert_to_normalized_parameters(fmsynth_t *fm,
+      unsigned first_parameter, unsigned parameters, const float *in, float *out);
+
 /** \brief Set a parameter global to the FM synth.
  *
  * If parameter is out of bounds, this functions is a no-op.
@@ -241,11 +502,27 @@ struct fmsynth_preset_metadata
 };
 
 /** \brief Size in bytes required to hold a preset in memory.
+ *
+ * Presets store every operator, so the size depends on \ref FMSYNTH_OPERATORS.
+ * Presets saved with a different number of operators can still be loaded.
+ * Operators missing from such a preset are disabled, and extra operators in it are dropped.
  *
  * @returns Required size.
  */
 size_t fmsynth_preset_size(void);
 
+/** \brief Size in bytes of a stored preset.
+ *
+ * Useful to step through banks of concatenated presets,
+ * which may have been saved with a different number of operators than this build.
+ *
+ * @param buffer Pointer to buffer which starts with a preset.
+ * @param size Size of buffer.
+ *
+ * @returns Size of the preset at the start of buffer, or 0 if buffer does not start with a preset header.
+ */
+size_t fmsynth_preset_stored_size(const void *buffer, size_t size);
+
 /** \brief Saves current preset to memory.
  *
  * The current preset state of the synth is stored to memory.
@@ -269,7 +546,7 @@ fmsynth_status_t fmsynth_preset_save(fmsynth_t *fm, const struct fmsynth_preset_
  * @param fm Handle to an FM synth interface.
  * @param metadata Pointer to metadata. Can be NULL if reading metadata is not necessary.
  * @param buffer Pointer to buffer where preset can be read.
- * @param size Size of buffer. Must be at least \ref fmsynth_preset_size.
+ * @param size Size of buffer. Must be at least \ref fmsynth_preset_stored_size.
  *
  * @returns Error code.
  */
@@ -277,8 +554,154 @@ fmsynth_status_t fmsynth_preset_load(fmsynth_t *fm, struct fmsynth_preset_metada
       const void *buffer, size_t size);
 /** @} */
 
+/** \addtogroup libfmsynthProgram Program handling */
+/** @{ */
+/** \brief Allocate a new patch.
+ *
+ * The patch is initialized with default parameters.
+ * Must be freed later with \ref fmsynth_patch_free.
+ *
+ * @returns Newly allocated patch if successful, otherwise NULL.
+ */
+fmsynth_patch_t *fmsynth_patch_new(void);
+
+/** \brief Free a patch.
+ *
+ * The patch must not be registered with any FM synth instance,
+ * and no voices started with the patch can be active.
+ *
+ * @param patch Handle to a patch. Can be NULL.
+ */
+void fmsynth_patch_free(fmsynth_patch_t *patch);
+
+/** \brief Load preset into a patch.
+ *
+ * Parses a preset in the same format as \ref fmsynth_preset_load.
+ * This is intended to be done up front, outside the audio thread.
+ * A patch must not be modified while it is registered with an FM synth instance.
+ *
+ * @param patch Handle to a patch.
+ * @param metadata Pointer to metadata. Can be NULL if reading metadata is not necessary.
+ * @param buffer Pointer to buffer where preset can be read.
+ * @param size Size of buffer. Must be at least \ref fmsynth_preset_stored_size.
+ *
+ * @returns Error code.
+ */
+fmsynth_status_t fmsynth_patch_load(fmsynth_patch_t *patch, struct fmsynth_preset_metadata *metadata,
+      const void *buffer, size_t size);
+
+/** \brief Copy the parameters of a patch to an FM synth instance.
+ *
+ * Has the same effect as loading the preset the patch was loaded from with \ref fmsynth_preset_load,
+ * but the preset is already parsed, and no memory is allocated.
+ * This allows parsing presets with \ref fmsynth_patch_load outside the audio thread,
+ * and swapping them in between calls to \ref fmsynth_render.
+ * The patch is not referenced after this call.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param patch Handle to a patch.
+ */
+void fmsynth_patch_apply(fmsynth_t *fm, const fmsynth_patch_t *patch);
+
+/** \brief Register a patch for a MIDI program.
+ *
+ * The patch is not copied, and must remain valid as long as it is registered,
+ * or as long as voices started with the patch are active.
+ * \ref fmsynth_reset unregisters all patches.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param program MIDI program number. Valid range is [0, \ref FMSYNTH_PROGRAMS - 1].
+ * @param patch Handle to a patch. If NULL, the program is unregistered.
+ */
+void fmsynth_set_program(fmsynth_t *fm, uint8_t program,
+      const fmsynth_patch_t *patch);
+
+/** \brief Select which patch is used for new voices.
+ *
+ * Switching program is a constant-time operation and is safe to do between calls to \ref fmsynth_render.
+ * Voices which are already active keep the parameters they were started with.
+ * If no patch is registered for the program, the parameters of the FM synth instance itself are used,
+ * i.e. the parameters set with \ref fmsynth_set_parameter and \ref fmsynth_preset_load.
+ * Program change messages in \ref fmsynth_parse_midi call this function.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param program MIDI program number.
+ */
+void fmsynth_program_change(fmsynth_t *fm, uint8_t program);
+/** @} */
+
 /** \addtogroup libfmsynthRender Audio rendering */
 /** @{ */
+
+/**
+ * Implementations of the audio-rate inner loop.
+ */
+enum fmsynth_kernel
+{
+   FMSYNTH_KERNEL_DEFAULT = 0, /**< Fastest kernel available in this build. */
+   FMSYNTH_KERNEL_C,           /**< Portable C reference kernel. Always available. */
+   FMSYNTH_KERNEL_SIMD,        /**< SIMD kernel selected at compile time (SSE, AVX or NEON). Requires FMSYNTH_SIMD. */
+   FMSYNTH_KERNEL_JIT,         /**< Code generated per patch at runtime, see \ref fmsynth_set_kernel. Requires FMSYNTH_JIT, x86-64 Linux, AVX2 and FMA. */
+
+   FMSYNTH_KERNEL_ENSURE_INT = INT_MAX /**< Ensure the enum is sizeof(int). */
+};
+
+/** \brief Select which kernel is used for rendering.
+ *
+ * Intended for benchmarking and validation of SIMD kernels against the C reference.
+ * Output of different kernels is not bit-exact.
+ * The default kernel is selected when an FM synth instance is created.
+ *
+ * With \ref FMSYNTH_KERNEL_JIT, a kernel specialized to the modulation matrix, enabled operators
+ * and carriers of a patch is generated once the same patch has been triggered twice in a row.
+ * Up to 16 patches are cached, least recently used first out.
+ * Voices whose patch is not compiled yet, is edited while they play, or is rendered with
+ * \ref fmsynth_render_mono or at reduced precision by the render governor use the fastest static kernel.
+ * Code is generated on the thread calling the note-on functions without system calls,
+ * into a writable and executable arena which is mapped when this kernel is selected and
+ * unmapped when another kernel is selected or the instance is freed with \ref fmsynth_free.
+ * Select another kernel before releasing the memory of an instance created with \ref fmsynth_init_in_place.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param kernel Kernel to use.
+ *
+ * @returns \ref FMSYNTH_STATUS_UNSUPPORTED if the kernel is not available in this build.
+ */
+fmsynth_status_t fmsynth_set_kernel(fmsynth_t *fm, enum fmsynth_kernel kernel);
+
+/** \brief Get name of the kernel in use.
+ *
+ * @param fm Handle to an FM synth instance.
+ *
+ * @returns Kernel name, e.g. "c", "sse", "avx", "neon" or "jit".
+ */
+const char *fmsynth_get_kernel_name(const fmsynth_t *fm);
+
+/** \brief Set number of operators used by an instance.
+ *
+ * Operators from operators to \ref FMSYNTH_OPERATORS - 1 are disabled for new voices regardless of patch,
+ * and kernels specialized to the next multiple of 4 operators are used.
+ * How much this saves depends on the kernel. On an AVX2 machine, 4 operator voices render about 1.25x as fast
+ * as 8 operator voices with the default SIMD kernel, which is bound by the latency of each voice's per-frame
+ * dependency chain rather than by its width, and about 2.3x as fast with the C kernel.
+ * Intended to be called right after the instance is created. Active voices are stopped.
+ * The default is \ref FMSYNTH_OPERATORS.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param operators Number of operators. Valid range is [1, \ref FMSYNTH_OPERATORS].
+ *
+ * @returns \ref FMSYNTH_STATUS_UNSUPPORTED if operators is out of range.
+ */
+fmsynth_status_t fmsynth_set_operators(fmsynth_t *fm, unsigned operators);
+
+/** \brief Get number of operators used by an instance.
+ *
+ * @param fm Handle to an FM synth instance.
+ *
+ * @returns Number of operators, see \ref fmsynth_set_operators.
+ */
+unsigned fmsynth_get_operators(const fmsynth_t *fm);
+
 /** \brief Render audio to buffer
  *
  * Renders audio to left and right buffers. The rendering is additive.
@@ -292,10 +715,362 @@ fmsynth_status_t fmsynth_preset_load(fmsynth_t *fm, struct fmsynth_preset_metada
  * @returns Number of voices currently active.
  */
 unsigned fmsynth_render(fmsynth_t *fm, float *left, float *right, unsigned frames);
+
+/** \brief Render audio to a mono buffer
+ *
+ * Like \ref fmsynth_render, but mixes every voice to a single channel,
+ * which is the average of the left and right channels \ref fmsynth_render would produce.
+ * Only one carrier mix is computed per voice, which saves the second buffer and a mixdown pass.
+ * The carrier mix is a small part of the work next to the oscillators and the modulation matrix,
+ * so render time is within a few percent of \ref fmsynth_render.
+ * The rendering is additive.
+ *
+ * \ref fmsynth_render detects voices where every carrier is panned to center by itself,
+ * and computes a single mix for both channels for those. This gives a similarly small gain.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param out A pointer to the output buffer.
+ * @param frames The number of frames to render.
+ *
+ * @returns Number of voices currently active.
+ */
+unsigned fmsynth_render_mono(fmsynth_t *fm, float *out, unsigned frames);
+/** @} */
+
+/** \addtogroup libfmsynthStats Runtime statistics */
+/** @{ */
+
+/**
+ * Runtime statistics of an FM synth instance.
+ * Timings are in timer ticks, which is the CPU time stamp counter on x86, otherwise clock().
+ */
+struct fmsynth_stats
+{
+   uint64_t frames_rendered;       /**< Total number of frames rendered. */
+   uint64_t render_calls;          /**< Number of calls to \ref fmsynth_render. */
+   uint64_t voice_frames_rendered; /**< Sum of active voices times frames for every call to \ref fmsynth_render. */
+   uint64_t peak_active_voices;    /**< Highest number of voices active at the same time. */
+   float average_active_voices;    /**< Average number of active voices per rendered frame. */
+   uint64_t notes_rejected;        /**< Notes which could not be started, i.e. note on returned \ref FMSYNTH_STATUS_BUSY. */
+   uint64_t voices_retired;        /**< Voices which were stopped before their release had finished. */
+   uint64_t process_ticks;         /**< Time spent in the audio-rate kernel. */
+   uint64_t control_ticks;         /**< Time spent in control-rate updates of LFOs and envelopes. */
+   uint64_t event_ticks;           /**< Time spent handling events, e.g. note on and \ref fmsynth_parse_midi. */
+   uint64_t max_render_ticks;      /**< Longest time spent in a single call to \ref fmsynth_render. */
+};
+
+/** \brief Read runtime statistics.
+ *
+ * Statistics are only gathered if libfmsynth is built with FMSYNTH_STATS defined (make STATS=1).
+ * Otherwise, collecting statistics compiles out entirely.
+ * Counters are lock-free, so this function can be called from any thread, e.g. a monitoring thread,
+ * while another thread is rendering. Counters are read individually, so they might not be mutually consistent.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param stats Receives the statistics.
+ *
+ * @returns \ref FMSYNTH_STATUS_UNSUPPORTED if statistics are not compiled in.
+ */
+fmsynth_status_t fmsynth_get_stats(const fmsynth_t *fm, struct fmsynth_stats *stats);
+
+/** \brief Reset runtime statistics to zero.
+ *
+ * Should be called from the thread which renders, otherwise updates from a concurrent \ref fmsynth_render can be lost.
+ *
+ * @param fm Handle to an FM synth instance.
+ */
+void fmsynth_reset_stats(fmsynth_t *fm);
+/** @} */
+
+/** \addtogroup libfmsynthGovernor Render governor */
+/** @{ */
+
+/**
+ * Degradation steps taken by the render governor, in the order they are escalated.
+ * Every level also applies the steps of the levels below it.
+ */
+enum fmsynth_governor_level
+{
+   FMSYNTH_GOVERNOR_NOMINAL = 0,   /**< Full quality. */
+   FMSYNTH_GOVERNOR_CULL_RELEASED, /**< The quietest released voices are culled if the block would not fit in the budget. */
+   FMSYNTH_GOVERNOR_LOW_PRECISION, /**< Voices quieter than average use a cheaper, less precise oscillator. */
+   FMSYNTH_GOVERNOR_SLOW_CONTROL,  /**< Envelopes and LFOs are updated at a quarter of the normal control rate. */
+   FMSYNTH_GOVERNOR_CULL_HELD,     /**< The quietest voices are culled even if they are still held. */
+
+   FMSYNTH_GOVERNOR_ENSURE_INT = INT_MAX /**< Ensure the enum is sizeof(int). */
+};
+
+/**
+ * What the render governor did in the most recent call to \ref fmsynth_render.
+ */
+struct fmsynth_governor_report
+{
+   enum fmsynth_governor_level level; /**< Degradation level after the block was rendered. */
+   float load;                        /**< Render time of the block relative to the budget. Above 1 the budget was exceeded. */
+   unsigned voices_culled;            /**< Voices culled before the block was rendered. */
+   unsigned low_precision_voices;     /**< Voices rendered with the less precise oscillator. */
+   unsigned control_interval;         /**< Frames between control-rate updates for voices. */
+};
+
+/** \brief Called from \ref fmsynth_render when the governor changes level or culls voices.
+ *
+ * Runs on the rendering thread, so it must be real-time safe.
+ */
+typedef void (*fmsynth_governor_cb)(void *userdata, const struct fmsynth_governor_report *report);
+
+/** \brief Monotonic clock in seconds, used to measure render time. */
+typedef double (*fmsynth_clock_cb)(void *userdata);
+
+/**
+ * Configuration of the render governor.
+ */
+struct fmsynth_governor_config
+{
+   float budget;                  /**< Longest time rendering a block may take, as a fraction of the block's duration, e.g. 0.5. */
+   fmsynth_governor_cb report_cb; /**< Optional report callback. */
+   fmsynth_clock_cb clock_cb;     /**< Optional clock. If NULL, a monotonic system clock is used. */
+   void *userdata;                /**< Passed to report_cb and clock_cb. */
+};
+
+/** \brief Enable or disable the render governor.
+ *
+ * The governor measures how long \ref fmsynth_render takes and degrades quality gracefully
+ * before a block misses its deadline, rather than failing at the worst moment.
+ * Rendering time per voice is tracked over recent blocks. When a block comes close to the budget,
+ * the governor escalates one \ref fmsynth_governor_level per block.
+ * When rendering has stayed well within budget for a while, it steps back down one level at a time.
+ * Culled voices count towards voices_retired in \ref fmsynth_stats.
+ *
+ * The governor is disabled by default, in which case rendering is unaffected.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param config Governor configuration. NULL or a budget of zero disables the governor.
+ */
+void fmsynth_set_governor(fmsynth_t *fm, const struct fmsynth_governor_config *config);
+
+/** \brief Get what the render governor did in the most recent block.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param report Receives the report.
+ */
+void fmsynth_get_governor_report(const fmsynth_t *fm, struct fmsynth_governor_report *report);
+/** @} */
+
+/** \addtogroup libfmsynthOffline Offline rendering */
+/** @{ */
+
+/**
+ * A timestamped MIDI message, used for offline rendering and render-ahead.
+ */
+struct fmsynth_event
+{
+   uint64_t frame;  /**< Frame at which the message takes effect. */
+   uint8_t data[3]; /**< MIDI message, as passed to \ref fmsynth_parse_midi. */
+};
+
+/**
+ * Opaque type which holds an offline render plan.
+ */
+typedef struct fmsynth_offline fmsynth_offline_t;
+
+/** \brief Plan offline rendering of a complete event list.
+ *
+ * When the whole event list is known up front,
+ * every note can be rendered as an independent job over its entire lifetime.
+ * Jobs only read from the plan, so they can be rendered concurrently on any number of threads
+ * with no synchronization, and the results mixed together afterwards.
+ *
+ * Events are interpreted like \ref fmsynth_parse_midi would at the given frame.
+ * Pitch bend, mod wheel, sustain, program change and all notes off are honored.
+ * Programs, part parameters and multi-timbral mode are taken from the FM synth instance
+ * as they are when this function is called. Voices which are already active in the instance are not part of the plan.
+ * Polyphony is not limited, and notes which are still held at the end of the event list are released there.
+ *
+ * The FM synth instance and any registered patches must not be modified or freed while the plan is in use.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param events Event list. Must be sorted by frame.
+ * @param num_events Number of events.
+ *
+ * @returns Newly allocated plan if successful, otherwise NULL.
+ */
+fmsynth_offline_t *fmsynth_offline_new(const fmsynth_t *fm,
+      const struct fmsynth_event *events, size_t num_events);
+
+/** \brief Free an offline render plan.
+ *
+ * @param plan Handle to a plan. Can be NULL.
+ */
+void fmsynth_offline_free(fmsynth_offline_t *plan);
+
+/** \brief Get number of jobs in a plan.
+ *
+ * There is one job per note.
+ *
+ * @param plan Handle to a plan.
+ *
+ * @returns Number of jobs.
+ */
+size_t fmsynth_offline_num_jobs(const fmsynth_offline_t *plan);
+
+/** \brief Query where a job belongs in the output.
+ *
+ * @param plan Handle to a plan.
+ * @param job Job index.
+ * @param start Receives the frame where the output of the job starts.
+ * @param frames Receives an upper bound of the number of frames the job renders.
+ */
+void fmsynth_offline_job_info(const fmsynth_offline_t *plan, size_t job,
+      uint64_t *start, uint64_t *frames);
+
+/** \brief Render a single job.
+ *
+ * Renders the complete lifetime of a note. The rendering is additive, like \ref fmsynth_render.
+ * The output should be mixed into the final output at the start frame returned by \ref fmsynth_offline_job_info.
+ * This function is thread-safe as long as the output buffers are not shared between threads.
+ *
+ * @param plan Handle to a plan.
+ * @param job Job index.
+ * @param left A pointer to buffer representing the left channel.
+ * @param right A pointer to buffer representing the right channel.
+ * @param max_frames Size of the buffers. Rendering stops after this many frames.
+ *
+ * @returns Number of frames rendered.
+ */
+uint64_t fmsynth_offline_render_job(const fmsynth_offline_t *plan, size_t job,
+      float *left, float *right, uint64_t max_frames);
+/** @} */
+
+/** \addtogroup libfmsynthAhead Render-ahead */
+/** @{ */
+
+/**
+ * Opaque type which holds a render-ahead thread.
+ */
+typedef struct fmsynth_ahead fmsynth_ahead_t;
+
+/**
+ * Render-ahead statistics, see \ref fmsynth_ahead_get_stats.
+ */
+struct fmsynth_ahead_stats
+{
+   unsigned buffered_frames; /**< Frames rendered ahead which have not been read yet. */
+   uint64_t underrun_frames; /**< Frames \ref fmsynth_ahead_read could not provide in time. */
+   uint64_t late_events;     /**< Events which were scheduled after their frame had been rendered. */
+};
+
+/** \brief Start rendering ahead of the audio callback on a background thread.
+ *
+ * For playback which does not need to react to live input, e.g. sequenced backing tracks or game music,
+ * a background thread keeps a ring buffer of audio rendered ahead of time. The audio callback only copies
+ * audio out of the ring with \ref fmsynth_ahead_read, so spikes in render time, e.g. from large chords,
+ * are absorbed by the ring instead of causing missed deadlines.
+ * Events are scheduled into the future with \ref fmsynth_ahead_schedule, and take effect at their exact frame
+ * as long as they are scheduled before the render thread gets there.
+ *
+ * The render thread owns fm until \ref fmsynth_ahead_free returns. Other threads must not use fm directly,
+ * but can control it with scheduled MIDI messages.
+ * Not available on Windows builds.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param buffer_frames Size of the ring in frames, which is the most audio rendered ahead.
+ * @param block_frames Number of frames the render thread renders at a time. Must not be larger than buffer_frames.
+ * @param max_events Number of events which can be scheduled but not yet applied at a time.
+ *
+ * @returns Newly allocated render-ahead handle if successful, otherwise NULL.
+ */
+fmsynth_ahead_t *fmsynth_ahead_new(fmsynth_t *fm, unsigned buffer_frames,
+      unsigned block_frames, unsigned max_events);
+
+/** \brief Stop the render thread and free the render-ahead handle.
+ *
+ * @param ahead Handle to render-ahead. Can be NULL.
+ */
+void fmsynth_ahead_free(fmsynth_ahead_t *ahead);
+
+/** \brief Schedule a MIDI message.
+ *
+ * Events must be scheduled in order of frame, and only from one thread.
+ * Events scheduled for a frame which has already been rendered take effect at the next frame which is rendered,
+ * and are counted in \ref fmsynth_ahead_stats::late_events.
+ * Lock-free, so this function can be called from a real-time thread.
+ *
+ * @param ahead Handle to render-ahead.
+ * @param event Event to schedule. The frame is in the timeline of \ref fmsynth_ahead_get_position.
+ *
+ * @returns \ref FMSYNTH_STATUS_OK or \ref FMSYNTH_STATUS_BUSY if max_events events are already pending.
+ */
+fmsynth_status_t fmsynth_ahead_schedule(fmsynth_ahead_t *ahead,
+      const struct fmsynth_event *event);
+
+/** \brief Read audio rendered ahead.
+ *
+ * Intended to be called from the audio callback, and only from one thread.
+ * Lock-free and no memory is allocated. The rendering is additive, like \ref fmsynth_render.
+ * If the render thread has fallen behind, fewer frames are provided, and the rest of the buffers is left untouched.
+ * The timeline only advances by the frames which were provided.
+ *
+ * @param ahead Handle to render-ahead.
+ * @param left A pointer to buffer representing the left channel.
+ * @param right A pointer to buffer representing the right channel.
+ * @param frames The number of frames to read.
+ *
+ * @returns Number of frames provided.
+ */
+unsigned fmsynth_ahead_read(fmsynth_ahead_t *ahead, float *left, float *right, unsigned frames);
+
+/** \brief Get the playback position.
+ *
+ * @param ahead Handle to render-ahead.
+ *
+ * @returns Number of frames read so far with \ref fmsynth_ahead_read.
+ */
+uint64_t fmsynth_ahead_get_position(const fmsynth_ahead_t *ahead);
+
+/** \brief Get render-ahead statistics.
+ *
+ * Can be called from any thread.
+ *
+ * @param ahead Handle to render-ahead.
+ * @param stats Receives statistics.
+ */
+void fmsynth_ahead_get_stats(const fmsynth_ahead_t *ahead, struct fmsynth_ahead_stats *stats);
 /** @} */
 
 /** \addtogroup libfmsynthControl MIDI control interface */
 /** @{ */
+/** \brief Enable or disable multi-timbral mode.
+ *
+ * In multi-timbral mode, \ref fmsynth_parse_midi routes messages to one of \ref FMSYNTH_PARTS parts
+ * based on the MIDI channel. Every part has its own program, sustain, mod wheel and pitch bend state,
+ * while all parts share the same pool of voices.
+ * If disabled (the default), the MIDI channel is ignored and all messages control part 0.
+ *
+ * The direct control functions below, e.g. \ref fmsynth_note_on, always control part 0.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param enable If true, enable multi-timbral mode.
+ */
+void fmsynth_set_multi_timbral(fmsynth_t *fm, bool enable);
+
+/** \brief Enable or disable global LFO mode.
+ *
+ * By default, every voice runs its own LFO, starting at the same phase when the voice is triggered.
+ * In global LFO mode, every part runs a single free-running LFO instead, which is shared by all voices of the part.
+ * This removes the per-voice LFO cost, at the expense of LFO phase no longer following note on.
+ *
+ * The global LFO is stepped once per call to \ref fmsynth_render, so render blocks should be
+ * a few hundred frames or shorter for smooth modulation.
+ * Changes to \ref FMSYNTH_GLOBAL_PARAM_LFO_FREQ apply to the global LFO immediately.
+ *
+ * Voices skip LFO updates entirely if none of their enabled operators have
+ * \ref FMSYNTH_PARAM_LFO_AMP_SENSITIVITY or \ref FMSYNTH_PARAM_LFO_FREQ_MOD_DEPTH set, in either mode.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param enable If true, enable global LFO mode. Disabled by \ref fmsynth_reset.
+ */
+void fmsynth_set_global_lfo(fmsynth_t *fm, bool enable);
+
 /** \brief Trigger a note on the FM synth.
  *
  * @param fm Handle to an FM synth instance.
@@ -354,11 +1129,46 @@ void fmsynth_release_all(fmsynth_t *fm);
  * @param fm Handle to an FM synth instance.
  * @param midi_data Pointer to MIDI data. Message type must always be provided.
  *                  E.g. Successive "note on" messages cannot drop the first byte.
+ *                  The MIDI channel selects the part if multi-timbral mode is enabled, see \ref fmsynth_set_multi_timbral.
  *
  * @returns Status code. Depends on MIDI message type or \ref FMSYNTH_STATUS_MESSAGE_UNKNOWN if unknown MIDI message is provided.
  */
 fmsynth_status_t fmsynth_parse_midi(fmsynth_t *fm,
       const uint8_t *midi_data);
+
+/**
+ * Framing state of a MIDI byte stream, see \ref fmsynth_parse_midi_stream.
+ * Must be zero-initialized before the first chunk of a stream. Members are private.
+ */
+struct fmsynth_midi_stream
+{
+   uint8_t status;  /**< Running status, or 0 if there is none. */
+   uint8_t data[2]; /**< Data bytes of the message being framed. */
+   uint8_t count;   /**< Number of data bytes in data. */
+   bool sysex;      /**< Set while inside a SysEx message. */
+};
+
+/** \brief Parse a chunk of a raw MIDI byte stream.
+ *
+ * Bytes are framed into messages across chunks, as read from a serial port or a raw MIDI device.
+ * Messages may be split at any byte, and may use running status.
+ * SysEx messages and system common messages are skipped.
+ * Real-time messages are handled wherever they appear, STOP and Reset release all notes like in \ref fmsynth_parse_midi.
+ * Complete messages are handled like with \ref fmsynth_parse_midi.
+ * Runs of note on and note off messages are handled without framing each message.
+ *
+ * @param fm Handle to an FM synth instance.
+ * @param bytes MIDI bytes.
+ * @param len Number of bytes.
+ * @param stream Framing state of the stream, which is kept between chunks.
+ *
+ * @returns Status code. Every byte is consumed even if a message fails.
+ * If any message failed, the status of the last message which failed,
+ * e.g. \ref FMSYNTH_STATUS_BUSY if a note could not be started or
+ * \ref FMSYNTH_STATUS_MESSAGE_UNKNOWN if a message is not supported.
+ */
+fmsynth_status_t fmsynth_parse_midi_stream(fmsynth_t *fm,
+      const uint8_t *bytes, size_t len, struct fmsynth_midi_stream *stream);
 /** @} */
 
 /** @} */
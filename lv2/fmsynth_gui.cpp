@@ -19,6 +19,8 @@
 #include <lvtk/gtkui.hpp>
 #include "fmsynth.peg"
 #include "fmsynth_private.h"
+#include "fmsynth_uris.hpp"
+#include <lv2/lv2plug.in/ns/ext/atom/atom.h>
 
 #include <functional>
 #include <utility>
@@ -35,6 +37,10 @@ using namespace Gtk;
 
 using EventMap = std::unordered_map<uint32_t, std::function<void (float)>>;
 using ValueMap = std::unordered_map<uint32_t, std::function<float ()>>;
+
+// Sends a binary preset to the plugin as a whole.
+// Widgets are updated by the second argument without writing their ports.
+using PresetFunc = std::function<void (const std::vector<uint8_t>&, const std::function<void ()>&)>;
 class FMSynthGUI;
 
 class Slider : public VBox
@@ -274,8 +280,8 @@ class BasicParameters : public Frame
 class Presets : public Frame
 {
    public:
-      Presets(const char *bundle_path, EventMap& events, ValueMap& values, std::function<void (uint32_t, float)> func)
-         : Frame("Presets"), events(events), values(values), lv2_func(func), bundle_path(bundle_path)
+      Presets(const char *bundle_path, EventMap& events, ValueMap& values, PresetFunc func)
+         : Frame("Presets"), events(events), values(values), preset_func(func), bundle_path(bundle_path)
       {
          auto vbox = manage(new VBox);
          auto hbox = manage(new HBox);
@@ -314,7 +320,7 @@ class Presets : public Frame
       FileFilter any_filter;
       EventMap& events;
       ValueMap& values;
-      std::function<void (uint32_t, float)> lv2_func;
+      PresetFunc preset_func;
       const char *bundle_path;
 
       Entry name;
@@ -427,18 +433,21 @@ class Presets : public Frame
             name.set_text(name_str);
             author.set_text(author_str);
 
-            const float *values = params.amp;
+            // The plugin loads the preset itself, so a patch change is one message rather than a write per port.
+            preset_func(buffer, [&] {
+               const float *values = params.amp;
 
-            set_parameter(peg_volume, global_params.volume);
-            set_parameter(peg_lfofreq, global_params.lfo_freq);
-            for (unsigned p = 0; p < FMSYNTH_PARAM_END; p++)
-            {
-               for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+               set_parameter(peg_volume, global_params.volume);
+               set_parameter(peg_lfofreq, global_params.lfo_freq);
+               for (unsigned p = 0; p < FMSYNTH_PARAM_END; p++)
                {
-                  set_parameter(peg_amp__op__0_ + (peg_amp__op__1_ - peg_amp__op__0_) * o + p,
-                        values[p * FMSYNTH_OPERATORS + o]);
+                  for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+                  {
+                     set_parameter(peg_amp__op__0_ + (peg_amp__op__1_ - peg_amp__op__0_) * o + p,
+                           values[p * FMSYNTH_OPERATORS + o]);
+                  }
                }
-            }
+            });
          }
          else
             throw std::runtime_error("Failed to parse preset.");
@@ -509,7 +518,6 @@ class Presets : public Frame
          auto func = events[id];
          if (func)
             func(value);
-         lv2_func(id, value);
       }
 
       float get_parameter(uint32_t id)
@@ -729,7 +737,23 @@ class FMSynthGUI : public lvtk::UI<FMSynthGUI, lvtk::GtkUI<true>, lvtk::URID<tru
    public:
       FMSynthGUI(const std::string&)
       {
-         auto write_ctrl = [this](uint32_t port, float value) { write_control(port, value); };
+         auto write_ctrl = [this](uint32_t port, float value) {
+            write_control(port, value);
+         };
+
+         // The preset is swapped in as a whole by the plugin.
+         // Widgets still write their ports so the host's control values stay in sync.
+         // The plugin holds back port changes until the preset is swapped in,
+         // then skips the ones which match it.
+         auto write_preset = [this](const std::vector<uint8_t>& preset, const std::function<void ()>& update_widgets) {
+            std::vector<uint8_t> buffer(sizeof(LV2_Atom) + preset.size());
+            LV2_Atom atom = { uint32_t(preset.size()), uint32_t(map(FMSYNTH_PRESET_URI)) };
+            memcpy(buffer.data(), &atom, sizeof(atom));
+            memcpy(buffer.data() + sizeof(atom), preset.data(), preset.size());
+            write(peg_midi, buffer.size(), map(LV2_ATOM__eventTransfer), buffer.data());
+
+            update_widgets();
+         };
 
          auto hbox = manage(new HBox);
 
@@ -749,7 +773,7 @@ class FMSynthGUI : public lvtk::UI<FMSynthGUI, lvtk::GtkUI<true>, lvtk::URID<tru
          auto top_hbox = manage(new HBox);
 
          top_hbox->add(*manage(new BasicParameters(event_map, value_map, write_ctrl)));
-         top_hbox->add(*manage(new Presets(bundle_path(), event_map, value_map, write_ctrl)));
+         top_hbox->add(*manage(new Presets(bundle_path(), event_map, value_map, write_preset)));
 
          vbox->pack_start(*top_hbox);
          vbox->pack_start(*notebook);
@@ -18,19 +18,44 @@
 
 #include "fmsynth.h"
 #include "fmsynth.peg"
+#include "fmsynth_uris.hpp"
 
 #include <lvtk/plugin.hpp>
+#include <lvtk/ext/state.hpp>
+#include <lvtk/ext/worker.hpp>
+#include <lv2/lv2plug.in/ns/ext/atom/util.h>
 #include <cstring>
 #include <stdexcept>
 #include <cstdio>
+#include <vector>
 
-struct FMSynth : public lvtk::Plugin<FMSynth, lvtk::URID<true>>
+struct FMSynth : public lvtk::Plugin<FMSynth, lvtk::URID<true>, lvtk::State<false>, lvtk::Worker<false>>
 {
-   using Parent = lvtk::Plugin<FMSynth, lvtk::URID<true>>;
+   using Parent = lvtk::Plugin<FMSynth, lvtk::URID<true>, lvtk::State<false>, lvtk::Worker<false>>;
 
-   FMSynth(double rate) : Parent(peg_n_ports)
+   // Requests to the worker thread.
+   // Presets are parsed into patches off the audio thread, and patches are freed there after they are applied.
+   struct WorkMessage
+   {
+      enum Type : uint32_t { LoadPreset, FreePatch } type;
+      fmsynth_patch_t *patch;
+   };
+
+   FMSynth(double rate) : Parent(peg_n_ports), m_rate(uint32_t(rate))
    {
       m_midi_type = map(LV2_MIDI__MidiEvent);
+      m_preset_type = map(FMSYNTH_PRESET_URI);
+      m_preset_key = map(FMSYNTH_STATE_PRESET_URI);
+      m_chunk_type = map(LV2_ATOM__Chunk);
+
+      // Ports and presets are laid out for the operator count this plugin was built with.
+      if (fmsynth_get_max_operators() != FMSYNTH_OPERATORS)
+      {
+         throw std::runtime_error("libfmsynth was built with a different operator count.");
+      }
+
+      // Preallocated, so requests can be built on the audio thread.
+      m_work_buffer.resize(sizeof(WorkMessage) + FMSYNTH_MAX_PRESET_SIZE);
 
       fm = fmsynth_new(rate, 128);
       if (fm == nullptr)
@@ -54,19 +79,182 @@ struct FMSynth : public lvtk::Plugin<FMSynth, lvtk::URID<true>>
       return clamp(*p(index), peg_ports[index].min, peg_ports[index].max);
    }
 
-   void update_parameters()
+   // A port is applied when the host changed it since the last run,
+   // and the new value differs from the parameter in use.
+   // Ports the host has not touched yet do not override a preset which was loaded as a whole,
+   // and ports which only echo that preset back are no-ops.
+   bool port_changed(unsigned index, float current)
+   {
+      float value = get_param(index);
+      if (m_ports_valid && value == m_ports[index])
+      {
+         return false;
+      }
+
+      m_ports[index] = value;
+      return value != current;
+   }
+
+   void update_parameters(uint32_t sample_count)
    {
-      fmsynth_set_global_parameter(fm, FMSYNTH_GLOBAL_PARAM_VOLUME, get_param(peg_volume));
-      fmsynth_set_global_parameter(fm, FMSYNTH_GLOBAL_PARAM_LFO_FREQ, get_param(peg_lfofreq));
+      // While a preset is parsed on the worker, port changes are left alone.
+      // They are compared against the preset once it is swapped in.
+      // If the response never arrives, stop waiting after a second.
+      if (m_preset_pending)
+      {
+         if (m_preset_pending > sample_count)
+         {
+            m_preset_pending -= sample_count;
+            return;
+         }
+         m_preset_pending = 0;
+      }
+
+      if (port_changed(peg_volume, fmsynth_get_global_parameter(fm, FMSYNTH_GLOBAL_PARAM_VOLUME)))
+      {
+         fmsynth_set_global_parameter(fm, FMSYNTH_GLOBAL_PARAM_VOLUME, m_ports[peg_volume]);
+      }
+      if (port_changed(peg_lfofreq, fmsynth_get_global_parameter(fm, FMSYNTH_GLOBAL_PARAM_LFO_FREQ)))
+      {
+         fmsynth_set_global_parameter(fm, FMSYNTH_GLOBAL_PARAM_LFO_FREQ, m_ports[peg_lfofreq]);
+      }
 
       for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
       {
          unsigned base_port = peg_amp__op__0_ + o * (peg_amp__op__1_ - peg_amp__op__0_);
          for (unsigned i = 0; i < peg_amp__op__1_ - peg_amp__op__0_; i++)
          {
-            fmsynth_set_parameter(fm, i, o, get_param(i + base_port));
+            if (port_changed(i + base_port, fmsynth_get_parameter(fm, i, o)))
+            {
+               fmsynth_set_parameter(fm, i, o, m_ports[i + base_port]);
+            }
          }
       }
+
+      m_ports_valid = true;
+   }
+
+   void load_preset(const void *data, uint32_t size)
+   {
+      if (size > FMSYNTH_MAX_PRESET_SIZE)
+      {
+         return;
+      }
+
+      WorkMessage msg = { WorkMessage::LoadPreset, nullptr };
+      std::memcpy(m_work_buffer.data(), &msg, sizeof(msg));
+      std::memcpy(m_work_buffer.data() + sizeof(msg), data, size);
+
+      if (schedule_work(sizeof(msg) + size, m_work_buffer.data()) == lvtk::WORKER_SUCCESS)
+      {
+         m_preset_pending = m_rate;
+      }
+      else
+      {
+         // Host without worker support, parse on the audio thread instead.
+         fmsynth_preset_load(fm, nullptr, data, size);
+      }
+   }
+
+   lvtk::WorkerStatus work(lvtk::WorkerRespond &respond, uint32_t size, const void *data)
+   {
+      WorkMessage msg;
+      if (size < sizeof(msg))
+      {
+         return lvtk::WORKER_ERR_UNKNOWN;
+      }
+      std::memcpy(&msg, data, sizeof(msg));
+
+      switch (msg.type)
+      {
+         case WorkMessage::LoadPreset:
+         {
+            // Invalid presets respond with no patch, so the audio thread stops waiting for one.
+            fmsynth_patch_t *patch = fmsynth_patch_new();
+            if (patch != nullptr && fmsynth_patch_load(patch, nullptr,
+                     static_cast<const uint8_t*>(data) + sizeof(msg), size - sizeof(msg)) != FMSYNTH_STATUS_OK)
+            {
+               fmsynth_patch_free(patch);
+               patch = nullptr;
+            }
+
+            lvtk::WorkerStatus status = respond(sizeof(patch), &patch);
+            if (status != lvtk::WORKER_SUCCESS && patch != nullptr)
+            {
+               fmsynth_patch_free(patch);
+            }
+            return status;
+         }
+
+         case WorkMessage::FreePatch:
+            fmsynth_patch_free(msg.patch);
+            return lvtk::WORKER_SUCCESS;
+      }
+
+      return lvtk::WORKER_ERR_UNKNOWN;
+   }
+
+   // On the audio thread, between runs. Applying the parsed preset is a single copy.
+   lvtk::WorkerStatus work_response(uint32_t size, const void *body)
+   {
+      fmsynth_patch_t *patch;
+      if (size != sizeof(patch))
+      {
+         return lvtk::WORKER_ERR_UNKNOWN;
+      }
+      std::memcpy(&patch, body, sizeof(patch));
+
+      m_preset_pending = 0;
+      if (patch == nullptr)
+      {
+         return lvtk::WORKER_SUCCESS;
+      }
+
+      fmsynth_patch_apply(fm, patch);
+
+      WorkMessage msg = { WorkMessage::FreePatch, patch };
+      return schedule_work(sizeof(msg), &msg);
+   }
+
+   // Parameters are saved as a binary preset, which also covers presets loaded without port updates.
+   // Parameters are plain floats, so a save concurrent with run() sees each one either before or after a change.
+   lvtk::StateStatus save(lvtk::StateStore &store, uint32_t, const lvtk::FeatureVec &)
+   {
+      std::vector<uint8_t> buffer(fmsynth_preset_size());
+      struct fmsynth_preset_metadata metadata;
+      std::memset(&metadata, 0, sizeof(metadata));
+
+      if (fmsynth_preset_save(fm, &metadata, buffer.data(), buffer.size()) != FMSYNTH_STATUS_OK)
+      {
+         return lvtk::STATE_ERR_UNKNOWN;
+      }
+
+      return store(m_preset_key, buffer.data(), buffer.size(), m_chunk_type,
+            lvtk::STATE_IS_POD | lvtk::STATE_IS_PORTABLE);
+   }
+
+   lvtk::StateStatus restore(lvtk::StateRetrieve &retrieve, uint32_t, const lvtk::FeatureVec &)
+   {
+      size_t size = 0;
+      uint32_t type = 0;
+      const void *data = retrieve(m_preset_key, &size, &type);
+
+      if (data == nullptr)
+      {
+         return lvtk::STATE_ERR_NO_PROPERTY;
+      }
+      if (type != m_chunk_type)
+      {
+         return lvtk::STATE_ERR_BAD_TYPE;
+      }
+
+      // Restore is never called concurrently with run(), so load directly.
+      if (fmsynth_preset_load(fm, nullptr, data, size) != FMSYNTH_STATUS_OK)
+      {
+         return lvtk::STATE_ERR_UNKNOWN;
+      }
+
+      return lvtk::STATE_SUCCESS;
    }
 
    void run(uint32_t sample_count)
@@ -80,11 +268,24 @@ struct FMSynth : public lvtk::Plugin<FMSynth, lvtk::URID<true>>
       std::memset(left, 0, sample_count * sizeof(float));
       std::memset(right, 0, sample_count * sizeof(float));
 
+      // Presets are scheduled before ports are read,
+      // so port updates sent along with a preset wait for it instead of being applied one by one.
+      for (LV2_Atom_Event *ev = lv2_atom_sequence_begin(&seq->body);
+            !lv2_atom_sequence_is_end(&seq->body, seq->atom.size, ev);
+            ev = lv2_atom_sequence_next(ev))
+      {
+         if (ev->body.type == m_preset_type)
+         {
+            load_preset(LV2_ATOM_BODY(&ev->body), ev->body.size);
+         }
+      }
+
+      update_parameters(sample_count);
+
       for (LV2_Atom_Event *ev = lv2_atom_sequence_begin(&seq->body);
             !lv2_atom_sequence_is_end(&seq->body, seq->atom.size, ev);
             ev = lv2_atom_sequence_next(ev))
       {
-         update_parameters();
          uint32_t to = ev->time.frames;
 
          if (to > samples_done)
@@ -124,7 +325,17 @@ struct FMSynth : public lvtk::Plugin<FMSynth, lvtk::URID<true>>
 
    fmsynth_t *fm;
    LV2_URID m_midi_type;
-};
+   LV2_URID m_preset_type;
+   LV2_URID m_preset_key;
+   LV2_URID m_chunk_type;
 
-int fmsynth_register = FMSynth::register_class("git://github.com/Themaister/fmsynth");
+   std::vector<uint8_t> m_work_buffer;
+   float m_ports[peg_n_ports];
+   bool m_ports_valid = false;
+
+   // Frames left to wait for a preset scheduled on the worker, 0 when none is pending.
+   uint32_t m_preset_pending = 0;
+   uint32_t m_rate;
+};
 
+int fmsynth_register = FMSynth::register_class(FMSYNTH_URI);
@@ -0,0 +1,36 @@
+/* Copyright (C) 2014 Hans-Kristian Arntzen <maister@archlinux.us>
+ *
+ * Permission is hereby granted, free of charge,
+ * to any person obtaining a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FMSYNTH_URIS_HPP__
+#define FMSYNTH_URIS_HPP__
+
+// URIs shared by the plugin and the GUI.
+
+#define FMSYNTH_URI "git://github.com/Themaister/fmsynth"
+
+// Atom type of a binary preset, as written by fmsynth_preset_save().
+// The GUI sends presets to the MIDI input of the plugin as one atom of this type.
+#define FMSYNTH_PRESET_URI FMSYNTH_URI "#Preset"
+
+// State key under which the current parameters are saved as a binary preset.
+#define FMSYNTH_STATE_PRESET_URI FMSYNTH_URI "#preset"
+
+// Largest preset the plugin accepts, enough for 16 operators.
+#define FMSYNTH_MAX_PRESET_SIZE 8192
+
+#endif
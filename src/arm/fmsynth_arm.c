@@ -18,19 +18,21 @@
 
 #define FMSYNTH_NEON_ASM 1
 
+#include <arm_neon.h>
+
 #if FMSYNTH_NEON_ASM
 void fmsynth_process_frames_neon(const float *mod_to_carriers,
       const float *voice, float *left, float *right, unsigned frames);
 
-static void fmsynth_process_frames(fmsynth_t *fm,
+static void fmsynth_process_frames_simd(const struct fmsynth_voice_parameters *params,
       struct fmsynth_voice *voice, float *oleft, float *oright,
       unsigned frames)
 {
-   fmsynth_process_frames_neon(fm->params.mod_to_carriers[0], voice->phases,
+   fmsynth_process_frames_neon(params->mod_to_carriers[0], voice->phases,
          oleft, oright, frames);
 }
-#else
-#include <arm_neon.h>
+#endif
+
 static inline float32x4_t floor_neon(float32x4_t a)
 {
 #if __ARM_ARCH >= 8
@@ -48,128 +50,284 @@ static inline float32x4_t floor_neon(float32x4_t a)
 #endif
 }
 
-static void fmsynth_process_frames(fmsynth_t * restrict fm_,
-      struct fmsynth_voice * restrict voice_, float * restrict oleft_, float * restrict oright_, unsigned frames)
+// One frame of one voice. Returns the left mix in lane 0 and the right mix in lane 1.
+// Mono voices only compute the mix with amp, and return it in both lanes.
+static FMSYNTH_ALWAYS_INLINE float32x2_t fmsynth_step_neon(
+      const struct fmsynth_voice_parameters * restrict params,
+      const struct fmsynth_voice * restrict voice, const float *amp,
+      float32x4_t *phases, float32x4_t *env, bool mono)
 {
-   fmsynth_t *fm = FMSYNTH_ASSUME_ALIGNED(fm_, 16);
-   struct fmsynth_voice *voice = FMSYNTH_ASSUME_ALIGNED(voice_, 16);
-   float *oleft = FMSYNTH_ASSUME_ALIGNED(oleft_, 16);
-   float *oright = FMSYNTH_ASSUME_ALIGNED(oright_, 16);
-
-   float32x4_t phases0 = vld1q_f32(voice->phases + 0);
-   float32x4_t phases1 = vld1q_f32(voice->phases + 4);
-
-   float32x4_t env0 = vld1q_f32(voice->env + 0);
-   float32x4_t env1 = vld1q_f32(voice->env + 4);
+   float32x4_t phases0 = phases[0];
+   float32x4_t phases1 = phases[1];
+   float32x4_t env0 = env[0];
+   float32x4_t env1 = env[1];
 
    const float32x4_t step_rate0 = vld1q_f32(voice->step_rate + 0);
    const float32x4_t step_rate1 = vld1q_f32(voice->step_rate + 4);
 
-   for (unsigned f = 0; f < frames; f++)
+   const float32x4_t c_sub = vdupq_n_f32(0.25f);
+   const float32x4_t c_cmp = vdupq_n_f32(0.5f);
+   const float32x4_t c_greater = vdupq_n_f32(0.75f);
+
+   float32x4_t x0 = vsubq_f32(phases0, c_sub);
+   float32x4_t x1 = vsubq_f32(phases1, c_sub);
+   uint32x4_t cmp0 = vcltq_f32(phases0, c_cmp);
+   uint32x4_t cmp1 = vcltq_f32(phases1, c_cmp);
+   float32x4_t greater0 = vsubq_f32(c_greater, phases0);
+   float32x4_t greater1 = vsubq_f32(c_greater, phases1);
+   x0 = vreinterpretq_f32_u32(
+         vorrq_u32(vandq_u32(cmp0, vreinterpretq_u32_f32(x0)),
+            vbicq_u32(vreinterpretq_u32_f32(greater0), cmp0)));
+   x1 = vreinterpretq_f32_u32(
+         vorrq_u32(vandq_u32(cmp1, vreinterpretq_u32_f32(x1)),
+            vbicq_u32(vreinterpretq_u32_f32(greater1), cmp1)));
+
+   // Compute sine approximation.
    {
-      const float32x4_t c_sub = vdupq_n_f32(0.25f);
-      const float32x4_t c_cmp = vdupq_n_f32(0.5f);
-      const float32x4_t c_greater = vdupq_n_f32(0.75f);
-
-      float32x4_t x0 = vsubq_f32(phases0, c_sub);
-      float32x4_t x1 = vsubq_f32(phases1, c_sub);
-      uint32x4_t cmp0 = vcltq_f32(phases0, c_cmp);
-      uint32x4_t cmp1 = vcltq_f32(phases1, c_cmp);
-      float32x4_t greater0 = vsubq_f32(c_greater, phases0);
-      float32x4_t greater1 = vsubq_f32(c_greater, phases1);
-      x0 = vreinterpretq_f32_u32(
-            vorrq_u32(vandq_u32(cmp0, vreinterpretq_u32_f32(x0)),
-               vbicq_u32(vreinterpretq_u32_f32(greater0), cmp0)));
-      x1 = vreinterpretq_f32_u32(
-            vorrq_u32(vandq_u32(cmp1, vreinterpretq_u32_f32(x1)),
-               vbicq_u32(vreinterpretq_u32_f32(greater1), cmp1)));
-
-      // Compute sine approximation.
-      {
-         const float32x4_t fact3 = vdupq_n_f32(INV_FACTORIAL_3_2PIPOW3);
-         const float32x4_t fact5 = vdupq_n_f32(INV_FACTORIAL_5_2PIPOW5);
-         const float32x4_t fact7 = vdupq_n_f32(INV_FACTORIAL_7_2PIPOW7);
+      const float32x4_t fact3 = vdupq_n_f32(INV_FACTORIAL_3_2PIPOW3);
+      const float32x4_t fact5 = vdupq_n_f32(INV_FACTORIAL_5_2PIPOW5);
+      const float32x4_t fact7 = vdupq_n_f32(INV_FACTORIAL_7_2PIPOW7);
 
-         float32x4_t x20 = vmulq_f32(x0, x0);
-         float32x4_t x21 = vmulq_f32(x1, x1);
-         float32x4_t x30 = vmulq_f32(x0, x20);
-         float32x4_t x31 = vmulq_f32(x1, x21);
+      float32x4_t x20 = vmulq_f32(x0, x0);
+      float32x4_t x21 = vmulq_f32(x1, x1);
+      float32x4_t x30 = vmulq_f32(x0, x20);
+      float32x4_t x31 = vmulq_f32(x1, x21);
 
-         x0 = vmulq_n_f32(x0, 2.0f * PI);
-         x1 = vmulq_n_f32(x1, 2.0f * PI);
+      x0 = vmulq_n_f32(x0, 2.0f * PI);
+      x1 = vmulq_n_f32(x1, 2.0f * PI);
 
-         x0 = vmlsq_f32(x0, x30, fact3);
-         x1 = vmlsq_f32(x1, x31, fact3);
+      x0 = vmlsq_f32(x0, x30, fact3);
+      x1 = vmlsq_f32(x1, x31, fact3);
 
-         x30 = vmulq_f32(x30, x20);
-         x31 = vmulq_f32(x31, x21);
+      x30 = vmulq_f32(x30, x20);
+      x31 = vmulq_f32(x31, x21);
 
-         x0 = vmlaq_f32(x0, x30, fact5);
-         x1 = vmlaq_f32(x1, x31, fact5);
+      x0 = vmlaq_f32(x0, x30, fact5);
+      x1 = vmlaq_f32(x1, x31, fact5);
 
-         x30 = vmulq_f32(x30, x20);
-         x31 = vmulq_f32(x31, x21);
+      x30 = vmulq_f32(x30, x20);
+      x31 = vmulq_f32(x31, x21);
 
-         x0 = vmlsq_f32(x0, x30, fact7);
-         x1 = vmlsq_f32(x1, x31, fact7);
-      }
+      x0 = vmlsq_f32(x0, x30, fact7);
+      x1 = vmlsq_f32(x1, x31, fact7);
+   }
 
-      x0 = vmulq_f32(x0, vmulq_f32(vld1q_f32(voice->read_mod + 0), env0));
-      x1 = vmulq_f32(x1, vmulq_f32(vld1q_f32(voice->read_mod + 4), env1));
+   x0 = vmulq_f32(x0, vmulq_f32(vld1q_f32(voice->read_mod + 0), env0));
+   x1 = vmulq_f32(x1, vmulq_f32(vld1q_f32(voice->read_mod + 4), env1));
 
-      env0 = vaddq_f32(env0, vld1q_f32(voice->target_env_step + 0));
-      env1 = vaddq_f32(env1, vld1q_f32(voice->target_env_step + 4));
+   env0 = vaddq_f32(env0, vld1q_f32(voice->target_env_step + 0));
+   env1 = vaddq_f32(env1, vld1q_f32(voice->target_env_step + 4));
 
-      float32x4_t xmod0 = vmulq_f32(x0, step_rate0);
-      float32x4_t xmod1 = vmulq_f32(x1, step_rate1);
+   float32x4_t xmod0 = vmulq_f32(x0, step_rate0);
+   float32x4_t xmod1 = vmulq_f32(x1, step_rate1);
 
-      float32x4_t steps0 = vmulq_f32(step_rate0, vld1q_f32(voice->lfo_freq_mod + 0));
-      float32x4_t steps1 = vmulq_f32(step_rate1, vld1q_f32(voice->lfo_freq_mod + 4));
-      const float *vec;
+   float32x4_t steps0 = vmulq_f32(step_rate0, vld1q_f32(voice->lfo_freq_mod + 0));
+   float32x4_t steps1 = vmulq_f32(step_rate1, vld1q_f32(voice->lfo_freq_mod + 4));
+   const float *vec;
 
 #define MAT_ACCUMULATE(steps0, steps1, i, scalar, index) \
-      vec = fm->params.mod_to_carriers[i]; \
-      steps0 = vmlaq_lane_f32(steps0, vld1q_f32(vec + 0), scalar, index); \
-      steps1 = vmlaq_lane_f32(steps1, vld1q_f32(vec + 4), scalar, index)
-
-      MAT_ACCUMULATE(steps0, steps1, 0,  vget_low_f32(xmod0), 0);
-      MAT_ACCUMULATE(phases0, phases1, 1,  vget_low_f32(xmod0), 1);
-      MAT_ACCUMULATE(steps0, steps1, 2, vget_high_f32(xmod0), 0);
-      MAT_ACCUMULATE(phases0, phases1, 3, vget_high_f32(xmod0), 1);
-      MAT_ACCUMULATE(steps0, steps1, 4,  vget_low_f32(xmod1), 0);
-      MAT_ACCUMULATE(phases0, phases1, 5,  vget_low_f32(xmod1), 1);
-      MAT_ACCUMULATE(steps0, steps1, 6, vget_high_f32(xmod1), 0);
-      MAT_ACCUMULATE(phases0, phases1, 7, vget_high_f32(xmod1), 1);
+   vec = params->mod_to_carriers[i]; \
+   steps0 = vmlaq_lane_f32(steps0, vld1q_f32(vec + 0), scalar, index); \
+   steps1 = vmlaq_lane_f32(steps1, vld1q_f32(vec + 4), scalar, index)
+
+   MAT_ACCUMULATE(steps0, steps1, 0,  vget_low_f32(xmod0), 0);
+   MAT_ACCUMULATE(phases0, phases1, 1,  vget_low_f32(xmod0), 1);
+   MAT_ACCUMULATE(steps0, steps1, 2, vget_high_f32(xmod0), 0);
+   MAT_ACCUMULATE(phases0, phases1, 3, vget_high_f32(xmod0), 1);
+   MAT_ACCUMULATE(steps0, steps1, 4,  vget_low_f32(xmod1), 0);
+   MAT_ACCUMULATE(phases0, phases1, 5,  vget_low_f32(xmod1), 1);
+   MAT_ACCUMULATE(steps0, steps1, 6, vget_high_f32(xmod1), 0);
+   MAT_ACCUMULATE(phases0, phases1, 7, vget_high_f32(xmod1), 1);
 #undef MAT_ACCUMULATE
 
-      float32x4_t left  = vmulq_f32(x0, vld1q_f32(voice->pan_amp[0] + 0));
-      float32x4_t right = vmulq_f32(x0, vld1q_f32(voice->pan_amp[1] + 0));
+   float32x4_t left = vmulq_f32(x0, vld1q_f32(amp + 0));
+   float32x4_t right = left;
+   if (!mono)
+   {
+      right = vmulq_f32(x0, vld1q_f32(voice->pan_amp[1] + 0));
+   }
 
-      phases0 = vaddq_f32(phases0, steps0);
-      phases1 = vaddq_f32(phases1, steps1);
+   phases0 = vaddq_f32(phases0, steps0);
+   phases1 = vaddq_f32(phases1, steps1);
 
-      left  = vmlaq_f32(left, x1, vld1q_f32(voice->pan_amp[0] + 4));
+   left = vmlaq_f32(left, x1, vld1q_f32(amp + 4));
+   if (!mono)
+   {
       right = vmlaq_f32(right, x1, vld1q_f32(voice->pan_amp[1] + 4));
+   }
 
-      phases0 = vsubq_f32(phases0, floor_neon(phases0));
-      phases1 = vsubq_f32(phases1, floor_neon(phases1));
+   phases[0] = vsubq_f32(phases0, floor_neon(phases0));
+   phases[1] = vsubq_f32(phases1, floor_neon(phases1));
+   env[0] = env0;
+   env[1] = env1;
 
-      float32x2_t hleft = vadd_f32(vget_low_f32(left), vget_high_f32(left));
-      float32x2_t hright = vadd_f32(vget_low_f32(right), vget_high_f32(right));
-      float32x2_t out = vpadd_f32(hleft, hright);
+   float32x2_t hleft = vadd_f32(vget_low_f32(left), vget_high_f32(left));
+   if (mono)
+   {
+      return vpadd_f32(hleft, hleft);
+   }
+   float32x2_t hright = vadd_f32(vget_low_f32(right), vget_high_f32(right));
+   return vpadd_f32(hleft, hright);
+}
+
+static FMSYNTH_ALWAYS_INLINE void fmsynth_load_state_neon(const struct fmsynth_voice *voice,
+      float32x4_t *phases, float32x4_t *env)
+{
+   phases[0] = vld1q_f32(voice->phases + 0);
+   phases[1] = vld1q_f32(voice->phases + 4);
+   env[0] = vld1q_f32(voice->env + 0);
+   env[1] = vld1q_f32(voice->env + 4);
+}
+
+static FMSYNTH_ALWAYS_INLINE void fmsynth_store_state_neon(struct fmsynth_voice *voice,
+      const float32x4_t *phases, const float32x4_t *env)
+{
+   vst1q_f32(voice->phases + 0, phases[0]);
+   vst1q_f32(voice->phases + 4, phases[1]);
+   vst1q_f32(voice->env + 0, env[0]);
+   vst1q_f32(voice->env + 4, env[1]);
+}
+
+// In mono, oright aliases oleft and only the left mix is stored.
+static FMSYNTH_ALWAYS_INLINE void fmsynth_accumulate_neon(float *oleft, float *oright, float32x2_t out, bool mono)
+{
+   if (mono)
+   {
+      vst1_lane_f32(oleft, vadd_f32(vld1_dup_f32(oleft), out), 0);
+      return;
+   }
+
+   float32x2_t current = vld1_dup_f32(oleft);
+   current = vld1_lane_f32(oright, current, 1);
+
+   out = vadd_f32(current, out);
+   vst1_lane_f32(oleft, out, 0);
+   vst1_lane_f32(oright, out, 1);
+}
+
+static FMSYNTH_ALWAYS_INLINE void fmsynth_process_frames_intrinsics(
+      const struct fmsynth_voice_parameters * restrict params_,
+      struct fmsynth_voice * restrict voice_, float *oleft, float *oright, unsigned frames, bool mono)
+{
+   const struct fmsynth_voice_parameters *params = FMSYNTH_ASSUME_ALIGNED(params_, 16);
+   struct fmsynth_voice *voice = FMSYNTH_ASSUME_ALIGNED(voice_, 16);
+
+   float32x4_t phases[2];
+   float32x4_t env[2];
+   FMSYNTH_ALIGNED_CACHE_PRE float mono_amp[FMSYNTH_OPERATORS] FMSYNTH_ALIGNED_CACHE_POST;
+   const float *amp = fmsynth_voice_mix_amp(voice, mono_amp, FMSYNTH_OPERATORS,
+         mono ? FMSYNTH_MIX_MONO : FMSYNTH_MIX_STEREO);
+   fmsynth_load_state_neon(voice, phases, env);
+
+   for (unsigned f = 0; f < frames; f++)
+   {
+      fmsynth_accumulate_neon(oleft + f, oright + f,
+            fmsynth_step_neon(params, voice, amp, phases, env, mono), mono);
+   }
+
+   fmsynth_store_state_neon(voice, phases, env);
+}
+
+// Two independent voices in one loop, so each hides the latency of the other's
+// oscillator, modulation and phase update chain.
+// Voice a is mixed before voice b, like rendering them one after another.
+static FMSYNTH_ALWAYS_INLINE void fmsynth_process_frames_pair_intrinsics(
+      const struct fmsynth_voice_parameters * restrict params_a_, struct fmsynth_voice * restrict voice_a_,
+      const struct fmsynth_voice_parameters * restrict params_b_, struct fmsynth_voice * restrict voice_b_,
+      float *oleft, float *oright, unsigned frames, bool mono)
+{
+   const struct fmsynth_voice_parameters *params_a = FMSYNTH_ASSUME_ALIGNED(params_a_, 16);
+   const struct fmsynth_voice_parameters *params_b = FMSYNTH_ASSUME_ALIGNED(params_b_, 16);
+   struct fmsynth_voice *voice_a = FMSYNTH_ASSUME_ALIGNED(voice_a_, 16);
+   struct fmsynth_voice *voice_b = FMSYNTH_ASSUME_ALIGNED(voice_b_, 16);
+
+   float32x4_t phases_a[2];
+   float32x4_t env_a[2];
+   float32x4_t phases_b[2];
+   float32x4_t env_b[2];
+   FMSYNTH_ALIGNED_CACHE_PRE float mono_amp_a[FMSYNTH_OPERATORS] FMSYNTH_ALIGNED_CACHE_POST;
+   FMSYNTH_ALIGNED_CACHE_PRE float mono_amp_b[FMSYNTH_OPERATORS] FMSYNTH_ALIGNED_CACHE_POST;
+   enum fmsynth_mix mix = mono ? FMSYNTH_MIX_MONO : FMSYNTH_MIX_STEREO;
+   const float *amp_a = fmsynth_voice_mix_amp(voice_a, mono_amp_a, FMSYNTH_OPERATORS, mix);
+   const float *amp_b = fmsynth_voice_mix_amp(voice_b, mono_amp_b, FMSYNTH_OPERATORS, mix);
+   fmsynth_load_state_neon(voice_a, phases_a, env_a);
+   fmsynth_load_state_neon(voice_b, phases_b, env_b);
+
+   for (unsigned f = 0; f < frames; f++)
+   {
+      float32x2_t out_a = fmsynth_step_neon(params_a, voice_a, amp_a, phases_a, env_a, mono);
+      float32x2_t out_b = fmsynth_step_neon(params_b, voice_b, amp_b, phases_b, env_b, mono);
 
       float32x2_t current = vld1_dup_f32(oleft + f);
-      current = vld1_lane_f32(oright + f, current, 1);
+      if (!mono)
+      {
+         current = vld1_lane_f32(oright + f, current, 1);
+      }
 
-      out = vadd_f32(out, current);
+      float32x2_t out = vadd_f32(vadd_f32(current, out_a), out_b);
       vst1_lane_f32(oleft + f, out, 0);
-      vst1_lane_f32(oright + f, out, 1);
+      if (!mono)
+      {
+         vst1_lane_f32(oright + f, out, 1);
+      }
    }
 
-   vst1q_f32(voice->phases + 0, phases0);
-   vst1q_f32(voice->phases + 4, phases1);
-   vst1q_f32(voice->env + 0, env0);
-   vst1q_f32(voice->env + 4, env1);
+   fmsynth_store_state_neon(voice_a, phases_a, env_a);
+   fmsynth_store_state_neon(voice_b, phases_b, env_b);
+}
+
+#if !FMSYNTH_NEON_ASM
+static void fmsynth_process_frames_simd(const struct fmsynth_voice_parameters *params,
+      struct fmsynth_voice *voice, float *oleft, float *oright, unsigned frames)
+{
+   fmsynth_process_frames_intrinsics(params, voice, oleft, oright, frames, false);
 }
 #endif
 
+// With the assembly kernel, mono and paired voices are still rendered with the intrinsics.
+static void fmsynth_process_frames_simd_mono(const struct fmsynth_voice_parameters *params,
+      struct fmsynth_voice *voice, float *oleft, float *oright, unsigned frames)
+{
+   fmsynth_process_frames_intrinsics(params, voice, oleft, oright, frames, true);
+}
+
+static void fmsynth_process_frames_pair_simd(
+      const struct fmsynth_voice_parameters *params_a, struct fmsynth_voice *voice_a,
+      const struct fmsynth_voice_parameters *params_b, struct fmsynth_voice *voice_b,
+      float *oleft, float *oright, unsigned frames)
+{
+   fmsynth_process_frames_pair_intrinsics(params_a, voice_a, params_b, voice_b, oleft, oright, frames, false);
+}
+
+static void fmsynth_process_frames_pair_simd_mono(
+      const struct fmsynth_voice_parameters *params_a, struct fmsynth_voice *voice_a,
+      const struct fmsynth_voice_parameters *params_b, struct fmsynth_voice *voice_b,
+      float *oleft, float *oright, unsigned frames)
+{
+   fmsynth_process_frames_pair_intrinsics(params_a, voice_a, params_b, voice_b, oleft, oright, frames, true);
+}
+
+// The NEON kernels have no reduced precision, centered, or 4 operator variants yet.
+// Centered voices use the stereo kernel.
+// Operators which an instance does not use are disabled, so they are silent in the 8 operator kernel.
+static const fmsynth_kernel_table_t fmsynth_process_frames_simd_tables[FMSYNTH_WIDTHS] = {
+   {
+      { fmsynth_process_frames_simd, fmsynth_process_frames_simd, fmsynth_process_frames_simd_mono },
+      { fmsynth_process_frames_simd, fmsynth_process_frames_simd, fmsynth_process_frames_simd_mono },
+   },
+   {
+      { fmsynth_process_frames_simd, fmsynth_process_frames_simd, fmsynth_process_frames_simd_mono },
+      { fmsynth_process_frames_simd, fmsynth_process_frames_simd, fmsynth_process_frames_simd_mono },
+   },
+};
+
+static const fmsynth_pair_kernel_table_t fmsynth_process_frames_simd_pair_tables[FMSYNTH_WIDTHS] = {
+   {
+      { fmsynth_process_frames_pair_simd, fmsynth_process_frames_pair_simd, fmsynth_process_frames_pair_simd_mono },
+      { fmsynth_process_frames_pair_simd, fmsynth_process_frames_pair_simd, fmsynth_process_frames_pair_simd_mono },
+   },
+   {
+      { fmsynth_process_frames_pair_simd, fmsynth_process_frames_pair_simd, fmsynth_process_frames_pair_simd_mono },
+      { fmsynth_process_frames_pair_simd, fmsynth_process_frames_pair_simd, fmsynth_process_frames_pair_simd_mono },
+   },
+};
@@ -16,6 +16,21 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+// For clock_gettime().
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+// Generated code is laid out for 8 operators.
+#if defined(FMSYNTH_JIT) && defined(__x86_64__) && defined(__linux__) && \
+   (!defined(FMSYNTH_OPERATORS) || FMSYNTH_OPERATORS == 8)
+#define FMSYNTH_HAVE_JIT
+#ifndef _DEFAULT_SOURCE
+// For MAP_ANONYMOUS.
+#define _DEFAULT_SOURCE
+#endif
+#endif
+
 #include "fmsynth_private.h"
 #include <stdbool.h>
 #include <stdlib.h>
@@ -23,6 +38,33 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <math.h>
+#include <time.h>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+// Flush-to-zero and denormals-are-zero.
+#define FMSYNTH_DENORMALS_BEGIN(var) \
+   unsigned var = _mm_getcsr(); \
+   _mm_setcsr(var | 0x8040)
+#define FMSYNTH_DENORMALS_END(var) _mm_setcsr(var)
+#elif defined(__aarch64__) && defined(__GNUC__)
+// FPCR.FZ
+#define FMSYNTH_DENORMALS_BEGIN(var) \
+   uint64_t var; \
+   __asm__ volatile("mrs %0, fpcr" : "=r"(var)); \
+   __asm__ volatile("msr fpcr, %0" : : "r"(var | (UINT64_C(1) << 24)))
+#define FMSYNTH_DENORMALS_END(var) __asm__ volatile("msr fpcr, %0" : : "r"(var))
+#else
+// ARMv7 NEON always flushes denormals.
+#define FMSYNTH_DENORMALS_BEGIN(var)
+#define FMSYNTH_DENORMALS_END(var)
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
 
 #ifndef max
 #define max(a, b) ((a) > (b) ? (a) : (b))
@@ -38,6 +80,7 @@
 #define FMSYNTH_ALIGNED_POST(x) __attribute__((aligned(x)))
 #define FMSYNTH_ALIGNED_CACHE_POST FMSYNTH_ALIGNED_POST(64)
 #define FMSYNTH_NOINLINE __attribute__((noinline))
+#define FMSYNTH_ALWAYS_INLINE inline __attribute__((always_inline))
 #define FMSYNTH_ASSUME_ALIGNED(x, align) __builtin_assume_aligned(x, align)
 #elif defined(_MSC_VER)
 #define FMSYNTH_ALIGNED_PRE(x) __declspec(align(x))
@@ -45,6 +88,7 @@
 #define FMSYNTH_ALIGNED_POST(x)
 #define FMSYNTH_ALIGNED_CACHE_POST
 #define FMSYNTH_NOINLINE __declspec(noinline)
+#define FMSYNTH_ALWAYS_INLINE __forceinline
 #define FMSYNTH_ASSUME_ALIGNED(x, align) x
 #else
 #define FMSYNTH_ALIGNED_PRE(x)
@@ -52,9 +96,42 @@
 #define FMSYNTH_ALIGNED_POST(x)
 #define FMSYNTH_ALIGNED_CACHE_POST
 #define FMSYNTH_NOINLINE
+#define FMSYNTH_ALWAYS_INLINE inline
 #define FMSYNTH_ASSUME_ALIGNED(x, align) x
 #endif
 
+#ifdef FMSYNTH_STATS
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define FMSYNTH_TICKS() __rdtsc()
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define FMSYNTH_TICKS() __rdtsc()
+#else
+#define FMSYNTH_TICKS() ((uint64_t)clock())
+#endif
+
+// Counters are only written from the rendering thread,
+// but can be read from any thread.
+#if defined(__GNUC__)
+#define FMSYNTH_STATS_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define FMSYNTH_STATS_STORE(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_RELAXED)
+#else
+#define FMSYNTH_STATS_LOAD(ptr) (*(volatile uint64_t*)(ptr))
+#define FMSYNTH_STATS_STORE(ptr, value) (*(volatile uint64_t*)(ptr) = (value))
+#endif
+
+#define FMSYNTH_STATS_BEGIN(var) uint64_t var = FMSYNTH_TICKS()
+#define FMSYNTH_STATS_ADD(fm, field, value) fmsynth_stats_add(&(fm)->stats.field, value)
+#define FMSYNTH_STATS_MAX(fm, field, value) fmsynth_stats_max(&(fm)->stats.field, value)
+#define FMSYNTH_STATS_TICKS(fm, field, var) FMSYNTH_STATS_ADD(fm, field, FMSYNTH_TICKS() - (var))
+#else
+#define FMSYNTH_STATS_BEGIN(var)
+#define FMSYNTH_STATS_ADD(fm, field, value)
+#define FMSYNTH_STATS_MAX(fm, field, value)
+#define FMSYNTH_STATS_TICKS(fm, field, var)
+#endif
+
 #undef PI
 #define PI 3.14159265359f
 
@@ -64,6 +141,21 @@
 
 #define FMSYNTH_FRAMES_PER_LFO 32
 
+// Parameter ramps which can run at the same time, see fmsynth_set_parameter_ramp().
+#define FMSYNTH_RAMPS 32
+
+// Envelopes which decay below this (-140 dB) are flushed to exact zero.
+#define FMSYNTH_ENVELOPE_FLOOR 1.0e-7f
+
+// Escalate when a block takes more than this fraction of the budget.
+#define FMSYNTH_GOVERNOR_HEADROOM 0.9
+// Step back down after this many consecutive blocks below FMSYNTH_GOVERNOR_RELAX_LOAD.
+#define FMSYNTH_GOVERNOR_RELAX_LOAD 0.5
+#define FMSYNTH_GOVERNOR_RELAX_BLOCKS 64
+// Control interval is FMSYNTH_FRAMES_PER_LFO << FMSYNTH_GOVERNOR_CONTROL_SHIFT at FMSYNTH_GOVERNOR_SLOW_CONTROL.
+#define FMSYNTH_GOVERNOR_CONTROL_SHIFT 2
+#define FMSYNTH_GOVERNOR_BUCKETS 32
+
 enum fmsynth_voice_state
 {
    FMSYNTH_VOICE_INACTIVE = 0,
@@ -72,12 +164,46 @@ enum fmsynth_voice_state
    FMSYNTH_VOICE_RELEASED
 };
 
+// Audio-rate state. Used in process_frames(), should be local in cache.
 struct fmsynth_voice
+{
+   FMSYNTH_ALIGNED_CACHE_PRE float phases[FMSYNTH_OPERATORS] FMSYNTH_ALIGNED_CACHE_POST;
+   float env[FMSYNTH_OPERATORS];
+   float read_mod[FMSYNTH_OPERATORS];
+   float target_env_step[FMSYNTH_OPERATORS];
+   float step_rate[FMSYNTH_OPERATORS];
+   float lfo_freq_mod[FMSYNTH_OPERATORS];
+   float pan_amp[2][FMSYNTH_OPERATORS];
+};
+
+// Control-rate state. Only touched every N samples or on note events.
+struct fmsynth_voice_control
 {
    enum fmsynth_voice_state state;
    uint8_t note;
-   uint8_t enable;
-   uint8_t dead;
+   uint8_t part;
+   // Bitmasks of operators.
+   uint16_t enable;
+   uint16_t dead;
+
+   // Every carrier is panned to center, so left and right are the same mix.
+   uint8_t centered;
+
+   // Set by the render governor.
+   uint8_t low_precision;
+   uint8_t control_shift;
+
+   // Set if an enabled operator is modulated by the LFO, otherwise LFO updates are skipped.
+   uint8_t lfo;
+
+#ifdef FMSYNTH_HAVE_JIT
+   // 1-based slot of generated code for the patch, 0 if the voice uses the static kernel.
+   uint8_t jit_slot;
+   uint32_t jit_generation;
+#endif
+
+   // Parameters which were active when the voice was triggered.
+   const struct fmsynth_voice_parameters *params;
 
    float base_freq;
    float env_speed;
@@ -86,17 +212,10 @@ struct fmsynth_voice
 
    float lfo_step;
    float lfo_phase;
+   // LFO value lfo_amp and lfo_freq_mod were last computed with.
+   float lfo_value;
    unsigned count;
 
-   // Used in process_frames(). Should be local in cache.
-   FMSYNTH_ALIGNED_CACHE_PRE float phases[FMSYNTH_OPERATORS] FMSYNTH_ALIGNED_CACHE_POST;
-   float env[FMSYNTH_OPERATORS];
-   float read_mod[FMSYNTH_OPERATORS];
-   float target_env_step[FMSYNTH_OPERATORS];
-   float step_rate[FMSYNTH_OPERATORS];
-   float lfo_freq_mod[FMSYNTH_OPERATORS];
-   float pan_amp[2][FMSYNTH_OPERATORS];
-
    // Using when updating envelope (every N sample).
    float falloff[FMSYNTH_OPERATORS];
    float end_time[FMSYNTH_OPERATORS];
@@ -108,26 +227,165 @@ struct fmsynth_voice
    float lerp[3][FMSYNTH_OPERATORS];
 
    float amp[FMSYNTH_OPERATORS];
+   // Velocity and keyboard scaling part of amp, so amp can follow parameter ramps.
+   float key_amp[FMSYNTH_OPERATORS];
    float wheel_amp[FMSYNTH_OPERATORS];
    float lfo_amp[FMSYNTH_OPERATORS];
 };
 
-struct fmsynth
+struct fmsynth_patch
 {
    FMSYNTH_ALIGNED_CACHE_PRE struct fmsynth_voice_parameters params FMSYNTH_ALIGNED_CACHE_POST;
    FMSYNTH_ALIGNED_CACHE_PRE struct fmsynth_global_parameters global_params FMSYNTH_ALIGNED_CACHE_POST;
+};
 
-   float sample_rate;
-   float inv_sample_rate;
+// Per MIDI channel state. All parts share the same voice pool.
+struct fmsynth_part
+{
+   // Parameters used for new voices.
+   // Either points to params/global_params of the synth or to a registered patch.
+   const struct fmsynth_voice_parameters *params;
+   const struct fmsynth_global_parameters *global_params;
 
    float bend;
    float wheel;
    bool sustained;
 
+   // Shared by all voices of the part in global LFO mode.
+   float lfo_phase;
+   float lfo_value;
+};
+
+// Linear ramp of one parameter in params of the synth.
+struct fmsynth_ramp
+{
+   uint16_t parameter;
+   uint16_t operator_index;
+   // The value is computed from the start, so it does not drift from the line.
+   unsigned elapsed;
+   unsigned frames;
+   float start;
+   float step;
+   float target;
+};
+
+#ifdef FMSYNTH_STATS
+struct fmsynth_stats_counters
+{
+   uint64_t frames_rendered;
+   uint64_t render_calls;
+   uint64_t voice_frames_rendered;
+   uint64_t peak_active_voices;
+   uint64_t notes_rejected;
+   uint64_t voices_retired;
+   uint64_t process_ticks;
+   uint64_t control_ticks;
+   uint64_t event_ticks;
+   uint64_t max_render_ticks;
+};
+
+static void fmsynth_stats_add(uint64_t *counter, uint64_t value)
+{
+   FMSYNTH_STATS_STORE(counter, FMSYNTH_STATS_LOAD(counter) + value);
+}
+
+static void fmsynth_stats_max(uint64_t *counter, uint64_t value)
+{
+   if (value > FMSYNTH_STATS_LOAD(counter))
+   {
+      FMSYNTH_STATS_STORE(counter, value);
+   }
+}
+#endif
+
+typedef void (*fmsynth_process_frames_t)(const struct fmsynth_voice_parameters *params,
+      struct fmsynth_voice *voice, float *left, float *right, unsigned frames);
+
+// How a kernel mixes carriers to the output.
+enum fmsynth_mix
+{
+   FMSYNTH_MIX_STEREO = 0,
+   // Computes the left mix only and adds it to both channels.
+   FMSYNTH_MIX_CENTERED,
+   // Computes a single mix with the average of both pan gains and adds it to left only.
+   FMSYNTH_MIX_MONO,
+   FMSYNTH_MIX_COUNT
+};
+
+// Kernel variants, indexed by low precision and mix.
+typedef fmsynth_process_frames_t fmsynth_kernel_table_t[2][FMSYNTH_MIX_COUNT];
+
+// Renders two voices interleaved, mixing voice a before voice b.
+typedef void (*fmsynth_process_pair_t)(
+      const struct fmsynth_voice_parameters *params_a, struct fmsynth_voice *voice_a,
+      const struct fmsynth_voice_parameters *params_b, struct fmsynth_voice *voice_b,
+      float *left, float *right, unsigned frames);
+typedef fmsynth_process_pair_t fmsynth_pair_kernel_table_t[2][FMSYNTH_MIX_COUNT];
+
+struct fmsynth_governor_state
+{
+   struct fmsynth_governor_config config;
+   bool enabled;
+   unsigned calm_blocks;
+   unsigned control_shift;
+
+   // Smoothed render time per voice and frame, in seconds.
+   double cost;
+
+   struct fmsynth_governor_report report;
+};
+
+struct fmsynth
+{
+   FMSYNTH_ALIGNED_CACHE_PRE struct fmsynth_voice_parameters params FMSYNTH_ALIGNED_CACHE_POST;
+   FMSYNTH_ALIGNED_CACHE_PRE struct fmsynth_global_parameters global_params FMSYNTH_ALIGNED_CACHE_POST;
+
+   const fmsynth_patch_t *programs[FMSYNTH_PROGRAMS];
+   struct fmsynth_part parts[FMSYNTH_PARTS];
+   bool multi_timbral;
+   bool global_lfo;
+
+   struct fmsynth_ramp ramps[FMSYNTH_RAMPS];
+   unsigned ramp_count;
+
+   float sample_rate;
+   float inv_sample_rate;
+
+   enum fmsynth_kernel kernel;
+   // Kernels are specialized to the operators in use, see fmsynth_set_operators().
+   unsigned operators;
+   const fmsynth_kernel_table_t *kernels;
+   // NULL if the kernel has no interleaved variant.
+   const fmsynth_pair_kernel_table_t *pair_kernels;
+#ifdef FMSYNTH_HAVE_JIT
+   // Set while FMSYNTH_KERNEL_JIT is selected.
+   struct fmsynth_jit *jit;
+#endif
+
+   struct fmsynth_governor_state governor;
+
+   // Set if the instance owns its memory.
+   void *memory;
+   fmsynth_alloc_cb alloc_cb;
+   fmsynth_free_cb free_cb;
+   void *alloc_userdata;
+
    unsigned max_voices;
+   unsigned voice_limit;
+   unsigned active_voices;
+
+#ifdef FMSYNTH_STATS
+   struct fmsynth_stats_counters stats;
+#endif
+
+   struct fmsynth_voice_control *controls;
    FMSYNTH_ALIGNED_CACHE_PRE struct fmsynth_voice voices[] FMSYNTH_ALIGNED_CACHE_POST;
 };
 
+#ifdef FMSYNTH_HAVE_JIT
+#include "x86/fmsynth_jit.c"
+#endif
+
 static void *fmsynth_memory_alloc(size_t alignment, size_t size)
 {
    void **place;
@@ -156,20 +414,35 @@ static void fmsynth_memory_free(void *ptr)
 static void fmsynth_init_voices(fmsynth_t *fm)
 {
    memset(fm->voices, 0, fm->max_voices * sizeof(*fm->voices));
+   memset(fm->controls, 0, fm->max_voices * sizeof(*fm->controls));
 
    for (unsigned v = 0; v < fm->max_voices; v++)
    {
       for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
       {
-         fm->voices[v].amp[i] = 1.0f;
+         fm->controls[v].amp[i] = 1.0f;
          fm->voices[v].pan_amp[0][i] = 1.0f;
          fm->voices[v].pan_amp[1][i] = 1.0f;
-         fm->voices[v].wheel_amp[i] = 1.0f;
-         fm->voices[v].lfo_amp[i] = 1.0f;
+         fm->controls[v].wheel_amp[i] = 1.0f;
+         fm->controls[v].lfo_amp[i] = 1.0f;
          fm->voices[v].lfo_freq_mod[i] = 1.0f;
       }
    }
-   fm->bend = 1.0f;
+}
+
+static void fmsynth_init_parts(fmsynth_t *fm)
+{
+   for (unsigned p = 0; p < FMSYNTH_PARTS; p++)
+   {
+      struct fmsynth_part *part = &fm->parts[p];
+      part->params = &fm->params;
+      part->global_params = &fm->global_params;
+      part->bend = 1.0f;
+      part->wheel = 0.0f;
+      part->sustained = false;
+      part->lfo_phase = 0.25f;
+      part->lfo_value = 0.0f;
+   }
 }
 
 static void fmsynth_set_default_parameters(
@@ -232,35 +505,325 @@ static void fmsynth_set_default_global_parameters(
 
 void fmsynth_reset(fmsynth_t *fm)
 {
+   FMSYNTH_STATS_ADD(fm, voices_retired, fm->active_voices);
    fmsynth_init_voices(fm);
    fmsynth_set_default_parameters(&fm->params);
    fmsynth_set_default_global_parameters(&fm->global_params);
+
+   memset(fm->programs, 0, sizeof(fm->programs));
+   fmsynth_init_parts(fm);
+   fm->multi_timbral = false;
+   fm->global_lfo = false;
+   fm->ramp_count = 0;
+
+   // The voice limit is host configuration like the kernel, so it is kept.
+   fm->active_voices = 0;
 }
 
-fmsynth_t *fmsynth_new(float sample_rate, unsigned max_voices)
+static size_t fmsynth_instance_size_unaligned(unsigned max_voices)
 {
-   size_t fmsynth_size = sizeof(fmsynth_t) +
-      max_voices * sizeof(struct fmsynth_voice);
+   // Audio-rate and control-rate voice state live in separate arrays,
+   // so rendering only streams the audio-rate state through cache.
+   return sizeof(fmsynth_t) +
+      max_voices * (sizeof(struct fmsynth_voice) + sizeof(struct fmsynth_voice_control));
+}
 
-   fmsynth_t *fm = fmsynth_memory_alloc(64, fmsynth_size);
-   if (fm == NULL)
+size_t fmsynth_instance_size(unsigned max_voices)
+{
+   // Leave room for aligning the instance to cache line.
+   return fmsynth_instance_size_unaligned(max_voices) + 64;
+}
+
+fmsynth_t *fmsynth_init_in_place(void *memory, size_t size,
+      float sample_rate, unsigned max_voices)
+{
+   if (memory == NULL || size < fmsynth_instance_size(max_voices))
    {
       return NULL;
    }
 
+   uintptr_t addr = ((uintptr_t)memory + 63) & ~(uintptr_t)63;
+   size_t fmsynth_size = fmsynth_instance_size_unaligned(max_voices);
+
+   fmsynth_t *fm = (fmsynth_t*)addr;
    memset(fm, 0, fmsynth_size);
    fm->max_voices = max_voices;
+   fm->controls = (struct fmsynth_voice_control*)(fm->voices + max_voices);
 
    fm->sample_rate = sample_rate;
    fm->inv_sample_rate = 1.0f / sample_rate;
+   fm->operators = FMSYNTH_OPERATORS;
+   fm->voice_limit = max_voices;
+   fmsynth_set_kernel(fm, FMSYNTH_KERNEL_DEFAULT);
 
    fmsynth_reset(fm);
    return fm;
 }
 
+static void *fmsynth_default_alloc(void *userdata, size_t size)
+{
+   (void)userdata;
+   return malloc(size);
+}
+
+static void fmsynth_default_free(void *userdata, void *ptr)
+{
+   (void)userdata;
+   free(ptr);
+}
+
+fmsynth_t *fmsynth_new_with_allocator(float sample_rate, unsigned max_voices,
+      fmsynth_alloc_cb alloc_cb, fmsynth_free_cb free_cb, void *userdata)
+{
+   size_t size = fmsynth_instance_size(max_voices);
+   void *memory = alloc_cb(userdata, size);
+   if (memory == NULL)
+   {
+      return NULL;
+   }
+
+   fmsynth_t *fm = fmsynth_init_in_place(memory, size, sample_rate, max_voices);
+   if (fm == NULL)
+   {
+      if (free_cb)
+      {
+         free_cb(userdata, memory);
+      }
+      return NULL;
+   }
+
+   fm->memory = memory;
+   fm->alloc_cb = alloc_cb;
+   fm->free_cb = free_cb;
+   fm->alloc_userdata = userdata;
+   return fm;
+}
+
+fmsynth_t *fmsynth_new(float sample_rate, unsigned max_voices)
+{
+   return fmsynth_new_with_allocator(sample_rate, max_voices,
+         fmsynth_default_alloc, fmsynth_default_free, NULL);
+}
+
 void fmsynth_free(fmsynth_t *fm)
 {
-   fmsynth_memory_free(fm);
+#ifdef FMSYNTH_HAVE_JIT
+   if (fm->jit)
+   {
+      fmsynth_jit_free(fm->jit);
+   }
+#endif
+
+   // Instances initialized in place do not own their memory.
+   if (fm->free_cb)
+   {
+      fm->free_cb(fm->alloc_userdata, fm->memory);
+   }
+}
+
+// A state is a memory image of the instance and its voices,
+// so it is only valid in the same process and build.
+#define FMSYNTH_STATE_MAGIC 0x464d5354u
+
+struct fmsynth_state_header
+{
+   uint32_t magic;
+   uint32_t max_voices;
+   uint32_t instance_size;
+   uint32_t voice_size;
+   uint32_t control_size;
+
+   // Where the parameters of the saved instance lived, so pointers to them can be relocated.
+   const void *params;
+   const void *global_params;
+};
+
+static size_t fmsynth_state_size_voices(unsigned max_voices)
+{
+   return sizeof(struct fmsynth_state_header) + sizeof(fmsynth_t) +
+      max_voices * (sizeof(struct fmsynth_voice) + sizeof(struct fmsynth_voice_control));
+}
+
+size_t fmsynth_state_size(const fmsynth_t *fm)
+{
+   return fmsynth_state_size_voices(fm->max_voices);
+}
+
+// Copies performance state from an image of another instance.
+// Memory, kernel and statistics belong to the instance, and are kept.
+static void fmsynth_restore_state(fmsynth_t *fm, const void *instance,
+      const void *voices, const void *controls, unsigned num_voices,
+      const void *params, const void *global_params)
+{
+   void *memory = fm->memory;
+   fmsynth_alloc_cb alloc_cb = fm->alloc_cb;
+   fmsynth_free_cb free_cb = fm->free_cb;
+   void *alloc_userdata = fm->alloc_userdata;
+   unsigned max_voices = fm->max_voices;
+   enum fmsynth_kernel kernel = fm->kernel;
+#ifdef FMSYNTH_HAVE_JIT
+   struct fmsynth_jit *jit = fm->jit;
+#endif
+#ifdef FMSYNTH_STATS
+   struct fmsynth_stats_counters stats = fm->stats;
+#endif
+
+   memcpy(fm, instance, sizeof(fmsynth_t));
+
+   fm->memory = memory;
+   fm->alloc_cb = alloc_cb;
+   fm->free_cb = free_cb;
+   fm->alloc_userdata = alloc_userdata;
+   fm->max_voices = max_voices;
+   fm->voice_limit = min(fm->voice_limit, max_voices);
+   fm->controls = (struct fmsynth_voice_control*)(fm->voices + max_voices);
+   fm->kernel = kernel;
+#ifdef FMSYNTH_HAVE_JIT
+   fm->jit = jit;
+#endif
+#ifdef FMSYNTH_STATS
+   fm->stats = stats;
+#endif
+
+   fmsynth_init_voices(fm);
+   memcpy(fm->voices, voices, num_voices * sizeof(*fm->voices));
+   memcpy(fm->controls, controls, num_voices * sizeof(*fm->controls));
+
+   for (unsigned p = 0; p < FMSYNTH_PARTS; p++)
+   {
+      struct fmsynth_part *part = &fm->parts[p];
+      if ((const void*)part->params == params)
+      {
+         part->params = &fm->params;
+      }
+      if ((const void*)part->global_params == global_params)
+      {
+         part->global_params = &fm->global_params;
+      }
+   }
+
+   for (unsigned v = 0; v < num_voices; v++)
+   {
+      if ((const void*)fm->controls[v].params == params)
+      {
+         fm->controls[v].params = &fm->params;
+      }
+   }
+
+   // Picks kernels for the restored operator count. Generated code is not shared between instances,
+   // so voices continue with the static kernel until they are triggered again.
+   fmsynth_set_kernel(fm, kernel);
+}
+
+fmsynth_status_t fmsynth_state_save(const fmsynth_t *fm, void *buffer_, size_t size)
+{
+   if (size < fmsynth_state_size(fm))
+   {
+      return FMSYNTH_STATUS_BUFFER_TOO_SMALL;
+   }
+
+   uint8_t *buffer = buffer_;
+   struct fmsynth_state_header header = {
+      .magic = FMSYNTH_STATE_MAGIC,
+      .max_voices = fm->max_voices,
+      .instance_size = sizeof(fmsynth_t),
+      .voice_size = sizeof(struct fmsynth_voice),
+      .control_size = sizeof(struct fmsynth_voice_control),
+      .params = &fm->params,
+      .global_params = &fm->global_params,
+   };
+
+   memcpy(buffer, &header, sizeof(header));
+   buffer += sizeof(header);
+   memcpy(buffer, fm, sizeof(fmsynth_t));
+   buffer += sizeof(fmsynth_t);
+   memcpy(buffer, fm->voices, fm->max_voices * sizeof(*fm->voices));
+   buffer += fm->max_voices * sizeof(*fm->voices);
+   memcpy(buffer, fm->controls, fm->max_voices * sizeof(*fm->controls));
+   return FMSYNTH_STATUS_OK;
+}
+
+fmsynth_status_t fmsynth_state_load(fmsynth_t *fm, const void *buffer_, size_t size)
+{
+   const uint8_t *buffer = buffer_;
+   struct fmsynth_state_header header;
+
+   if (size < sizeof(header))
+   {
+      return FMSYNTH_STATUS_BUFFER_TOO_SMALL;
+   }
+
+   memcpy(&header, buffer, sizeof(header));
+   if (header.magic != FMSYNTH_STATE_MAGIC ||
+         header.instance_size != sizeof(fmsynth_t) ||
+         header.voice_size != sizeof(struct fmsynth_voice) ||
+         header.control_size != sizeof(struct fmsynth_voice_control))
+   {
+      return FMSYNTH_STATUS_INVALID_FORMAT;
+   }
+
+   if (size < fmsynth_state_size_voices(header.max_voices))
+   {
+      return FMSYNTH_STATUS_BUFFER_TOO_SMALL;
+   }
+
+   if (header.max_voices > fm->max_voices)
+   {
+      return FMSYNTH_STATUS_BUSY;
+   }
+
+   buffer += sizeof(header);
+   const uint8_t *voices = buffer + sizeof(fmsynth_t);
+   const uint8_t *controls = voices + header.max_voices * sizeof(struct fmsynth_voice);
+   fmsynth_restore_state(fm, buffer, voices, controls, header.max_voices,
+         header.params, header.global_params);
+   return FMSYNTH_STATUS_OK;
+}
+
+fmsynth_t *fmsynth_clone(const fmsynth_t *fm)
+{
+   // Clones use the allocator of the original, or malloc if it was initialized in place.
+   fmsynth_t *clone = fm->alloc_cb ?
+      fmsynth_new_with_allocator(fm->sample_rate, fm->max_voices,
+            fm->alloc_cb, fm->free_cb, fm->alloc_userdata) :
+      fmsynth_new(fm->sample_rate, fm->max_voices);
+
+   if (clone == NULL)
+   {
+      return NULL;
+   }
+
+   if (fmsynth_set_kernel(clone, fm->kernel) != FMSYNTH_STATUS_OK)
+   {
+      fmsynth_free(clone);
+      return NULL;
+   }
+
+   fmsynth_restore_state(clone, fm, fm->voices, fm->controls, fm->max_voices,
+         &fm->params, &fm->global_params);
+   return clone;
+}
+
+fmsynth_patch_t *fmsynth_patch_new(void)
+{
+   fmsynth_patch_t *patch = fmsynth_memory_alloc(64, sizeof(*patch));
+   if (patch == NULL)
+   {
+      return NULL;
+   }
+
+   memset(patch, 0, sizeof(*patch));
+   fmsynth_set_default_parameters(&patch->params);
+   fmsynth_set_default_global_parameters(&patch->global_params);
+   return patch;
+}
+
+void fmsynth_patch_free(fmsynth_patch_t *patch)
+{
+   if (patch)
+   {
+      fmsynth_memory_free(patch);
+   }
 }
 
 static float pitch_bend_to_ratio(uint16_t bend)
@@ -274,18 +837,31 @@ static float note_to_frequency(uint8_t note)
    return 440.0f * powf(2.0f, (note - 69.0f) / 12.0f);
 }
 
-static void fmsynth_update_target_envelope(struct fmsynth_voice *voice)
+static void fmsynth_update_target_envelope(struct fmsynth_voice *voice,
+      struct fmsynth_voice_control *ctrl)
 {
-   voice->pos += voice->speed * FMSYNTH_FRAMES_PER_LFO;
+   unsigned frames = FMSYNTH_FRAMES_PER_LFO << ctrl->control_shift;
+   ctrl->pos += ctrl->speed * frames;
 
-   if (voice->state == FMSYNTH_VOICE_RELEASED)
+   if (ctrl->state == FMSYNTH_VOICE_RELEASED)
    {
       for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
       {
-         voice->target_env[i] *= voice->falloff[i];
-         if (voice->pos >= voice->end_time[i])
+         // Falloff is per FMSYNTH_FRAMES_PER_LFO frames.
+         float falloff = ctrl->falloff[i];
+         for (unsigned s = 0; s < ctrl->control_shift; s++)
+         {
+            falloff *= falloff;
+         }
+
+         ctrl->target_env[i] *= falloff;
+         if (ctrl->target_env[i] < FMSYNTH_ENVELOPE_FLOOR)
+         {
+            ctrl->target_env[i] = 0.0f;
+         }
+         if (ctrl->pos >= ctrl->end_time[i])
          {
-            voice->dead |= 1 << i;
+            ctrl->dead |= 1 << i;
          }
       }
    }
@@ -293,330 +869,720 @@ static void fmsynth_update_target_envelope(struct fmsynth_voice *voice)
    {
       for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
       {
-         if (voice->pos >= voice->time[3][i])
+         if (ctrl->pos >= ctrl->time[3][i])
          {
-            voice->target_env[i] = voice->target[3][i];
+            ctrl->target_env[i] = ctrl->target[3][i];
          }
-         else if (voice->pos >= voice->time[2][i])
+         else if (ctrl->pos >= ctrl->time[2][i])
          {
-            voice->target_env[i] = voice->target[2][i] +
-               (voice->pos - voice->time[2][i]) * voice->lerp[2][i];
+            ctrl->target_env[i] = ctrl->target[2][i] +
+               (ctrl->pos - ctrl->time[2][i]) * ctrl->lerp[2][i];
          }
-         else if (voice->pos >= voice->time[1][i])
+         else if (ctrl->pos >= ctrl->time[1][i])
          {
-            voice->target_env[i] = voice->target[1][i] +
-               (voice->pos - voice->time[1][i]) * voice->lerp[1][i];
+            ctrl->target_env[i] = ctrl->target[1][i] +
+               (ctrl->pos - ctrl->time[1][i]) * ctrl->lerp[1][i];
          }
          else
          {
-            voice->target_env[i] = voice->target[0][i] +
-               (voice->pos - voice->time[0][i]) * voice->lerp[0][i];
+            ctrl->target_env[i] = ctrl->target[0][i] +
+               (ctrl->pos - ctrl->time[0][i]) * ctrl->lerp[0][i];
          }
       }
    }
 
    for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
    {
+      // Stop ramping towards zero before the envelope turns denormal.
+      if (ctrl->target_env[i] == 0.0f && fabsf(voice->env[i]) < FMSYNTH_ENVELOPE_FLOOR)
+      {
+         voice->env[i] = 0.0f;
+      }
+
       voice->target_env_step[i] =
-         (voice->target_env[i] - voice->env[i]) * (1.0f / FMSYNTH_FRAMES_PER_LFO);
+         (ctrl->target_env[i] - voice->env[i]) * (1.0f / frames);
    }
 }
 
-static void fmsynth_reset_envelope(fmsynth_t *fm, struct fmsynth_voice *voice)
+// Attenuation per envelope update to reach -60 dB after release_time seconds.
+static float fmsynth_release_falloff(const fmsynth_t *fm, float release_time)
+{
+   return expf(logf(0.001f) * FMSYNTH_FRAMES_PER_LFO *
+         fm->inv_sample_rate / release_time);
+}
+
+static void fmsynth_reset_envelope(fmsynth_t *fm, struct fmsynth_voice *voice,
+      struct fmsynth_voice_control *ctrl)
 {
-   voice->pos = 0.0f;
-   voice->count = 0;
-   voice->speed = fm->inv_sample_rate;
-   voice->dead = 0;
+   const struct fmsynth_voice_parameters *params = ctrl->params;
+
+   ctrl->pos = 0.0f;
+   ctrl->count = 0;
+   ctrl->speed = fm->inv_sample_rate;
+   ctrl->dead = 0;
+   ctrl->control_shift = fm->governor.control_shift;
 
    for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
    {
-      voice->env[i] = voice->target[0][i] = 0.0f;
-      voice->time[0][i] = 0.0f;
+      voice->env[i] = ctrl->target[0][i] = 0.0f;
+      ctrl->time[0][i] = 0.0f;
 
       for (unsigned j = 1; j <= 3; j++)
       {
-         voice->target[j][i] = fm->params.envelope_target[j - 1][i];
-         voice->time[j][i] = fm->params.envelope_delay[j - 1][i] +
-            voice->time[j - 1][i];
+         ctrl->target[j][i] = params->envelope_target[j - 1][i];
+         ctrl->time[j][i] = params->envelope_delay[j - 1][i] +
+            ctrl->time[j - 1][i];
       }
 
       for (unsigned j = 0; j < 3; j++)
       {
-         voice->lerp[j][i] = (voice->target[j + 1][i] - voice->target[j][i]) /
-            (voice->time[j + 1][i] - voice->time[j][i]);
+         ctrl->lerp[j][i] = (ctrl->target[j + 1][i] - ctrl->target[j][i]) /
+            (ctrl->time[j + 1][i] - ctrl->time[j][i]);
       }
 
-      voice->release_time[i] = fm->params.envelope_release_time[i];
-      voice->falloff[i] = expf(logf(0.001f) * FMSYNTH_FRAMES_PER_LFO *
-            fm->inv_sample_rate / voice->release_time[i]);
+      ctrl->release_time[i] = params->envelope_release_time[i];
+      ctrl->falloff[i] = fmsynth_release_falloff(fm, ctrl->release_time[i]);
    }
 
-   fmsynth_update_target_envelope(voice);
+   fmsynth_update_target_envelope(voice, ctrl);
 }
 
 static void fmsynth_reset_voice(fmsynth_t *fm, struct fmsynth_voice *voice,
-      float volume, float velocity, float freq)
+      struct fmsynth_voice_control *ctrl, float volume, float velocity, float freq)
 {
-   voice->enable = 0;
+   const struct fmsynth_voice_parameters *params = ctrl->params;
+   const struct fmsynth_part *part = &fm->parts[ctrl->part];
+   ctrl->enable = 0;
+   ctrl->centered = 1;
 
    for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
    {
       voice->phases[i] = 0.25f;
 
-      float mod_amp = 1.0f - fm->params.velocity_sensitivity[i];
-      mod_amp += fm->params.velocity_sensitivity[i] * velocity;
+      float mod_amp = 1.0f - params->velocity_sensitivity[i];
+      mod_amp += params->velocity_sensitivity[i] * velocity;
 
-      float ratio = freq / fm->params.keyboard_scaling_mid_point[i];
+      float ratio = freq / params->keyboard_scaling_mid_point[i];
       float factor = ratio > 1.0f ?
-         fm->params.keyboard_scaling_high_factor[i] :
-         fm->params.keyboard_scaling_low_factor[i];
+         params->keyboard_scaling_high_factor[i] :
+         params->keyboard_scaling_low_factor[i];
 
       mod_amp *= powf(ratio, factor);
+      ctrl->key_amp[i] = mod_amp;
 
-      bool enable = fm->params.enable[i] > 0.5f;
-      voice->enable |= enable << i;
+      bool enable = params->enable[i] > 0.5f && i < fm->operators;
+      ctrl->enable |= enable << i;
 
       if (enable)
       {
-         voice->amp[i] = mod_amp * fm->params.amp[i];
+         ctrl->amp[i] = mod_amp * params->amp[i];
       }
       else
       {
-         voice->amp[i] = 0.0f;
+         ctrl->amp[i] = 0.0f;
       }
 
-      voice->wheel_amp[i] = 1.0f - fm->params.mod_sensitivity[i] +
-         fm->params.mod_sensitivity[i] * fm->wheel;
-      voice->pan_amp[0][i] = volume * min(1.0f - fm->params.pan[i], 1.0f) *
-         fm->params.carriers[i];
-      voice->pan_amp[1][i] = volume * min(1.0f + fm->params.pan[i], 1.0f) *
-         fm->params.carriers[i];
+      ctrl->wheel_amp[i] = 1.0f - params->mod_sensitivity[i] +
+         params->mod_sensitivity[i] * part->wheel;
+      voice->pan_amp[0][i] = volume * min(1.0f - params->pan[i], 1.0f) *
+         params->carriers[i];
+      voice->pan_amp[1][i] = volume * min(1.0f + params->pan[i], 1.0f) *
+         params->carriers[i];
+      ctrl->centered &= voice->pan_amp[0][i] == voice->pan_amp[1][i];
 
-      voice->lfo_amp[i] = 1.0f;
+      ctrl->lfo_amp[i] = 1.0f;
       voice->lfo_freq_mod[i] = 1.0f;
    }
 
-   voice->state = FMSYNTH_VOICE_RUNNING;
-   fmsynth_reset_envelope(fm, voice);
+   ctrl->state = FMSYNTH_VOICE_RUNNING;
+   fmsynth_reset_envelope(fm, voice, ctrl);
 }
 
-static void fmsynth_voice_update_read_mod(struct fmsynth_voice *voice)
+static void fmsynth_voice_update_read_mod(struct fmsynth_voice *voice,
+      const struct fmsynth_voice_control *ctrl)
 {
    for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
    {
       voice->read_mod[i] =
-         voice->wheel_amp[i] * voice->lfo_amp[i] * voice->amp[i];
+         ctrl->wheel_amp[i] * ctrl->lfo_amp[i] * ctrl->amp[i];
+   }
+}
+
+// Zero depths leave lfo_amp and lfo_freq_mod at exactly 1 for any LFO value.
+static bool fmsynth_voice_uses_lfo(const struct fmsynth_voice_control *ctrl,
+      const struct fmsynth_voice_parameters *params)
+{
+   for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
+   {
+      if ((ctrl->enable & (1u << i)) &&
+            (params->lfo_amp_depth[i] != 0.0f || params->lfo_freq_mod_depth[i] != 0.0f))
+      {
+         return true;
+      }
    }
+   return false;
 }
 
 static void fmsynth_trigger_voice(fmsynth_t *fm, struct fmsynth_voice *voice,
-      uint8_t note, uint8_t velocity)
+      struct fmsynth_voice_control *ctrl, unsigned part, uint8_t note, uint8_t velocity)
 {
-   voice->note = note;
-   voice->base_freq = note_to_frequency(note);
+   const struct fmsynth_voice_parameters *params = fm->parts[part].params;
+   const struct fmsynth_global_parameters *global_params = fm->parts[part].global_params;
+
+   ctrl->note = note;
+   ctrl->part = part;
+   ctrl->base_freq = note_to_frequency(note);
+   ctrl->params = params;
+   ctrl->low_precision = 0;
 
-   float freq = fm->bend * voice->base_freq;
+   float freq = fm->parts[part].bend * ctrl->base_freq;
    float mod_vel = velocity * (1.0f / 127.0f);
 
    for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
    {
       voice->step_rate[o] =
-         (freq * fm->params.freq_mod[o] + fm->params.freq_offset[o]) *
+         (freq * params->freq_mod[o] + params->freq_offset[o]) *
          fm->inv_sample_rate;
    }
 
-   fmsynth_reset_voice(fm, voice,
-         fm->global_params.volume, mod_vel, voice->base_freq);
-   fmsynth_voice_update_read_mod(voice);
+   fmsynth_reset_voice(fm, voice, ctrl,
+         global_params->volume, mod_vel, ctrl->base_freq);
+   fmsynth_voice_update_read_mod(voice, ctrl);
 
-   voice->lfo_phase = 0.25f;
-   voice->lfo_step = FMSYNTH_FRAMES_PER_LFO * fm->global_params.lfo_freq * fm->inv_sample_rate;
-   voice->count = 0;
-}
+   ctrl->lfo = fmsynth_voice_uses_lfo(ctrl, params);
+   ctrl->lfo_value = 0.0f;
+   ctrl->lfo_phase = 0.25f;
+   ctrl->lfo_step = FMSYNTH_FRAMES_PER_LFO * global_params->lfo_freq * fm->inv_sample_rate;
+   ctrl->count = 0;
 
-fmsynth_status_t fmsynth_note_on(fmsynth_t *fm, uint8_t note, uint8_t velocity)
-{
-   struct fmsynth_voice *voice = NULL;
-   for (unsigned i = 0; i < fm->max_voices; i++)
+#ifdef FMSYNTH_HAVE_JIT
+   if (fm->jit)
    {
-      if (fm->voices[i].state == FMSYNTH_VOICE_INACTIVE)
-      {
-         voice = &fm->voices[i];
-         break;
-      }
+      fmsynth_jit_bind(fm->jit, voice, ctrl);
    }
+#endif
+}
 
-   if (voice)
+// Searches for a free voice from *first_free, and leaves it past the voice which was taken.
+// Voices only become inactive while rendering, so a batch of events can keep searching from the same place.
+static fmsynth_status_t fmsynth_part_note_on_from(fmsynth_t *fm, unsigned part,
+      uint8_t note, uint8_t velocity, unsigned *first_free)
+{
+   if (fm->active_voices >= fm->voice_limit)
    {
-      fmsynth_trigger_voice(fm, voice, note, velocity);
-      return FMSYNTH_STATUS_OK;
+      FMSYNTH_STATS_ADD(fm, notes_rejected, 1);
+      return FMSYNTH_STATUS_BUSY;
    }
-   else
+
+   for (unsigned i = *first_free; i < fm->max_voices; i++)
    {
-      return FMSYNTH_STATUS_BUSY;
+      if (fm->controls[i].state == FMSYNTH_VOICE_INACTIVE)
+      {
+         fmsynth_trigger_voice(fm, &fm->voices[i], &fm->controls[i],
+               part, note, velocity);
+         fm->active_voices++;
+         FMSYNTH_STATS_MAX(fm, peak_active_voices, fm->active_voices);
+         *first_free = i + 1;
+         return FMSYNTH_STATUS_OK;
+      }
    }
+
+   *first_free = fm->max_voices;
+   FMSYNTH_STATS_ADD(fm, notes_rejected, 1);
+   return FMSYNTH_STATUS_BUSY;
+}
+
+static fmsynth_status_t fmsynth_part_note_on(fmsynth_t *fm, unsigned part,
+      uint8_t note, uint8_t velocity)
+{
+   unsigned first_free = 0;
+   return fmsynth_part_note_on_from(fm, part, note, velocity, &first_free);
+}
+
+fmsynth_status_t fmsynth_note_on(fmsynth_t *fm, uint8_t note, uint8_t velocity)
+{
+   FMSYNTH_STATS_BEGIN(start);
+   fmsynth_status_t ret = fmsynth_part_note_on(fm, 0, note, velocity);
+   FMSYNTH_STATS_TICKS(fm, event_ticks, start);
+   return ret;
 }
 
-static void fmsynth_release_voice(struct fmsynth_voice *voice)
+static void fmsynth_release_voice(struct fmsynth_voice_control *ctrl)
 {
-   voice->state = FMSYNTH_VOICE_RELEASED;
+   ctrl->state = FMSYNTH_VOICE_RELEASED;
    for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
    {
-      voice->end_time[i] = voice->pos + voice->release_time[i];
+      ctrl->end_time[i] = ctrl->pos + ctrl->release_time[i];
    }
 }
 
-void fmsynth_note_off(fmsynth_t *fm, uint8_t note)
+static void fmsynth_part_note_off(fmsynth_t *fm, unsigned part, uint8_t note)
 {
    for (unsigned i = 0; i < fm->max_voices; i++)
    {
-      if (fm->voices[i].note == note &&
-            fm->voices[i].state == FMSYNTH_VOICE_RUNNING)
+      if (fm->controls[i].note == note &&
+            fm->controls[i].part == part &&
+            fm->controls[i].state == FMSYNTH_VOICE_RUNNING)
       {
-         if (fm->sustained)
+         if (fm->parts[part].sustained)
          {
-            fm->voices[i].state = FMSYNTH_VOICE_SUSTAINED;
+            fm->controls[i].state = FMSYNTH_VOICE_SUSTAINED;
          }
          else
          {
-            fmsynth_release_voice(&fm->voices[i]);
+            fmsynth_release_voice(&fm->controls[i]);
          }
       }
    }
 }
 
-void fmsynth_set_sustain(fmsynth_t *fm, bool enable)
+void fmsynth_note_off(fmsynth_t *fm, uint8_t note)
+{
+   FMSYNTH_STATS_BEGIN(start);
+   fmsynth_part_note_off(fm, 0, note);
+   FMSYNTH_STATS_TICKS(fm, event_ticks, start);
+}
+
+static void fmsynth_part_set_sustain(fmsynth_t *fm, unsigned part, bool enable)
 {
-   bool releasing = fm->sustained && !enable;
-   fm->sustained = enable;
+   bool releasing = fm->parts[part].sustained && !enable;
+   fm->parts[part].sustained = enable;
 
    if (releasing)
    {
       for (unsigned i = 0; i < fm->max_voices; i++)
       {
-         if (fm->voices[i].state == FMSYNTH_VOICE_SUSTAINED)
+         if (fm->controls[i].part == part &&
+               fm->controls[i].state == FMSYNTH_VOICE_SUSTAINED)
          {
-            fmsynth_release_voice(&fm->voices[i]);
+            fmsynth_release_voice(&fm->controls[i]);
          }
       }
    }
 }
 
-void fmsynth_set_mod_wheel(fmsynth_t *fm, uint8_t wheel)
+void fmsynth_set_sustain(fmsynth_t *fm, bool enable)
+{
+   FMSYNTH_STATS_BEGIN(start);
+   fmsynth_part_set_sustain(fm, 0, enable);
+   FMSYNTH_STATS_TICKS(fm, event_ticks, start);
+}
+
+static void fmsynth_part_set_mod_wheel(fmsynth_t *fm, unsigned part, uint8_t wheel)
 {
    float value = wheel * (1.0f / 127.0f);
-   fm->wheel = value;
+   fm->parts[part].wheel = value;
 
    for (unsigned v = 0; v < fm->max_voices; v++)
    {
       struct fmsynth_voice *voice = &fm->voices[v];
+      struct fmsynth_voice_control *ctrl = &fm->controls[v];
 
-      if (voice->state != FMSYNTH_VOICE_INACTIVE)
+      if (ctrl->part == part && ctrl->state != FMSYNTH_VOICE_INACTIVE)
       {
          for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
          {
-            voice->wheel_amp[o] = 1.0f - fm->params.mod_sensitivity[o] +
-               fm->params.mod_sensitivity[o] * value;
+            ctrl->wheel_amp[o] = 1.0f - ctrl->params->mod_sensitivity[o] +
+               ctrl->params->mod_sensitivity[o] * value;
          }
 
-         fmsynth_voice_update_read_mod(voice);
+         fmsynth_voice_update_read_mod(voice, ctrl);
       }
    }
 }
 
-void fmsynth_set_pitch_bend(fmsynth_t *fm, uint16_t value)
+void fmsynth_set_mod_wheel(fmsynth_t *fm, uint8_t wheel)
+{
+   FMSYNTH_STATS_BEGIN(start);
+   fmsynth_part_set_mod_wheel(fm, 0, wheel);
+   FMSYNTH_STATS_TICKS(fm, event_ticks, start);
+}
+
+static void fmsynth_part_set_pitch_bend(fmsynth_t *fm, unsigned part, uint16_t value)
 {
    float bend = pitch_bend_to_ratio(value);
-   fm->bend = bend;
+   fm->parts[part].bend = bend;
 
    for (unsigned v = 0; v < fm->max_voices; v++)
    {
       struct fmsynth_voice *voice = &fm->voices[v];
+      struct fmsynth_voice_control *ctrl = &fm->controls[v];
 
-      if (voice->state != FMSYNTH_VOICE_INACTIVE)
+      if (ctrl->part == part && ctrl->state != FMSYNTH_VOICE_INACTIVE)
       {
          for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
          {
-            float freq = bend * voice->base_freq;
+            float freq = bend * ctrl->base_freq;
             voice->step_rate[o] =
-               (freq * fm->params.freq_mod[o] + fm->params.freq_offset[o]) *
+               (freq * ctrl->params->freq_mod[o] + ctrl->params->freq_offset[o]) *
                fm->inv_sample_rate;
          }
       }
    }
 }
 
+void fmsynth_set_pitch_bend(fmsynth_t *fm, uint16_t value)
+{
+   FMSYNTH_STATS_BEGIN(start);
+   fmsynth_part_set_pitch_bend(fm, 0, value);
+   FMSYNTH_STATS_TICKS(fm, event_ticks, start);
+}
+
 static void fmsynth_voice_set_lfo_value(struct fmsynth_voice *voice,
+      struct fmsynth_voice_control *ctrl,
       const struct fmsynth_voice_parameters *params, float value)
 {
    for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
    {
-      voice->lfo_amp[i] = 1.0f + params->lfo_amp_depth[i] * value;
+      ctrl->lfo_amp[i] = 1.0f + params->lfo_amp_depth[i] * value;
       voice->lfo_freq_mod[i] = 1.0f + params->lfo_freq_mod_depth[i] * value;
    }
 
-   fmsynth_voice_update_read_mod(voice);
+   fmsynth_voice_update_read_mod(voice, ctrl);
 }
 
-void fmsynth_release_all(fmsynth_t *fm)
+// LFO depths of params changed, so voices playing them might start or stop using the LFO.
+static void fmsynth_update_lfo_usage(fmsynth_t *fm,
+      const struct fmsynth_voice_parameters *params)
+{
+   for (unsigned v = 0; v < fm->max_voices; v++)
+   {
+      struct fmsynth_voice_control *ctrl = &fm->controls[v];
+      if (ctrl->state == FMSYNTH_VOICE_INACTIVE || ctrl->params != params)
+      {
+         continue;
+      }
+
+      ctrl->lfo = fmsynth_voice_uses_lfo(ctrl, params);
+      if (!ctrl->lfo)
+      {
+         ctrl->lfo_value = 0.0f;
+      }
+      fmsynth_voice_set_lfo_value(&fm->voices[v], ctrl, params, ctrl->lfo_value);
+   }
+}
+
+// Applies a changed parameter of params to a playing voice.
+// Parameters which only shape how a note starts, like envelopes and velocity sensitivity, are left alone.
+static void fmsynth_voice_apply_parameter(const fmsynth_t *fm, struct fmsynth_voice *voice,
+      struct fmsynth_voice_control *ctrl, unsigned parameter, unsigned o)
+{
+   const struct fmsynth_voice_parameters *params = ctrl->params;
+   const struct fmsynth_part *part = &fm->parts[ctrl->part];
+
+   switch (parameter)
+   {
+      case FMSYNTH_PARAM_AMP:
+         if (ctrl->enable & (1u << o))
+         {
+            ctrl->amp[o] = ctrl->key_amp[o] * params->amp[o];
+            fmsynth_voice_update_read_mod(voice, ctrl);
+         }
+         break;
+
+      case FMSYNTH_PARAM_MOD_WHEEL_SENSITIVITY:
+         ctrl->wheel_amp[o] = 1.0f - params->mod_sensitivity[o] +
+            params->mod_sensitivity[o] * part->wheel;
+         fmsynth_voice_update_read_mod(voice, ctrl);
+         break;
+
+      case FMSYNTH_PARAM_FREQ_MOD:
+      case FMSYNTH_PARAM_FREQ_OFFSET:
+         voice->step_rate[o] =
+            (part->bend * ctrl->base_freq * params->freq_mod[o] + params->freq_offset[o]) *
+            fm->inv_sample_rate;
+         break;
+
+      case FMSYNTH_PARAM_PAN:
+      case FMSYNTH_PARAM_CARRIERS:
+      {
+         float volume = part->global_params->volume;
+         voice->pan_amp[0][o] = volume * min(1.0f - params->pan[o], 1.0f) * params->carriers[o];
+         voice->pan_amp[1][o] = volume * min(1.0f + params->pan[o], 1.0f) * params->carriers[o];
+
+         ctrl->centered = 1;
+         for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
+         {
+            ctrl->centered &= voice->pan_amp[0][i] == voice->pan_amp[1][i];
+         }
+
+#ifdef FMSYNTH_HAVE_JIT
+         // Generated code is specialized to the carriers and panning it was compiled for.
+         ctrl->jit_slot = 0;
+#endif
+         break;
+      }
+
+      default:
+         // The modulation matrix is read live by the kernels.
+         break;
+   }
+}
+
+static void fmsynth_apply_parameter(fmsynth_t *fm, unsigned parameter, unsigned operator_index)
+{
+   if (parameter == FMSYNTH_PARAM_LFO_AMP_SENSITIVITY ||
+         parameter == FMSYNTH_PARAM_LFO_FREQ_MOD_DEPTH)
+   {
+      fmsynth_update_lfo_usage(fm, &fm->params);
+      return;
+   }
+
+   for (unsigned v = 0; v < fm->max_voices; v++)
+   {
+      struct fmsynth_voice_control *ctrl = &fm->controls[v];
+      if (ctrl->state != FMSYNTH_VOICE_INACTIVE && ctrl->params == &fm->params)
+      {
+         fmsynth_voice_apply_parameter(fm, &fm->voices[v], ctrl, parameter, operator_index);
+      }
+   }
+}
+
+static void fmsynth_cancel_ramps(fmsynth_t *fm, unsigned first_parameter,
+      unsigned parameters, unsigned operator_index)
+{
+   for (unsigned r = 0; r < fm->ramp_count; )
+   {
+      const struct fmsynth_ramp *ramp = &fm->ramps[r];
+      if (ramp->parameter >= first_parameter && ramp->parameter - first_parameter < parameters &&
+            (operator_index == FMSYNTH_OPERATORS || ramp->operator_index == operator_index))
+      {
+         fm->ramps[r] = fm->ramps[--fm->ramp_count];
+      }
+      else
+      {
+         r++;
+      }
+   }
+}
+
+// Advances ramps by frames which were just rendered.
+// All ramps are applied to playing voices in one pass over the voices.
+static void fmsynth_step_ramps(fmsynth_t *fm, unsigned frames)
+{
+   bool lfo_changed = false;
+   for (unsigned r = 0; r < fm->ramp_count; r++)
+   {
+      struct fmsynth_ramp *ramp = &fm->ramps[r];
+      ramp->elapsed = frames >= ramp->frames - ramp->elapsed ? ramp->frames : ramp->elapsed + frames;
+      fm->params.amp[ramp->parameter * FMSYNTH_OPERATORS + ramp->operator_index] =
+         ramp->elapsed == ramp->frames ? ramp->target : ramp->start + ramp->step * ramp->elapsed;
+
+      lfo_changed |= ramp->parameter == FMSYNTH_PARAM_LFO_AMP_SENSITIVITY ||
+         ramp->parameter == FMSYNTH_PARAM_LFO_FREQ_MOD_DEPTH;
+   }
+
+   if (lfo_changed)
+   {
+      fmsynth_update_lfo_usage(fm, &fm->params);
+   }
+
+   for (unsigned v = 0; v < fm->max_voices; v++)
+   {
+      struct fmsynth_voice_control *ctrl = &fm->controls[v];
+      if (ctrl->state == FMSYNTH_VOICE_INACTIVE || ctrl->params != &fm->params)
+      {
+         continue;
+      }
+
+      for (unsigned r = 0; r < fm->ramp_count; r++)
+      {
+         fmsynth_voice_apply_parameter(fm, &fm->voices[v], ctrl,
+               fm->ramps[r].parameter, fm->ramps[r].operator_index);
+      }
+   }
+
+   for (unsigned r = 0; r < fm->ramp_count; )
+   {
+      if (fm->ramps[r].elapsed == fm->ramps[r].frames)
+      {
+         fm->ramps[r] = fm->ramps[--fm->ramp_count];
+      }
+      else
+      {
+         r++;
+      }
+   }
+}
+
+void fmsynth_set_sample_rate(fmsynth_t *fm, float sample_rate)
+{
+   float ratio = fm->sample_rate / sample_rate;
+   fm->sample_rate = sample_rate;
+   fm->inv_sample_rate = 1.0f / sample_rate;
+
+   // Envelope positions are tracked in seconds, so only per-frame rates need rescaling.
+   for (unsigned v = 0; v < fm->max_voices; v++)
+   {
+      struct fmsynth_voice *voice = &fm->voices[v];
+      struct fmsynth_voice_control *ctrl = &fm->controls[v];
+
+      if (ctrl->state == FMSYNTH_VOICE_INACTIVE)
+      {
+         continue;
+      }
+
+      ctrl->speed = fm->inv_sample_rate;
+      ctrl->lfo_step *= ratio;
+
+      for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+      {
+         voice->step_rate[o] *= ratio;
+         ctrl->falloff[o] = fmsynth_release_falloff(fm, ctrl->release_time[o]);
+      }
+   }
+}
+
+void fmsynth_set_active_voice_limit(fmsynth_t *fm, unsigned limit)
+{
+   fm->voice_limit = min(limit, fm->max_voices);
+}
+
+void fmsynth_set_program(fmsynth_t *fm, uint8_t program,
+      const fmsynth_patch_t *patch)
+{
+   if (program < FMSYNTH_PROGRAMS)
+   {
+      fm->programs[program] = patch;
+   }
+}
+
+void fmsynth_patch_apply(fmsynth_t *fm, const fmsynth_patch_t *patch)
+{
+   fm->params = patch->params;
+   fm->global_params = patch->global_params;
+   fm->ramp_count = 0;
+   fmsynth_update_lfo_usage(fm, &fm->params);
+}
+
+static void fmsynth_part_program_change(fmsynth_t *fm, unsigned part, uint8_t program)
+{
+   const fmsynth_patch_t *patch = program < FMSYNTH_PROGRAMS ?
+      fm->programs[program] : NULL;
+
+   // Voices hold on to the parameters they were triggered with,
+   // so switching is just a pointer swap.
+   if (patch)
+   {
+      fm->parts[part].params = &patch->params;
+      fm->parts[part].global_params = &patch->global_params;
+   }
+   else
+   {
+      fm->parts[part].params = &fm->params;
+      fm->parts[part].global_params = &fm->global_params;
+   }
+}
+
+void fmsynth_program_change(fmsynth_t *fm, uint8_t program)
+{
+   FMSYNTH_STATS_BEGIN(start);
+   fmsynth_part_program_change(fm, 0, program);
+   FMSYNTH_STATS_TICKS(fm, event_ticks, start);
+}
+
+void fmsynth_set_multi_timbral(fmsynth_t *fm, bool enable)
+{
+   fm->multi_timbral = enable;
+}
+
+void fmsynth_set_global_lfo(fmsynth_t *fm, bool enable)
+{
+   fm->global_lfo = enable;
+}
+
+static void fmsynth_part_release_all(fmsynth_t *fm, unsigned part)
 {
    for (unsigned i = 0; i < fm->max_voices; i++)
    {
-      fmsynth_release_voice(&fm->voices[i]);
+      if (fm->controls[i].part == part &&
+            fm->controls[i].state != FMSYNTH_VOICE_INACTIVE)
+      {
+         fmsynth_release_voice(&fm->controls[i]);
+      }
    }
-   fm->sustained = false;
+   fm->parts[part].sustained = false;
 }
 
-fmsynth_status_t fmsynth_parse_midi(fmsynth_t *fm,
+static void fmsynth_release_all_parts(fmsynth_t *fm)
+{
+   for (unsigned i = 0; i < fm->max_voices; i++)
+   {
+      if (fm->controls[i].state != FMSYNTH_VOICE_INACTIVE)
+      {
+         fmsynth_release_voice(&fm->controls[i]);
+      }
+   }
+
+   for (unsigned p = 0; p < FMSYNTH_PARTS; p++)
+   {
+      fm->parts[p].sustained = false;
+   }
+}
+
+void fmsynth_release_all(fmsynth_t *fm)
+{
+   FMSYNTH_STATS_BEGIN(start);
+   fmsynth_release_all_parts(fm);
+   FMSYNTH_STATS_TICKS(fm, event_ticks, start);
+}
+
+static fmsynth_status_t fmsynth_parse_midi_event(fmsynth_t *fm,
       const uint8_t *data)
 {
+   // Without multi-timbral mode, every channel plays part 0.
+   unsigned part = fm->multi_timbral ? (data[0] & 0x0f) : 0;
+
    if ((data[0] & 0xf0) == 0x90)
    {
       if (data[2] != 0)
       {
-         return fmsynth_note_on(fm, data[1], data[2]);
+         return fmsynth_part_note_on(fm, part, data[1], data[2]);
       }
       else
       {
-         fmsynth_note_off(fm, data[1]);
+         fmsynth_part_note_off(fm, part, data[1]);
          return FMSYNTH_STATUS_OK;
       }
    }
    else if ((data[0] & 0xf0) == 0x80)
    {
-      fmsynth_note_off(fm, data[1]);
+      fmsynth_part_note_off(fm, part, data[1]);
       return FMSYNTH_STATUS_OK;
    }
    else if ((data[0] & 0xf0) == 0xb0 && data[1] == 64)
    {
-      fmsynth_set_sustain(fm, data[2] >= 64);
+      fmsynth_part_set_sustain(fm, part, data[2] >= 64);
       return FMSYNTH_STATUS_OK;
    }
    else if ((data[0] & 0xf0) == 0xb0 && data[1] == 1)
    {
-      fmsynth_set_mod_wheel(fm, data[2]);
+      fmsynth_part_set_mod_wheel(fm, part, data[2]);
       return FMSYNTH_STATUS_OK;
    }
-   else if ((data[0] == 0xff) ||
-         (((data[0] & 0xf0) == 0xb0) && data[1] == 120))
+   else if (data[0] == 0xff || data[0] == 0xfc)
    {
-      // Reset, All Sound Off
-      fmsynth_release_all(fm);
+      // Reset, STOP
+      fmsynth_release_all_parts(fm);
       return FMSYNTH_STATUS_OK;
    }
-   else if ((((data[0] & 0xf0) == 0xb0) && data[1] == 123) ||
-         data[0] == 0xfc)
+   else if (((data[0] & 0xf0) == 0xb0) && (data[1] == 120 || data[1] == 123))
    {
-      // All Notes Off, STOP
-      fmsynth_release_all(fm);
+      // All Sound Off, All Notes Off
+      fmsynth_part_release_all(fm, part);
+      return FMSYNTH_STATUS_OK;
+   }
+   else if ((data[0] & 0xf0) == 0xc0)
+   {
+      // Program change
+      fmsynth_part_program_change(fm, part, data[1]);
       return FMSYNTH_STATUS_OK;
    }
    else if ((data[0] & 0xf0) == 0xe0)
    {
       // Pitch bend
       uint16_t bend = data[1] | (data[2] << 7);
-      fmsynth_set_pitch_bend(fm, bend);
+      fmsynth_part_set_pitch_bend(fm, part, bend);
       return FMSYNTH_STATUS_OK;
    }
    else if (data[0] == 0xf8)
@@ -630,6 +1596,145 @@ fmsynth_status_t fmsynth_parse_midi(fmsynth_t *fm,
    }
 }
 
+fmsynth_status_t fmsynth_parse_midi(fmsynth_t *fm,
+      const uint8_t *data)
+{
+   FMSYNTH_STATS_BEGIN(start);
+   fmsynth_status_t ret = fmsynth_parse_midi_event(fm, data);
+   FMSYNTH_STATS_TICKS(fm, event_ticks, start);
+   return ret;
+}
+
+// Number of data bytes which follow a status byte, for channel and system common messages.
+static unsigned fmsynth_midi_data_bytes(uint8_t status)
+{
+   switch (status & 0xf0)
+   {
+      case 0xc0:
+      case 0xd0:
+         return 1;
+
+      case 0xf0:
+         switch (status)
+         {
+            case 0xf1:
+            case 0xf3:
+               return 1;
+            case 0xf2:
+               return 2;
+            default:
+               return 0;
+         }
+
+      default:
+         return 2;
+   }
+}
+
+fmsynth_status_t fmsynth_parse_midi_stream(fmsynth_t *fm,
+      const uint8_t *bytes, size_t len, struct fmsynth_midi_stream *stream)
+{
+   FMSYNTH_STATS_BEGIN(start);
+   fmsynth_status_t ret = FMSYNTH_STATUS_OK;
+   unsigned first_free = 0;
+
+   for (size_t i = 0; i < len; )
+   {
+      uint8_t byte = bytes[i];
+
+      if (byte >= 0xf8)
+      {
+         // Real-time messages can appear anywhere, even inside other messages, and do not affect framing.
+         if (byte == 0xfc || byte == 0xff)
+         {
+            // STOP, Reset
+            fmsynth_release_all_parts(fm);
+         }
+         i++;
+         continue;
+      }
+
+      if (byte >= 0x80)
+      {
+         // Any other status byte ends SysEx, and system messages cancel running status.
+         stream->sysex = byte == 0xf0;
+         stream->status = byte == 0xf0 || byte == 0xf7 ? 0 : byte;
+         stream->count = 0;
+
+         if (stream->status && fmsynth_midi_data_bytes(stream->status) == 0)
+         {
+            // Tune request, nothing to do.
+            stream->status = 0;
+         }
+         i++;
+         continue;
+      }
+
+      if (stream->sysex || !stream->status)
+      {
+         // SysEx payload, or data without a status byte to run from.
+         i++;
+         continue;
+      }
+
+      uint8_t status = stream->status;
+      unsigned part = fm->multi_timbral ? (status & 0x0f) : 0;
+
+      if (stream->count == 0 && (status & 0xe0) == 0x80)
+      {
+         // Runs of note on and note off, as sent by sequencers with running status, skip framing.
+         bool note_on = (status & 0xf0) == 0x90;
+         while (i + 1 < len && bytes[i] < 0x80 && bytes[i + 1] < 0x80)
+         {
+            if (note_on && bytes[i + 1] != 0)
+            {
+               fmsynth_status_t result = fmsynth_part_note_on_from(fm, part,
+                     bytes[i], bytes[i + 1], &first_free);
+               if (result != FMSYNTH_STATUS_OK)
+               {
+                  ret = result;
+               }
+            }
+            else
+            {
+               fmsynth_part_note_off(fm, part, bytes[i]);
+            }
+            i += 2;
+         }
+
+         if (i >= len || bytes[i] >= 0x80)
+         {
+            continue;
+         }
+         byte = bytes[i];
+      }
+
+      stream->data[stream->count++] = byte;
+      i++;
+
+      if (stream->count == fmsynth_midi_data_bytes(status))
+      {
+         stream->count = 0;
+         if (status >= 0xf0)
+         {
+            // System common messages are skipped, and have no running status.
+            stream->status = 0;
+            continue;
+         }
+
+         const uint8_t message[3] = { status, stream->data[0], stream->data[1] };
+         fmsynth_status_t result = fmsynth_parse_midi_event(fm, message);
+         if (result != FMSYNTH_STATUS_OK)
+         {
+            ret = result;
+         }
+      }
+   }
+
+   FMSYNTH_STATS_TICKS(fm, event_ticks, start);
+   return ret;
+}
+
 struct fmsynth_parameter_data
 {
     const char *name;
@@ -637,305 +1742,1736 @@ struct fmsynth_parameter_data
     float maximum;
     float default_value;
     bool logarithmic;
+    // log2 of minimum and maximum, for logarithmic parameters only.
+    float log2_minimum;
+    float log2_maximum;
 };
 
-static const struct fmsynth_parameter_data global_parameter_data[] = {
-    { "Amp", 0.0f, 1.0f, 0.2f, false },
-    { "LFO Freq", 0.1f, 64.0f, 0.1f, true },
+static const struct fmsynth_parameter_data global_parameter_data[] = {
+    { "Amp", 0.0f, 1.0f, 0.2f, false, 0.0f, 0.0f },
+    { "LFO Freq", 0.1f, 64.0f, 0.1f, true, -3.32192809f, 6.0f },
+};
+
+static const struct fmsynth_parameter_data parameter_data[] = {
+    { "Volume", 0.005f, 16.0f, 1.0f, true, -7.64385619f, 4.0f },
+    { "Pan", -1.0f, 1.0f, 0.0f, false, 0.0f, 0.0f },
+    { "FreqMod", 0.0f, 16.0f, 1.0f, false, 0.0f, 0.0f },
+    { "FreqOffset", -128.0f, 128.0f, 0.0f, false, 0.0f, 0.0f },
+    { "Env T0", 0.0f, 1.0f, 1.0f, false, 0.0f, 0.0f },
+    { "Env T1", 0.0f, 1.0f, 0.5f, false, 0.0f, 0.0f },
+    { "Env T2", 0.0f, 1.0f, 0.25f, false, 0.0f, 0.0f },
+    { "Env D0", 0.005f, 8.0f, 0.05f, true, -7.64385619f, 3.0f },
+    { "Env D1", 0.005f, 8.0f, 0.05f, true, -7.64385619f, 3.0f },
+    { "Env D2", 0.005f, 8.0f, 0.25f, true, -7.64385619f, 3.0f },
+    { "Env Rel", 0.005f, 8.0f, 0.5f, true, -7.64385619f, 3.0f },
+    { "KeyScale Mid", 50.0f, 5000.0f, 440.0f, true, 5.64385619f, 12.2877124f },
+    { "KeyScale LoFactor", -2.0f, 2.0f, 0.0f, false, 0.0f, 0.0f },
+    { "KeyScale HiFactor", -2.0f, 2.0f, 0.0f, false, 0.0f, 0.0f },
+    { "Velocity Sensitivity", 0.0f, 1.0f, 1.0f, false, 0.0f, 0.0f },
+    { "ModWheel Sensitivity", 0.0f, 1.0f, 0.0f, false, 0.0f, 0.0f },
+    { "LFOAmpDepth", 0.0f, 1.0f, 0.0f, false, 0.0f, 0.0f },
+    { "LFOFreqDepth", 0.0f, 0.025f, 0.0f, false, 0.0f, 0.0f },
+    { "Enable", 0.0f, 1.0f, 1.0f, false, 0.0f, 0.0f },
+    { "Carrier", 0.0f, 1.0f, 1.0f, false, 0.0f, 0.0f },
+    { "Mod0ToOperator", 0.0f, 1.0f, 0.0f, false, 0.0f, 0.0f },
+    { "Mod1ToOperator", 0.0f, 1.0f, 0.0f, false, 0.0f, 0.0f },
+    { "Mod2ToOperator", 0.0f, 1.0f, 0.0f, false, 0.0f, 0.0f },
+    { "Mod3ToOperator", 0.0f, 1.0f, 0.0f, false, 0.0f, 0.0f },
+    { "Mod4ToOperator", 0.0f, 1.0f, 0.0f, false, 0.0f, 0.0f },
+    { "Mod5ToOperator", 0.0f, 1.0f, 0.0f, false, 0.0f, 0.0f },
+    { "Mod6ToOperator", 0.0f, 1.0f, 0.0f, false, 0.0f, 0.0f },
+    { "Mod7ToOperator", 0.0f, 1.0f, 0.0f, false, 0.0f, 0.0f },
+};
+
+// Every modulation row has the same range, so builds with more than 8 operators
+// share the entries above for the remaining rows.
+static const struct fmsynth_parameter_data *fmsynth_parameter_data(unsigned parameter)
+{
+   const unsigned entries = sizeof(parameter_data) / sizeof(parameter_data[0]);
+   if (parameter >= entries)
+      parameter = FMSYNTH_PARAM_MOD_TO_CARRIERS0;
+   return &parameter_data[parameter];
+}
+
+void fmsynth_set_parameter(fmsynth_t *fm,
+      unsigned parameter, unsigned operator_index, float value)
+{
+   if (parameter < FMSYNTH_PARAM_END && operator_index < FMSYNTH_OPERATORS)
+   {
+      float *param = fm->params.amp;
+      param[parameter * FMSYNTH_OPERATORS + operator_index] = value;
+      fmsynth_cancel_ramps(fm, parameter, 1, operator_index);
+
+      if (parameter == FMSYNTH_PARAM_LFO_AMP_SENSITIVITY ||
+            parameter == FMSYNTH_PARAM_LFO_FREQ_MOD_DEPTH)
+      {
+         fmsynth_update_lfo_usage(fm, &fm->params);
+      }
+   }
+}
+
+fmsynth_status_t fmsynth_set_parameter_ramp(fmsynth_t *fm,
+      unsigned parameter, unsigned operator_index, float target, unsigned frames)
+{
+   // Enable is a switch, fractional values in between have no meaning.
+   if (parameter >= FMSYNTH_PARAM_END || operator_index >= FMSYNTH_OPERATORS ||
+         parameter == FMSYNTH_PARAM_ENABLE)
+   {
+      return FMSYNTH_STATUS_UNSUPPORTED;
+   }
+
+   fmsynth_cancel_ramps(fm, parameter, 1, operator_index);
+
+   if (frames == 0)
+   {
+      fm->params.amp[parameter * FMSYNTH_OPERATORS + operator_index] = target;
+      fmsynth_apply_parameter(fm, parameter, operator_index);
+      return FMSYNTH_STATUS_OK;
+   }
+
+   if (fm->ramp_count == FMSYNTH_RAMPS)
+   {
+      return FMSYNTH_STATUS_BUSY;
+   }
+
+   float value = fm->params.amp[parameter * FMSYNTH_OPERATORS + operator_index];
+   struct fmsynth_ramp *ramp = &fm->ramps[fm->ramp_count++];
+   ramp->parameter = parameter;
+   ramp->operator_index = operator_index;
+   ramp->elapsed = 0;
+   ramp->frames = frames;
+   ramp->start = value;
+   ramp->step = (target - value) / frames;
+   ramp->target = target;
+   return FMSYNTH_STATUS_OK;
+}
+
+void fmsynth_set_parameters(fmsynth_t *fm,
+      unsigned first_parameter, unsigned parameters, const float *values)
+{
+   if (first_parameter >= FMSYNTH_PARAM_END)
+   {
+      return;
+   }
+   if (parameters > FMSYNTH_PARAM_END - first_parameter)
+   {
+      parameters = FMSYNTH_PARAM_END - first_parameter;
+   }
+
+   memcpy(fm->params.amp + first_parameter * FMSYNTH_OPERATORS, values,
+         parameters * FMSYNTH_OPERATORS * sizeof(float));
+   fmsynth_cancel_ramps(fm, first_parameter, parameters, FMSYNTH_OPERATORS);
+
+   unsigned end = first_parameter + parameters;
+   if ((first_parameter <= FMSYNTH_PARAM_LFO_AMP_SENSITIVITY && FMSYNTH_PARAM_LFO_AMP_SENSITIVITY < end) ||
+         (first_parameter <= FMSYNTH_PARAM_LFO_FREQ_MOD_DEPTH && FMSYNTH_PARAM_LFO_FREQ_MOD_DEPTH < end))
+   {
+      fmsynth_update_lfo_usage(fm, &fm->params);
+   }
+}
+
+void fmsynth_get_parameters(fmsynth_t *fm,
+      unsigned first_parameter, unsigned parameters, float *values)
+{
+   if (first_parameter >= FMSYNTH_PARAM_END)
+   {
+      return;
+   }
+   if (parameters > FMSYNTH_PARAM_END - first_parameter)
+   {
+      parameters = FMSYNTH_PARAM_END - first_parameter;
+   }
+
+   memcpy(values, fm->params.amp + first_parameter * FMSYNTH_OPERATORS,
+         parameters * FMSYNTH_OPERATORS * sizeof(float));
+}
+
+static float convert_from_normalized(const struct fmsynth_parameter_data *data, float value)
+{
+   if (data->logarithmic)
+      return exp2f(data->log2_minimum * (1.0f - value) + data->log2_maximum * value);
+   else
+      return data->minimum * (1.0f - value) + data->maximum * value;
+}
+
+static float convert_to_normalized(const struct fmsynth_parameter_data *data, float value)
+{
+   if (data->logarithmic)
+      return (log2f(value) - data->log2_minimum) / (data->log2_maximum - data->log2_minimum);
+   else
+      return (value - data->minimum) / (data->maximum - data->minimum);
+}
+
+// Polynomial exp2 and log2 for batch conversion. Unlike libm calls, loops over these vectorize.
+// Relative error is below 1e-6 within the range of the parameters.
+static inline float fmsynth_exp2_approx(float x)
+{
+   x = x < -126.0f ? -126.0f : (x > 127.0f ? 127.0f : x);
+
+   // 2^x = 2^n * 2^f, with f in [-0.5, 0.5].
+   float n = floorf(x + 0.5f);
+   float f = (x - n) * 0.69314718f;
+
+   // Taylor series of e^f.
+   float p = 1.0f + f * (1.0f + f * (0.5f + f * (1.0f / 6.0f + f * (1.0f / 24.0f +
+               f * (1.0f / 120.0f + f * (1.0f / 720.0f + f * (1.0f / 5040.0f)))))));
+
+   uint32_t bits = (uint32_t)((int32_t)n + 127) << 23;
+   float scale;
+   memcpy(&scale, &bits, sizeof(scale));
+   return p * scale;
+}
+
+static inline float fmsynth_log2_approx(float x)
+{
+   uint32_t bits;
+   memcpy(&bits, &x, sizeof(bits));
+
+   // x = 2^e * m, with m in [sqrt(0.5), sqrt(2)).
+   int32_t e = ((int32_t)bits - 0x3f3504f3) >> 23;
+   bits -= (uint32_t)e << 23;
+   float m;
+   memcpy(&m, &bits, sizeof(m));
+
+   // ln(m) = 2 * atanh(t), with t = (m - 1) / (m + 1) in [-0.172, 0.172].
+   float t = (m - 1.0f) / (m + 1.0f);
+   float t2 = t * t;
+   float ln = 2.0f * t * (1.0f + t2 * (1.0f / 3.0f + t2 * (1.0f / 5.0f + t2 * (1.0f / 7.0f + t2 * (1.0f / 9.0f)))));
+   return (float)e + ln * 1.44269504f;
+}
+
+// Every row of operators shares one parameter, so each row is converted with a branch-free loop.
+// Rows are converted in a local copy, so in and out may alias without defeating vectorization.
+static void convert_from_normalized_row(const struct fmsynth_parameter_data *data,
+      float *row)
+{
+   if (data->logarithmic)
+   {
+      float base = data->log2_minimum;
+      float range = data->log2_maximum - data->log2_minimum;
+      for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+      {
+         row[o] = fmsynth_exp2_approx(base + range * row[o]);
+      }
+   }
+   else
+   {
+      float minimum = data->minimum;
+      float maximum = data->maximum;
+      for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+      {
+         row[o] = minimum * (1.0f - row[o]) + maximum * row[o];
+      }
+   }
+}
+
+static void convert_to_normalized_row(const struct fmsynth_parameter_data *data,
+      float *row)
+{
+   if (data->logarithmic)
+   {
+      float base = data->log2_minimum;
+      float inv_range = 1.0f / (data->log2_maximum - data->log2_minimum);
+      for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+      {
+         row[o] = (fmsynth_log2_approx(row[o]) - base) * inv_range;
+      }
+   }
+   else
+   {
+      float minimum = data->minimum;
+      float range = data->maximum - data->minimum;
+      for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+      {
+         row[o] = (row[o] - minimum) / range;
+      }
+   }
+}
+
+void fmsynth_convert_from_normalized_parameters(fmsynth_t *fm,
+      unsigned first_parameter, unsigned parameters, const float *in, float *out)
+{
+   (void)fm;
+   for (unsigned p = 0; p < parameters && first_parameter + p < FMSYNTH_PARAM_END; p++)
+   {
+      float row[FMSYNTH_OPERATORS];
+      memcpy(row, in + p * FMSYNTH_OPERATORS, sizeof(row));
+      convert_from_normalized_row(fmsynth_parameter_data(first_parameter + p), row);
+      memcpy(out + p * FMSYNTH_OPERATORS, row, sizeof(row));
+   }
+}
+
+void fmsynth_convert_to_normalized_parameters(fmsynth_t *fm,
+      unsigned first_parameter, unsigned parameters, const float *in, float *out)
+{
+   (void)fm;
+   for (unsigned p = 0; p < parameters && first_parameter + p < FMSYNTH_PARAM_END; p++)
+   {
+      float row[FMSYNTH_OPERATORS];
+      memcpy(row, in + p * FMSYNTH_OPERATORS, sizeof(row));
+      convert_to_normalized_row(fmsynth_parameter_data(first_parameter + p), row);
+      memcpy(out + p * FMSYNTH_OPERATORS, row, sizeof(row));
+   }
+}
+
+float fmsynth_convert_to_normalized_global_parameter(fmsynth_t *fm,
+                                                     unsigned parameter, float value)
+{
+   (void)fm;
+   if (parameter < FMSYNTH_GLOBAL_PARAM_END)
+   {
+      const struct fmsynth_parameter_data *data = &global_parameter_data[parameter];
+      return convert_to_normalized(data, value);
+   }
+   else
+      return 0.0f;
+}
+
+float fmsynth_convert_from_normalized_global_parameter(fmsynth_t *fm,
+                                                       unsigned parameter, float value)
+{
+   (void)fm;
+   if (parameter < FMSYNTH_GLOBAL_PARAM_END)
+   {
+      const struct fmsynth_parameter_data *data = &global_parameter_data[parameter];
+      return convert_from_normalized(data, value);
+   }
+   else
+      return 0.0f;
+}
+
+float fmsynth_convert_to_normalized_parameter(fmsynth_t *fm,
+                                              unsigned parameter, float value)
+{
+   (void)fm;
+   if (parameter < FMSYNTH_PARAM_END)
+   {
+      const struct fmsynth_parameter_data *data = fmsynth_parameter_data(parameter);
+      return convert_to_normalized(data, value);
+   }
+   else
+      return 0.0f;
+}
+
+float fmsynth_convert_from_normalized_parameter(fmsynth_t *fm,
+                                                unsigned parameter, float value)
+{
+   (void)fm;
+   if (parameter < FMSYNTH_PARAM_END)
+   {
+      const struct fmsynth_parameter_data *data = fmsynth_parameter_data(parameter);
+      return convert_from_normalized(data, value);
+   }
+   else
+      return 0.0f;
+}
+
+float fmsynth_get_parameter(fmsynth_t *fm,
+                            unsigned parameter, unsigned operator_index)
+{
+   if (parameter < FMSYNTH_PARAM_END && operator_index < FMSYNTH_OPERATORS)
+   {
+      float *param = fm->params.amp;
+      return param[parameter * FMSYNTH_OPERATORS + operator_index];
+   }
+   else
+      return 0.0f;
+}
+
+void fmsynth_set_global_parameter(fmsynth_t *fm,
+      unsigned parameter, float value)
+{
+   if (parameter < FMSYNTH_GLOBAL_PARAM_END)
+   {
+      float *param = &fm->global_params.volume;
+      param[parameter] = value;
+   }
+}
+
+float fmsynth_get_global_parameter(fmsynth_t *fm,
+                                   unsigned parameter)
+{
+   if (parameter < FMSYNTH_GLOBAL_PARAM_END)
+   {
+      float *param = &fm->global_params.volume;
+      return param[parameter];
+   }
+   else
+      return 0.0f;
+}
+
+static bool fmsynth_voice_update_active(struct fmsynth_voice_control *ctrl)
+{
+   if (ctrl->enable & (~ctrl->dead))
+   {
+      return true;
+   }
+   else
+   {
+      ctrl->state = FMSYNTH_VOICE_INACTIVE;
+      return false;
+   }
+}
+
+static float fmsynth_oscillator(float phase)
+{
+   float x = phase < 0.5f ? (phase - 0.25f) : (0.75f - phase);
+
+   float x2 = x * x;
+   float x3 = x2 * x;
+   x *= 2.0f * PI;
+   x -= x3 * INV_FACTORIAL_3_2PIPOW3;
+
+   float x5 = x3 * x2;
+   x += x5 * INV_FACTORIAL_5_2PIPOW5;
+
+   float x7 = x5 * x2;
+   x -= x7 * INV_FACTORIAL_7_2PIPOW7;
+
+   return x;
+}
+
+// Drops the last term of fmsynth_oscillator(), error is about -47 dB.
+static float fmsynth_oscillator_low_precision(float phase)
+{
+   float x = phase < 0.5f ? (phase - 0.25f) : (0.75f - phase);
+
+   float x2 = x * x;
+   float x3 = x2 * x;
+   x *= 2.0f * PI;
+   x -= x3 * INV_FACTORIAL_3_2PIPOW3;
+
+   float x5 = x3 * x2;
+   x += x5 * INV_FACTORIAL_5_2PIPOW5;
+
+   return x;
+}
+
+// Kernels are specialized to a multiple of 4 operators, see fmsynth_set_operators().
+#define FMSYNTH_WIDTHS (FMSYNTH_OPERATORS / 4)
+#define FMSYNTH_WIDTH_INDEX(operators) (((operators) + 3) / 4 - 1)
+
+#if FMSYNTH_OPERATORS >= 8
+#define FMSYNTH_IF_WIDTH_8(...) __VA_ARGS__
+#else
+#define FMSYNTH_IF_WIDTH_8(...)
+#endif
+#if FMSYNTH_OPERATORS >= 12
+#define FMSYNTH_IF_WIDTH_12(...) __VA_ARGS__
+#else
+#define FMSYNTH_IF_WIDTH_12(...)
+#endif
+#if FMSYNTH_OPERATORS >= 16
+#define FMSYNTH_IF_WIDTH_16(...) __VA_ARGS__
+#else
+#define FMSYNTH_IF_WIDTH_16(...)
+#endif
+
+// Expands macro(impl, prefix, operators) for every multiple of 4 operators up to FMSYNTH_OPERATORS.
+#define FMSYNTH_FOR_EACH_WIDTH(macro, impl, prefix) \
+   macro(impl, prefix, 4) \
+   FMSYNTH_IF_WIDTH_8(macro(impl, prefix, 8)) \
+   FMSYNTH_IF_WIDTH_12(macro(impl, prefix, 12)) \
+   FMSYNTH_IF_WIDTH_16(macro(impl, prefix, 16))
+
+// Instantiates every variant of a kernel from a force-inlined implementation,
+// and tables of them indexed by FMSYNTH_WIDTH_INDEX(), named prefix##_tables.
+#define FMSYNTH_KERNEL_VARIANT(impl, name, operators, low_precision, mix) \
+   static void name(const struct fmsynth_voice_parameters *params, \
+         struct fmsynth_voice *voice, float *left, float *right, unsigned frames) \
+   { \
+      impl(params, voice, left, right, frames, operators, low_precision, mix); \
+   }
+
+#define FMSYNTH_KERNEL_WIDTH(impl, prefix, operators) \
+   FMSYNTH_KERNEL_VARIANT(impl, prefix##_##operators##_stereo, operators, false, FMSYNTH_MIX_STEREO) \
+   FMSYNTH_KERNEL_VARIANT(impl, prefix##_##operators##_centered, operators, false, FMSYNTH_MIX_CENTERED) \
+   FMSYNTH_KERNEL_VARIANT(impl, prefix##_##operators##_mono, operators, false, FMSYNTH_MIX_MONO) \
+   FMSYNTH_KERNEL_VARIANT(impl, prefix##_##operators##_stereo_low, operators, true, FMSYNTH_MIX_STEREO) \
+   FMSYNTH_KERNEL_VARIANT(impl, prefix##_##operators##_centered_low, operators, true, FMSYNTH_MIX_CENTERED) \
+   FMSYNTH_KERNEL_VARIANT(impl, prefix##_##operators##_mono_low, operators, true, FMSYNTH_MIX_MONO)
+
+#define FMSYNTH_KERNEL_TABLE(impl, prefix, operators) \
+   { \
+      { prefix##_##operators##_stereo, prefix##_##operators##_centered, prefix##_##operators##_mono }, \
+      { prefix##_##operators##_stereo_low, prefix##_##operators##_centered_low, prefix##_##operators##_mono_low }, \
+   },
+
+#define FMSYNTH_KERNEL_VARIANTS(impl, prefix) \
+   FMSYNTH_FOR_EACH_WIDTH(FMSYNTH_KERNEL_WIDTH, impl, prefix) \
+   static const fmsynth_kernel_table_t prefix##_tables[FMSYNTH_WIDTHS] = { \
+      FMSYNTH_FOR_EACH_WIDTH(FMSYNTH_KERNEL_TABLE, impl, prefix) \
+   };
+
+#define FMSYNTH_PAIR_KERNEL_VARIANT(impl, name, operators, low_precision, mix) \
+   static void name(const struct fmsynth_voice_parameters *params_a, struct fmsynth_voice *voice_a, \
+         const struct fmsynth_voice_parameters *params_b, struct fmsynth_voice *voice_b, \
+         float *left, float *right, unsigned frames) \
+   { \
+      impl(params_a, voice_a, params_b, voice_b, left, right, frames, operators, low_precision, mix); \
+   }
+
+#define FMSYNTH_PAIR_KERNEL_WIDTH(impl, prefix, operators) \
+   FMSYNTH_PAIR_KERNEL_VARIANT(impl, prefix##_pair_##operators##_stereo, operators, false, FMSYNTH_MIX_STEREO) \
+   FMSYNTH_PAIR_KERNEL_VARIANT(impl, prefix##_pair_##operators##_centered, operators, false, FMSYNTH_MIX_CENTERED) \
+   FMSYNTH_PAIR_KERNEL_VARIANT(impl, prefix##_pair_##operators##_mono, operators, false, FMSYNTH_MIX_MONO) \
+   FMSYNTH_PAIR_KERNEL_VARIANT(impl, prefix##_pair_##operators##_stereo_low, operators, true, FMSYNTH_MIX_STEREO) \
+   FMSYNTH_PAIR_KERNEL_VARIANT(impl, prefix##_pair_##operators##_centered_low, operators, true, FMSYNTH_MIX_CENTERED) \
+   FMSYNTH_PAIR_KERNEL_VARIANT(impl, prefix##_pair_##operators##_mono_low, operators, true, FMSYNTH_MIX_MONO)
+
+#define FMSYNTH_PAIR_KERNEL_TABLE(impl, prefix, operators) \
+   { \
+      { prefix##_pair_##operators##_stereo, prefix##_pair_##operators##_centered, prefix##_pair_##operators##_mono }, \
+      { prefix##_pair_##operators##_stereo_low, prefix##_pair_##operators##_centered_low, prefix##_pair_##operators##_mono_low }, \
+   },
+
+#define FMSYNTH_PAIR_KERNEL_VARIANTS(impl, prefix) \
+   FMSYNTH_FOR_EACH_WIDTH(FMSYNTH_PAIR_KERNEL_WIDTH, impl, prefix) \
+   static const fmsynth_pair_kernel_table_t prefix##_pair_tables[FMSYNTH_WIDTHS] = { \
+      FMSYNTH_FOR_EACH_WIDTH(FMSYNTH_PAIR_KERNEL_TABLE, impl, prefix) \
+   };
+
+// Carrier gains for the left or only mix of a kernel call.
+// Mono gains are derived here once per call, so they do not take up space in struct fmsynth_voice.
+static FMSYNTH_ALWAYS_INLINE const float *fmsynth_voice_mix_amp(const struct fmsynth_voice *voice,
+      float *mono_amp, unsigned operators, enum fmsynth_mix mix)
+{
+   if (mix != FMSYNTH_MIX_MONO)
+   {
+      return voice->pan_amp[0];
+   }
+
+   for (unsigned o = 0; o < operators; o++)
+   {
+      mono_amp[o] = 0.5f * (voice->pan_amp[0][o] + voice->pan_amp[1][o]);
+   }
+   return mono_amp;
+}
+
+static FMSYNTH_ALWAYS_INLINE void fmsynth_process_frames_generic(
+      const struct fmsynth_voice_parameters *params,
+      struct fmsynth_voice *voice, float *left, float *right, unsigned frames,
+      unsigned operators, bool low_precision, enum fmsynth_mix mix)
+{
+   float cached[FMSYNTH_OPERATORS];
+   float cached_modulator[FMSYNTH_OPERATORS];
+   float steps[FMSYNTH_OPERATORS];
+   float mono_amp[FMSYNTH_OPERATORS];
+   const float *amp = fmsynth_voice_mix_amp(voice, mono_amp, operators, mix);
+
+   for (unsigned f = 0; f < frames; f++)
+   {
+      for (unsigned o = 0; o < operators; o++)
+      {
+         steps[o] = voice->lfo_freq_mod[o] * voice->step_rate[o];
+      }
+
+      for (unsigned o = 0; o < operators; o++)
+      {
+         float value = voice->env[o] * voice->read_mod[o] *
+            (low_precision ?
+             fmsynth_oscillator_low_precision(voice->phases[o]) :
+             fmsynth_oscillator(voice->phases[o]));
+
+         cached[o] = value;
+         cached_modulator[o] = value * voice->step_rate[o];
+         voice->env[o] += voice->target_env_step[o];
+      }
+
+      for (unsigned o = 0; o < operators; o++)
+      {
+         float scalar = cached_modulator[o];
+         const float *vec = params->mod_to_carriers[o];
+         for (unsigned j = 0; j < operators; j++)
+            steps[j] += scalar * vec[j];
+      }
+
+      for (unsigned o = 0; o < operators; o++)
+      {
+         voice->phases[o] += steps[o];
+         voice->phases[o] -= floorf(voice->phases[o]);
+      }
+
+      if (mix == FMSYNTH_MIX_STEREO)
+      {
+         for (unsigned o = 0; o < operators; o++)
+         {
+            left[f]  += cached[o] * voice->pan_amp[0][o];
+            right[f] += cached[o] * voice->pan_amp[1][o];
+         }
+      }
+      else
+      {
+         float sum = 0.0f;
+         for (unsigned o = 0; o < operators; o++)
+         {
+            sum += cached[o] * amp[o];
+         }
+
+         left[f] += sum;
+         if (mix == FMSYNTH_MIX_CENTERED)
+         {
+            right[f] += sum;
+         }
+      }
+   }
+}
+
+FMSYNTH_KERNEL_VARIANTS(fmsynth_process_frames_generic, fmsynth_process_frames_c)
+
+// The AVX kernel needs every operator array 32-byte aligned, and uses the SSE kernel for 4 operator remainders.
+#if defined(__AVX__) && defined(FMSYNTH_SIMD) && FMSYNTH_OPERATORS % 8 == 0
+#include "x86/fmsynth_sse.c"
+#include "x86/fmsynth_avx.c"
+#define FMSYNTH_SIMD_KERNEL_NAME "avx"
+#elif defined(__SSE__) && defined(FMSYNTH_SIMD)
+#include "x86/fmsynth_sse.c"
+FMSYNTH_KERNEL_VARIANTS(fmsynth_process_frames_sse, fmsynth_process_frames_simd)
+FMSYNTH_PAIR_KERNEL_VARIANTS(fmsynth_process_frames_pair_sse, fmsynth_process_frames_simd)
+#define FMSYNTH_SIMD_KERNEL_NAME "sse"
+#elif defined(__ARM_NEON__) && defined(FMSYNTH_SIMD) && FMSYNTH_OPERATORS == 8
+#include "arm/fmsynth_arm.c"
+#define FMSYNTH_SIMD_KERNEL_NAME "neon"
+#endif
+
+static const fmsynth_kernel_table_t *fmsynth_get_kernels(enum fmsynth_kernel kernel,
+      unsigned operators)
+{
+#ifdef FMSYNTH_SIMD_KERNEL_NAME
+   if (kernel == FMSYNTH_KERNEL_SIMD)
+   {
+      return &fmsynth_process_frames_simd_tables[FMSYNTH_WIDTH_INDEX(operators)];
+   }
+#endif
+   (void)kernel;
+   return &fmsynth_process_frames_c_tables[FMSYNTH_WIDTH_INDEX(operators)];
+}
+
+static const fmsynth_pair_kernel_table_t *fmsynth_get_pair_kernels(enum fmsynth_kernel kernel,
+      unsigned operators)
+{
+#ifdef FMSYNTH_SIMD_KERNEL_NAME
+   if (kernel == FMSYNTH_KERNEL_SIMD)
+   {
+      return &fmsynth_process_frames_simd_pair_tables[FMSYNTH_WIDTH_INDEX(operators)];
+   }
+#endif
+   // The C kernel relies on the compiler to schedule a single voice.
+   (void)kernel;
+   (void)operators;
+   return NULL;
+}
+
+fmsynth_status_t fmsynth_set_kernel(fmsynth_t *fm, enum fmsynth_kernel kernel)
+{
+   // With the JIT, voices without generated code use the fastest static kernel.
+   enum fmsynth_kernel fallback = kernel;
+
+   switch (kernel)
+   {
+      case FMSYNTH_KERNEL_JIT:
+#ifdef FMSYNTH_HAVE_JIT
+         if (!fm->jit && !(fm->jit = fmsynth_jit_new()))
+         {
+            return FMSYNTH_STATUS_UNSUPPORTED;
+         }
+#else
+         return FMSYNTH_STATUS_UNSUPPORTED;
+#endif
+         // Fall through.
+      case FMSYNTH_KERNEL_DEFAULT:
+#ifdef FMSYNTH_SIMD_KERNEL_NAME
+         fallback = FMSYNTH_KERNEL_SIMD;
+#else
+         fallback = FMSYNTH_KERNEL_C;
+#endif
+         break;
+
+      case FMSYNTH_KERNEL_C:
+         break;
+
+      case FMSYNTH_KERNEL_SIMD:
+#ifdef FMSYNTH_SIMD_KERNEL_NAME
+         break;
+#else
+         return FMSYNTH_STATUS_UNSUPPORTED;
+#endif
+
+      default:
+         return FMSYNTH_STATUS_UNSUPPORTED;
+   }
+
+#ifdef FMSYNTH_HAVE_JIT
+   if (kernel != FMSYNTH_KERNEL_JIT && fm->jit)
+   {
+      fmsynth_jit_free(fm->jit);
+      fm->jit = NULL;
+   }
+
+   for (unsigned i = 0; i < fm->max_voices; i++)
+   {
+      fm->controls[i].jit_slot = 0;
+   }
+#endif
+
+   fm->kernel = kernel == FMSYNTH_KERNEL_JIT ? kernel : fallback;
+   fm->kernels = fmsynth_get_kernels(fallback, fm->operators);
+   fm->pair_kernels = fmsynth_get_pair_kernels(fallback, fm->operators);
+   return FMSYNTH_STATUS_OK;
+}
+
+const char *fmsynth_get_kernel_name(const fmsynth_t *fm)
+{
+   if (fm->kernel == FMSYNTH_KERNEL_JIT)
+   {
+      return "jit";
+   }
+#ifdef FMSYNTH_SIMD_KERNEL_NAME
+   if (fm->kernel == FMSYNTH_KERNEL_SIMD)
+   {
+      return FMSYNTH_SIMD_KERNEL_NAME;
+   }
+#endif
+   (void)fm;
+   return "c";
+}
+
+fmsynth_status_t fmsynth_set_operators(fmsynth_t *fm, unsigned operators)
+{
+   if (operators == 0 || operators > FMSYNTH_OPERATORS)
+   {
+      return FMSYNTH_STATUS_UNSUPPORTED;
+   }
+
+   // Voices may have operators enabled which the new kernels do not render.
+   FMSYNTH_STATS_ADD(fm, voices_retired, fm->active_voices);
+   for (unsigned i = 0; i < fm->max_voices; i++)
+   {
+      fm->controls[i].state = FMSYNTH_VOICE_INACTIVE;
+   }
+   fm->active_voices = 0;
+
+   fm->operators = operators;
+   return fmsynth_set_kernel(fm, fm->kernel);
+}
+
+unsigned fmsynth_get_operators(const fmsynth_t *fm)
+{
+   return fm->operators;
+}
+
+// Control-rate update, every FMSYNTH_FRAMES_PER_LFO << control_shift frames.
+static void fmsynth_voice_control_tick(const fmsynth_t *fm, struct fmsynth_voice *voice,
+      struct fmsynth_voice_control *ctrl, unsigned control_shift)
+{
+   // Only change interval at a tick, so envelope steps always match the interval.
+   ctrl->control_shift = control_shift;
+   ctrl->count = 0;
+
+   if (fm->global_lfo)
+   {
+      if (ctrl->lfo && ctrl->lfo_value != fm->parts[ctrl->part].lfo_value)
+      {
+         ctrl->lfo_value = fm->parts[ctrl->part].lfo_value;
+         fmsynth_voice_set_lfo_value(voice, ctrl, ctrl->params, ctrl->lfo_value);
+      }
+   }
+   else
+   {
+      // Phase keeps running, so the LFO is in the right place if depths are edited while the voice plays.
+      float lfo_phase = ctrl->lfo_phase;
+      ctrl->lfo_phase += ctrl->lfo_step * (float)(1u << control_shift);
+      ctrl->lfo_phase -= floorf(ctrl->lfo_phase);
+
+      if (ctrl->lfo)
+      {
+         ctrl->lfo_value = fmsynth_oscillator(lfo_phase);
+         fmsynth_voice_set_lfo_value(voice, ctrl, ctrl->params, ctrl->lfo_value);
+      }
+   }
+
+   fmsynth_update_target_envelope(voice, ctrl);
+}
+
+// In global LFO mode, every part steps its LFO once per render call.
+// All parts are stepped, so voices of any part see a running LFO even if multi-timbral mode is toggled.
+static void fmsynth_step_global_lfo(fmsynth_t *fm, unsigned frames)
+{
+   for (unsigned p = 0; p < FMSYNTH_PARTS; p++)
+   {
+      struct fmsynth_part *part = &fm->parts[p];
+      part->lfo_value = fmsynth_oscillator(part->lfo_phase);
+      part->lfo_phase += frames * part->global_params->lfo_freq * fm->inv_sample_rate;
+      part->lfo_phase -= floorf(part->lfo_phase);
+   }
+}
+
+static enum fmsynth_mix fmsynth_voice_mix(const struct fmsynth_voice_control *ctrl, bool mono)
+{
+   return mono ? FMSYNTH_MIX_MONO :
+      (ctrl->centered ? FMSYNTH_MIX_CENTERED : FMSYNTH_MIX_STEREO);
+}
+
+#ifdef FMSYNTH_HAVE_JIT
+// Generated code only covers full precision stereo and centered mixes.
+static const struct fmsynth_jit_slot *fmsynth_voice_jit(const fmsynth_t *fm,
+      const struct fmsynth_voice_control *ctrl, bool mono)
+{
+   if (!ctrl->jit_slot || mono || ctrl->low_precision)
+   {
+      return NULL;
+   }
+   return &fm->jit->slots[ctrl->jit_slot - 1];
+}
+#endif
+
+// In mono, right is ignored and should alias left.
+static void fmsynth_render_voice(fmsynth_t *fm,
+      struct fmsynth_voice *voice, struct fmsynth_voice_control *ctrl,
+      float *left, float *right, unsigned frames, bool mono)
+{
+   enum fmsynth_mix mix = fmsynth_voice_mix(ctrl, mono);
+   fmsynth_process_frames_t process_frames = (*fm->kernels)[ctrl->low_precision][mix];
+#ifdef FMSYNTH_HAVE_JIT
+   const struct fmsynth_jit_slot *slot = fmsynth_voice_jit(fm, ctrl, mono);
+   if (slot)
+   {
+      process_frames = slot->process_frames;
+   }
+#endif
+
+   while (frames)
+   {
+      unsigned interval = FMSYNTH_FRAMES_PER_LFO << ctrl->control_shift;
+      unsigned to_render = min(interval - ctrl->count, frames);
+
+      FMSYNTH_STATS_BEGIN(process_start);
+      process_frames(ctrl->params, voice, left, right, to_render);
+      FMSYNTH_STATS_TICKS(fm, process_ticks, process_start);
+
+      left += to_render;
+      right += to_render;
+      frames -= to_render;
+      ctrl->count += to_render;
+
+      if (ctrl->count == interval)
+      {
+         FMSYNTH_STATS_BEGIN(control_start);
+         fmsynth_voice_control_tick(fm, voice, ctrl, fm->governor.control_shift);
+         FMSYNTH_STATS_TICKS(fm, control_ticks, control_start);
+      }
+   }
+}
+
+// Two voices which use the same kernel variant, rendered with an interleaved kernel.
+// Control-rate updates still happen at each voice's own interval.
+static void fmsynth_render_voice_pair(fmsynth_t *fm, unsigned a, unsigned b,
+      float *left, float *right, unsigned frames, bool mono)
+{
+   struct fmsynth_voice *voice_a = &fm->voices[a];
+   struct fmsynth_voice *voice_b = &fm->voices[b];
+   struct fmsynth_voice_control *ctrl_a = &fm->controls[a];
+   struct fmsynth_voice_control *ctrl_b = &fm->controls[b];
+
+   enum fmsynth_mix mix = fmsynth_voice_mix(ctrl_a, mono);
+   fmsynth_process_pair_t process_pair = (*fm->pair_kernels)[ctrl_a->low_precision][mix];
+#ifdef FMSYNTH_HAVE_JIT
+   const struct fmsynth_jit_slot *slot = fmsynth_voice_jit(fm, ctrl_a, mono);
+   if (slot)
+   {
+      process_pair = slot->process_pair;
+   }
+#endif
+
+   while (frames)
+   {
+      unsigned interval_a = FMSYNTH_FRAMES_PER_LFO << ctrl_a->control_shift;
+      unsigned interval_b = FMSYNTH_FRAMES_PER_LFO << ctrl_b->control_shift;
+      unsigned to_render = min(min(interval_a - ctrl_a->count,
+               interval_b - ctrl_b->count), frames);
+
+      FMSYNTH_STATS_BEGIN(process_start);
+      process_pair(ctrl_a->params, voice_a, ctrl_b->params, voice_b,
+            left, right, to_render);
+      FMSYNTH_STATS_TICKS(fm, process_ticks, process_start);
+
+      left += to_render;
+      right += to_render;
+      frames -= to_render;
+      ctrl_a->count += to_render;
+      ctrl_b->count += to_render;
+
+      FMSYNTH_STATS_BEGIN(control_start);
+      if (ctrl_a->count == interval_a)
+      {
+         fmsynth_voice_control_tick(fm, voice_a, ctrl_a, fm->governor.control_shift);
+      }
+      if (ctrl_b->count == interval_b)
+      {
+         fmsynth_voice_control_tick(fm, voice_b, ctrl_b, fm->governor.control_shift);
+      }
+      FMSYNTH_STATS_TICKS(fm, control_ticks, control_start);
+   }
+}
+
+static bool fmsynth_voices_can_pair(const fmsynth_t *fm, const struct fmsynth_voice_control *a,
+      const struct fmsynth_voice_control *b, bool mono)
+{
+#ifdef FMSYNTH_HAVE_JIT
+   // Voices share generated code only if they play the same patch.
+   if (fmsynth_voice_jit(fm, a, mono) != fmsynth_voice_jit(fm, b, mono))
+   {
+      return false;
+   }
+#else
+   (void)fm;
+   (void)mono;
+#endif
+   return a->low_precision == b->low_precision && a->centered == b->centered;
+}
+
+static double fmsynth_default_clock(void *userdata)
+{
+   (void)userdata;
+#if defined(_WIN32)
+   LARGE_INTEGER count, frequency;
+   QueryPerformanceCounter(&count);
+   QueryPerformanceFrequency(&frequency);
+   return (double)count.QuadPart / frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + 1e-9 * ts.tv_nsec;
+#else
+   return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// Rough output level of a voice, used to pick which voices to degrade first.
+static float fmsynth_voice_loudness(const struct fmsynth_voice *voice)
+{
+   float loudness = 0.0f;
+   for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+   {
+      loudness += fabsf(voice->env[o] * voice->read_mod[o]) *
+         (voice->pan_amp[0][o] + voice->pan_amp[1][o]);
+   }
+   return loudness;
+}
+
+// Octave-wide loudness buckets, so culling the quietest voices needs no sorting.
+static unsigned fmsynth_loudness_bucket(float loudness)
+{
+   if (loudness <= 0.0f)
+   {
+      return 0;
+   }
+
+   int exponent;
+   frexpf(loudness, &exponent);
+   exponent += FMSYNTH_GOVERNOR_BUCKETS - 5;
+   return (unsigned)max(min(exponent, FMSYNTH_GOVERNOR_BUCKETS - 1), 1);
+}
+
+static bool fmsynth_governor_can_cull(const struct fmsynth_voice_control *ctrl, bool held)
+{
+   return ctrl->state == FMSYNTH_VOICE_RELEASED ||
+      (held && ctrl->state != FMSYNTH_VOICE_INACTIVE);
+}
+
+// Culls up to count voices, quietest first.
+// Only released voices are considered unless held is set.
+static unsigned fmsynth_governor_cull(fmsynth_t *fm, unsigned count, bool held)
+{
+   unsigned histogram[FMSYNTH_GOVERNOR_BUCKETS] = {0};
+   for (unsigned i = 0; i < fm->max_voices; i++)
+   {
+      if (fmsynth_governor_can_cull(&fm->controls[i], held))
+      {
+         histogram[fmsynth_loudness_bucket(fmsynth_voice_loudness(&fm->voices[i]))]++;
+      }
+   }
+
+   // Every voice below the cutoff bucket is culled, and some of the voices in it.
+   unsigned cutoff = 0;
+   unsigned below = 0;
+   while (cutoff < FMSYNTH_GOVERNOR_BUCKETS && below + histogram[cutoff] < count)
+   {
+      below += histogram[cutoff++];
+   }
+
+   unsigned culled = 0;
+   for (unsigned pass = 0; pass < 2; pass++)
+   {
+      for (unsigned i = 0; i < fm->max_voices && culled < count; i++)
+      {
+         struct fmsynth_voice_control *ctrl = &fm->controls[i];
+         if (!fmsynth_governor_can_cull(ctrl, held))
+         {
+            continue;
+         }
+
+         unsigned bucket = fmsynth_loudness_bucket(fmsynth_voice_loudness(&fm->voices[i]));
+         if (pass == 0 ? bucket < cutoff : bucket == cutoff)
+         {
+            ctrl->state = FMSYNTH_VOICE_INACTIVE;
+            culled++;
+         }
+      }
+   }
+
+   return culled;
+}
+
+// Voices quieter than average are rendered with the less precise oscillator.
+static unsigned fmsynth_governor_set_low_precision(fmsynth_t *fm, bool enable)
+{
+   float threshold = 0.0f;
+   if (enable && fm->active_voices)
+   {
+      for (unsigned i = 0; i < fm->max_voices; i++)
+      {
+         if (fm->controls[i].state != FMSYNTH_VOICE_INACTIVE)
+         {
+            threshold += fmsynth_voice_loudness(&fm->voices[i]);
+         }
+      }
+      threshold /= fm->active_voices;
+   }
+
+   unsigned count = 0;
+   for (unsigned i = 0; i < fm->max_voices; i++)
+   {
+      struct fmsynth_voice_control *ctrl = &fm->controls[i];
+      ctrl->low_precision = enable && ctrl->state != FMSYNTH_VOICE_INACTIVE &&
+         fmsynth_voice_loudness(&fm->voices[i]) < threshold;
+      count += ctrl->low_precision;
+   }
+
+   return count;
+}
+
+static void fmsynth_governor_begin(fmsynth_t *fm, unsigned frames)
+{
+   struct fmsynth_governor_state *governor = &fm->governor;
+   enum fmsynth_governor_level level = governor->report.level;
+
+   unsigned culled = 0;
+   if (level >= FMSYNTH_GOVERNOR_CULL_RELEASED && governor->cost > 0.0)
+   {
+      // Predict whether the block fits and make room ahead of time.
+      double budget = governor->config.budget * frames * fm->inv_sample_rate *
+         FMSYNTH_GOVERNOR_HEADROOM;
+      double affordable = budget / (governor->cost * frames);
+
+      if (fm->active_voices > affordable)
+      {
+         unsigned excess = fm->active_voices - (unsigned)affordable;
+         culled = fmsynth_governor_cull(fm, excess, false);
+         if (level >= FMSYNTH_GOVERNOR_CULL_HELD && culled < excess)
+         {
+            culled += fmsynth_governor_cull(fm, excess - culled, true);
+         }
+
+         fm->active_voices -= culled;
+         FMSYNTH_STATS_ADD(fm, voices_retired, culled);
+      }
+   }
+   governor->report.voices_culled = culled;
+
+   if (level >= FMSYNTH_GOVERNOR_LOW_PRECISION || governor->report.low_precision_voices)
+   {
+      governor->report.low_precision_voices = fmsynth_governor_set_low_precision(fm,
+            level >= FMSYNTH_GOVERNOR_LOW_PRECISION);
+   }
+
+   governor->control_shift = level >= FMSYNTH_GOVERNOR_SLOW_CONTROL ?
+      FMSYNTH_GOVERNOR_CONTROL_SHIFT : 0;
+   governor->report.control_interval = FMSYNTH_FRAMES_PER_LFO << governor->control_shift;
+}
+
+static void fmsynth_governor_end(fmsynth_t *fm, unsigned frames,
+      unsigned voices, double elapsed)
+{
+   struct fmsynth_governor_state *governor = &fm->governor;
+   struct fmsynth_governor_report *report = &governor->report;
+   enum fmsynth_governor_level level = report->level;
+
+   if (voices)
+   {
+      double cost = elapsed / ((double)voices * frames);
+      if (governor->cost > 0.0)
+      {
+         governor->cost += 0.125 * (cost - governor->cost);
+      }
+      else
+      {
+         governor->cost = cost;
+      }
+   }
+
+   double load = elapsed /
+      (governor->config.budget * frames * fm->inv_sample_rate);
+
+   if (load > FMSYNTH_GOVERNOR_HEADROOM)
+   {
+      if (report->level < FMSYNTH_GOVERNOR_CULL_HELD)
+      {
+         report->level++;
+      }
+      governor->calm_blocks = 0;
+   }
+   else if (load < FMSYNTH_GOVERNOR_RELAX_LOAD && report->level > FMSYNTH_GOVERNOR_NOMINAL)
+   {
+      if (++governor->calm_blocks >= FMSYNTH_GOVERNOR_RELAX_BLOCKS)
+      {
+         report->level--;
+         governor->calm_blocks = 0;
+      }
+   }
+   else
+   {
+      governor->calm_blocks = 0;
+   }
+
+   report->load = (float)load;
+
+   if (governor->config.report_cb && (report->level != level || report->voices_culled))
+   {
+      governor->config.report_cb(governor->config.userdata, report);
+   }
+}
+
+static unsigned fmsynth_render_voices(fmsynth_t *fm, float *left, float *right,
+      unsigned frames, bool mono)
+{
+   unsigned active_voices = 0;
+   unsigned pending = fm->max_voices;
+   for (unsigned i = 0; i < fm->max_voices; i++)
+   {
+      struct fmsynth_voice_control *ctrl = &fm->controls[i];
+      if (ctrl->state == FMSYNTH_VOICE_INACTIVE)
+      {
+         continue;
+      }
+
+#ifdef FMSYNTH_HAVE_JIT
+      if (ctrl->jit_slot)
+      {
+         fmsynth_jit_validate(fm->jit, ctrl);
+      }
+#endif
+
+      if (!fm->pair_kernels)
+      {
+         fmsynth_render_voice(fm, &fm->voices[i], ctrl, left, right, frames, mono);
+         active_voices += fmsynth_voice_update_active(ctrl);
+      }
+      else if (pending == fm->max_voices)
+      {
+         // Hold on to the voice until the next voice shows up to pair with.
+         pending = i;
+      }
+      else if (fmsynth_voices_can_pair(fm, &fm->controls[pending], ctrl, mono))
+      {
+         fmsynth_render_voice_pair(fm, pending, i, left, right, frames, mono);
+         active_voices += fmsynth_voice_update_active(&fm->controls[pending]);
+         active_voices += fmsynth_voice_update_active(ctrl);
+         pending = fm->max_voices;
+      }
+      else
+      {
+         fmsynth_render_voice(fm, &fm->voices[pending], &fm->controls[pending],
+               left, right, frames, mono);
+         active_voices += fmsynth_voice_update_active(&fm->controls[pending]);
+         pending = i;
+      }
+   }
+
+   if (pending != fm->max_voices)
+   {
+      fmsynth_render_voice(fm, &fm->voices[pending], &fm->controls[pending],
+            left, right, frames, mono);
+      active_voices += fmsynth_voice_update_active(&fm->controls[pending]);
+   }
+
+   return active_voices;
+}
+
+static unsigned fmsynth_render_mix(fmsynth_t *fm, float *left, float *right,
+      unsigned frames, bool mono)
+{
+   FMSYNTH_STATS_BEGIN(start);
+   FMSYNTH_DENORMALS_BEGIN(fp_state);
+
+   double governor_start = 0.0;
+   if (fm->governor.enabled)
+   {
+      fmsynth_governor_begin(fm, frames);
+      governor_start = fm->governor.config.clock_cb(fm->governor.config.userdata);
+   }
+
+   if (fm->global_lfo)
+   {
+      fmsynth_step_global_lfo(fm, frames);
+   }
+
+   unsigned rendered_voices = fm->active_voices;
+   FMSYNTH_STATS_ADD(fm, voice_frames_rendered, (uint64_t)rendered_voices * frames);
+
+   unsigned active_voices = fm->active_voices;
+   if (!fm->ramp_count)
+   {
+      active_voices = fmsynth_render_voices(fm, left, right, frames, mono);
+   }
+   else
+   {
+      // Ramps step at control rate, so running voices follow them without zipper noise.
+      for (unsigned done = 0; done < frames; )
+      {
+         unsigned to_render = min(frames - done, FMSYNTH_FRAMES_PER_LFO);
+         active_voices = fmsynth_render_voices(fm, left + done, right + done, to_render, mono);
+         fmsynth_step_ramps(fm, to_render);
+         done += to_render;
+      }
+   }
+
+   fm->active_voices = active_voices;
+
+   if (fm->governor.enabled)
+   {
+      double elapsed = fm->governor.config.clock_cb(fm->governor.config.userdata) - governor_start;
+      fmsynth_governor_end(fm, frames, rendered_voices, elapsed);
+   }
+
+   FMSYNTH_STATS_ADD(fm, frames_rendered, frames);
+   FMSYNTH_STATS_ADD(fm, render_calls, 1);
+   FMSYNTH_DENORMALS_END(fp_state);
+   FMSYNTH_STATS_MAX(fm, max_render_ticks, FMSYNTH_TICKS() - start);
+   return active_voices;
+}
+
+unsigned fmsynth_render(fmsynth_t *fm, float *left, float *right,
+      unsigned frames)
+{
+   return fmsynth_render_mix(fm, left, right, frames, false);
+}
+
+unsigned fmsynth_render_mono(fmsynth_t *fm, float *out, unsigned frames)
+{
+   return fmsynth_render_mix(fm, out, out, frames, true);
+}
+
+void fmsynth_set_governor(fmsynth_t *fm, const struct fmsynth_governor_config *config)
+{
+   struct fmsynth_governor_state *governor = &fm->governor;
+
+   // Restore full quality. Voices pick up the normal control rate at their next update.
+   fmsynth_governor_set_low_precision(fm, false);
+   memset(governor, 0, sizeof(*governor));
+   governor->report.control_interval = FMSYNTH_FRAMES_PER_LFO;
+
+   if (config && config->budget > 0.0f)
+   {
+      governor->config = *config;
+      if (!governor->config.clock_cb)
+      {
+         governor->config.clock_cb = fmsynth_default_clock;
+      }
+      governor->enabled = true;
+   }
+}
+
+void fmsynth_get_governor_report(const fmsynth_t *fm, struct fmsynth_governor_report *report)
+{
+   *report = fm->governor.report;
+}
+
+fmsynth_status_t fmsynth_get_stats(const fmsynth_t *fm, struct fmsynth_stats *stats)
+{
+   memset(stats, 0, sizeof(*stats));
+
+#ifdef FMSYNTH_STATS
+   const struct fmsynth_stats_counters *counters = &fm->stats;
+   stats->frames_rendered = FMSYNTH_STATS_LOAD(&counters->frames_rendered);
+   stats->render_calls = FMSYNTH_STATS_LOAD(&counters->render_calls);
+   stats->voice_frames_rendered = FMSYNTH_STATS_LOAD(&counters->voice_frames_rendered);
+   stats->peak_active_voices = FMSYNTH_STATS_LOAD(&counters->peak_active_voices);
+   stats->notes_rejected = FMSYNTH_STATS_LOAD(&counters->notes_rejected);
+   stats->voices_retired = FMSYNTH_STATS_LOAD(&counters->voices_retired);
+   stats->process_ticks = FMSYNTH_STATS_LOAD(&counters->process_ticks);
+   stats->control_ticks = FMSYNTH_STATS_LOAD(&counters->control_ticks);
+   stats->event_ticks = FMSYNTH_STATS_LOAD(&counters->event_ticks);
+   stats->max_render_ticks = FMSYNTH_STATS_LOAD(&counters->max_render_ticks);
+
+   if (stats->frames_rendered)
+   {
+      stats->average_active_voices =
+         (float)stats->voice_frames_rendered / stats->frames_rendered;
+   }
+   return FMSYNTH_STATUS_OK;
+#else
+   (void)fm;
+   return FMSYNTH_STATUS_UNSUPPORTED;
+#endif
+}
+
+void fmsynth_reset_stats(fmsynth_t *fm)
+{
+#ifdef FMSYNTH_STATS
+   uint64_t *counters = (uint64_t*)&fm->stats;
+   for (size_t i = 0; i < sizeof(fm->stats) / sizeof(uint64_t); i++)
+   {
+      FMSYNTH_STATS_STORE(&counters[i], 0);
+   }
+#else
+   (void)fm;
+#endif
+}
+
+enum fmsynth_offline_event_type
+{
+   FMSYNTH_OFFLINE_PITCH_BEND = 0,
+   FMSYNTH_OFFLINE_MOD_WHEEL,
+   FMSYNTH_OFFLINE_RELEASE_ALL
+};
+
+// Part-wide events which affect voices after they have been triggered.
+struct fmsynth_offline_event
+{
+   uint64_t frame;
+   uint16_t value;
+   uint8_t type;
+};
+
+struct fmsynth_offline_stream
+{
+   struct fmsynth_offline_event *events;
+   size_t count;
+   size_t capacity;
+};
+
+struct fmsynth_offline_job
+{
+   const struct fmsynth_voice_parameters *params;
+   const struct fmsynth_global_parameters *global_params;
+   float bend;
+   float wheel;
+
+   uint64_t start;
+   uint64_t end;
+
+   // Note off or sustain release. Happens before stream event release_event.
+   // release_event is SIZE_MAX if the job is only released by a release-all event in the stream.
+   uint64_t release;
+   size_t release_event;
+   size_t first_event;
+
+   uint64_t last_release;
+   uint64_t tail;
+
+   enum fmsynth_voice_state state;
+   uint8_t part;
+   uint8_t note;
+   uint8_t velocity;
+};
+
+struct fmsynth_offline
+{
+   float sample_rate;
+   enum fmsynth_kernel kernel;
+   unsigned operators;
+   bool global_lfo;
+
+   struct fmsynth_offline_job *jobs;
+   size_t num_jobs;
+   size_t jobs_capacity;
+
+   struct fmsynth_offline_stream streams[FMSYNTH_PARTS];
 };
 
-static const struct fmsynth_parameter_data parameter_data[] = {
-    { "Volume", 0.005f, 16.0f, 1.0f, true },
-    { "Pan", -1.0f, 1.0f, 0.0f, false },
-    { "FreqMod", 0.0f, 16.0f, 1.0f, false },
-    { "FreqOffset", -128.0f, 128.0f, 0.0f, false },
-    { "Env T0", 0.0f, 1.0f, 1.0f, false },
-    { "Env T1", 0.0f, 1.0f, 0.5f, false },
-    { "Env T2", 0.0f, 1.0f, 0.25f, false },
-    { "Env D0", 0.005f, 8.0f, 0.05f, true },
-    { "Env D1", 0.005f, 8.0f, 0.05f, true },
-    { "Env D2", 0.005f, 8.0f, 0.25f, true },
-    { "Env Rel", 0.005f, 8.0f, 0.5f, true },
-    { "KeyScale Mid", 50.0f, 5000.0f, 440.0f, true },
-    { "KeyScale LoFactor", -2.0f, 2.0f, 0.0f, false },
-    { "KeyScale HiFactor", -2.0f, 2.0f, 0.0f, false },
-    { "Velocity Sensitivity", 0.0f, 1.0f, 1.0f, false },
-    { "ModWheel Sensitivity", 0.0f, 1.0f, 0.0f, false },
-    { "LFOAmpDepth", 0.0f, 1.0f, 0.0f, false },
-    { "LFOFreqDepth", 0.0f, 0.025f, 0.0f, false },
-    { "Enable", 0.0f, 1.0f, 1.0f, false },
-    { "Carrier", 0.0f, 1.0f, 1.0f, false },
-    { "Mod0ToOperator", 0.0f, 1.0f, 0.0f, false },
-    { "Mod1ToOperator", 0.0f, 1.0f, 0.0f, false },
-    { "Mod2ToOperator", 0.0f, 1.0f, 0.0f, false },
-    { "Mod3ToOperator", 0.0f, 1.0f, 0.0f, false },
-    { "Mod4ToOperator", 0.0f, 1.0f, 0.0f, false },
-    { "Mod5ToOperator", 0.0f, 1.0f, 0.0f, false },
-    { "Mod6ToOperator", 0.0f, 1.0f, 0.0f, false },
-    { "Mod7ToOperator", 0.0f, 1.0f, 0.0f, false },
-};
+#define FMSYNTH_OFFLINE_BLOCK 4096
+// The global LFO steps once per render call, so it needs shorter blocks.
+#define FMSYNTH_OFFLINE_LFO_BLOCK 256
 
-void fmsynth_set_parameter(fmsynth_t *fm,
-      unsigned parameter, unsigned operator_index, float value)
+static bool fmsynth_offline_grow(void **data, size_t *capacity, size_t count, size_t size)
 {
-   if (parameter < FMSYNTH_PARAM_END && operator_index < FMSYNTH_OPERATORS)
+   if (count < *capacity)
    {
-      float *param = fm->params.amp;
-      param[parameter * FMSYNTH_OPERATORS + operator_index] = value;
+      return true;
    }
-}
 
-static float convert_from_normalized(const struct fmsynth_parameter_data *data, float value)
-{
-   if (data->logarithmic)
+   size_t new_capacity = *capacity ? *capacity * 2 : 64;
+   void *new_data = realloc(*data, new_capacity * size);
+   if (new_data == NULL)
    {
-      float minlog = log2f(data->minimum);
-      float maxlog = log2f(data->maximum);
-      return exp2f(minlog * (1.0f - value) + maxlog * value);
+      return false;
    }
-   else
-      return data->minimum * (1.0f - value) + data->maximum * value;
-}
 
-static float convert_to_normalized(const struct fmsynth_parameter_data *data, float value)
-{
-   if (data->logarithmic)
-   {
-      float minlog = log2f(data->minimum);
-      float maxlog = log2f(data->maximum);
-      float l = log2f(value);
-      return (l - minlog) / (maxlog - minlog);
-   }
-   else
-      return (value - data->minimum) / (data->maximum - data->minimum);
+   *data = new_data;
+   *capacity = new_capacity;
+   return true;
 }
 
-float fmsynth_convert_to_normalized_global_parameter(fmsynth_t *fm,
-                                                     unsigned parameter, float value)
+static bool fmsynth_offline_push_event(fmsynth_offline_t *plan, unsigned part,
+      uint64_t frame, enum fmsynth_offline_event_type type, uint16_t value)
 {
-   (void)fm;
-   if (parameter < FMSYNTH_GLOBAL_PARAM_END)
+   struct fmsynth_offline_stream *stream = &plan->streams[part];
+   if (!fmsynth_offline_grow((void**)&stream->events, &stream->capacity,
+            stream->count, sizeof(*stream->events)))
    {
-      const struct fmsynth_parameter_data *data = &global_parameter_data[parameter];
-      return convert_to_normalized(data, value);
+      return false;
    }
-   else
-      return 0.0f;
-}
 
-float fmsynth_convert_from_normalized_global_parameter(fmsynth_t *fm,
-                                                       unsigned parameter, float value)
-{
-   (void)fm;
-   if (parameter < FMSYNTH_GLOBAL_PARAM_END)
-   {
-      const struct fmsynth_parameter_data *data = &global_parameter_data[parameter];
-      return convert_from_normalized(data, value);
-   }
-   else
-      return 0.0f;
+   struct fmsynth_offline_event *event = &stream->events[stream->count++];
+   event->frame = frame;
+   event->type = type;
+   event->value = value;
+   return true;
 }
 
-float fmsynth_convert_to_normalized_parameter(fmsynth_t *fm,
-                                              unsigned parameter, float value)
+// Upper bound for how long a voice lives after release.
+// Envelope position is accumulated in single precision, so leave some margin.
+static uint64_t fmsynth_offline_tail(const fmsynth_offline_t *plan,
+      const struct fmsynth_voice_parameters *params)
 {
-   (void)fm;
-   if (parameter < FMSYNTH_PARAM_END)
+   float release_time = 0.0f;
+   for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
    {
-      const struct fmsynth_parameter_data *data = &parameter_data[parameter];
-      return convert_to_normalized(data, value);
+      if (params->enable[o] > 0.5f)
+      {
+         release_time = max(release_time, params->envelope_release_time[o]);
+      }
    }
-   else
-      return 0.0f;
-}
 
-float fmsynth_convert_from_normalized_parameter(fmsynth_t *fm,
-                                                unsigned parameter, float value)
-{
-   (void)fm;
-   if (parameter < FMSYNTH_PARAM_END)
-   {
-      const struct fmsynth_parameter_data *data = &parameter_data[parameter];
-      return convert_from_normalized(data, value);
-   }
-   else
-      return 0.0f;
+   return (uint64_t)(release_time * plan->sample_rate * 1.1f) + 2 * FMSYNTH_FRAMES_PER_LFO;
 }
 
-float fmsynth_get_parameter(fmsynth_t *fm,
-                            unsigned parameter, unsigned operator_index)
+static void fmsynth_offline_release(fmsynth_offline_t *plan,
+      struct fmsynth_offline_job *job, uint64_t frame, bool release_all)
 {
-   if (parameter < FMSYNTH_PARAM_END && operator_index < FMSYNTH_OPERATORS)
+   // All notes off is replayed from the part stream, note off and sustain are per job.
+   if (!release_all && job->state != FMSYNTH_VOICE_RELEASED)
    {
-      float *param = fm->params.amp;
-      return param[parameter * FMSYNTH_OPERATORS + operator_index];
+      job->release = frame;
+      job->release_event = plan->streams[job->part].count;
    }
-   else
-      return 0.0f;
-}
 
-void fmsynth_set_global_parameter(fmsynth_t *fm,
-      unsigned parameter, float value)
-{
-   if (parameter < FMSYNTH_GLOBAL_PARAM_END)
-   {
-      float *param = &fm->global_params.volume;
-      param[parameter] = value;
-   }
+   job->state = FMSYNTH_VOICE_RELEASED;
+   job->last_release = frame;
 }
 
-float fmsynth_get_global_parameter(fmsynth_t *fm,
-                                   unsigned parameter)
+static bool fmsynth_offline_is_live(const struct fmsynth_offline_job *job, uint64_t frame)
 {
-   if (parameter < FMSYNTH_GLOBAL_PARAM_END)
-   {
-      float *param = &fm->global_params.volume;
-      return param[parameter];
-   }
-   else
-      return 0.0f;
+   return job->state != FMSYNTH_VOICE_RELEASED ||
+      job->last_release + job->tail >= frame;
 }
 
-static bool fmsynth_voice_update_active(struct fmsynth_voice *voice)
+fmsynth_offline_t *fmsynth_offline_new(const fmsynth_t *fm,
+      const struct fmsynth_event *events, size_t num_events)
 {
-   if (voice->enable & (~voice->dead))
-   {
-      return true;
-   }
-   else
+   fmsynth_offline_t *plan = calloc(1, sizeof(*plan));
+   if (plan == NULL)
    {
-      voice->state = FMSYNTH_VOICE_INACTIVE;
-      return false;
+      return NULL;
    }
-}
-
-static float fmsynth_oscillator(float phase)
-{
-   float x = phase < 0.5f ? (phase - 0.25f) : (0.75f - phase);
-
-   float x2 = x * x;
-   float x3 = x2 * x;
-   x *= 2.0f * PI;
-   x -= x3 * INV_FACTORIAL_3_2PIPOW3;
-
-   float x5 = x3 * x2;
-   x += x5 * INV_FACTORIAL_5_2PIPOW5;
 
-   float x7 = x5 * x2;
-   x -= x7 * INV_FACTORIAL_7_2PIPOW7;
+   plan->sample_rate = fm->sample_rate;
+   // Jobs are single notes on instances which are never freed, so they use the static kernels.
+   plan->kernel = fm->kernel == FMSYNTH_KERNEL_JIT ? FMSYNTH_KERNEL_DEFAULT : fm->kernel;
+   plan->operators = fm->operators;
+   plan->global_lfo = fm->global_lfo;
 
-   return x;
-}
+   struct fmsynth_part parts[FMSYNTH_PARTS];
+   memcpy(parts, fm->parts, sizeof(parts));
 
-#if defined(__AVX__) && defined(FMSYNTH_SIMD)
-#include "x86/fmsynth_avx.c"
-#elif defined(__SSE__) && defined(FMSYNTH_SIMD)
-#include "x86/fmsynth_sse.c"
-#elif defined(__ARM_NEON__) && defined(FMSYNTH_SIMD)
-#include "arm/fmsynth_arm.c"
-#else
-static void fmsynth_process_frames(fmsynth_t *fm,
-      struct fmsynth_voice *voice, float *left, float *right, unsigned frames)
-{
-   float cached[FMSYNTH_OPERATORS];
-   float cached_modulator[FMSYNTH_OPERATORS];
-   float steps[FMSYNTH_OPERATORS];
+   // Jobs which may still be affected by events, like the voice pool in real-time rendering.
+   size_t *live = NULL;
+   size_t num_live = 0;
+   size_t live_capacity = 0;
+   uint64_t frame = 0;
 
-   for (unsigned f = 0; f < frames; f++)
+   for (size_t i = 0; i < num_events; i++)
    {
-      for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+      const uint8_t *data = events[i].data;
+      unsigned part = fm->multi_timbral ? (data[0] & 0x0f) : 0;
+
+      if (events[i].frame < frame)
       {
-         steps[o] = voice->lfo_freq_mod[o] * voice->step_rate[o];
+         goto error;
       }
+      frame = events[i].frame;
 
-      for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+      if ((data[0] & 0xf0) == 0x90 && data[2] != 0)
       {
-         float value = voice->env[o] * voice->read_mod[o] *
-            fmsynth_oscillator(voice->phases[o]);
+         if (!fmsynth_offline_grow((void**)&plan->jobs, &plan->jobs_capacity,
+                  plan->num_jobs, sizeof(*plan->jobs)) ||
+               !fmsynth_offline_grow((void**)&live, &live_capacity,
+                  num_live, sizeof(*live)))
+         {
+            goto error;
+         }
 
-         cached[o] = value;
-         cached_modulator[o] = value * voice->step_rate[o];
-         voice->env[o] += voice->target_env_step[o];
+         struct fmsynth_offline_job *job = &plan->jobs[plan->num_jobs];
+         memset(job, 0, sizeof(*job));
+         job->params = parts[part].params;
+         job->global_params = parts[part].global_params;
+         job->bend = parts[part].bend;
+         job->wheel = parts[part].wheel;
+         job->start = frame;
+         job->first_event = plan->streams[part].count;
+         job->release_event = SIZE_MAX;
+         job->tail = fmsynth_offline_tail(plan, job->params);
+         job->state = FMSYNTH_VOICE_RUNNING;
+         job->part = part;
+         job->note = data[1];
+         job->velocity = data[2];
+
+         live[num_live++] = plan->num_jobs++;
       }
-
-      for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+      else if ((data[0] & 0xf0) == 0x90 || (data[0] & 0xf0) == 0x80)
       {
-         float scalar = cached_modulator[o];
-         const float *vec = fm->params.mod_to_carriers[o];
-         for (unsigned j = 0; j < FMSYNTH_OPERATORS; j++)
-            steps[j] += scalar * vec[j];
+         for (size_t j = 0; j < num_live; j++)
+         {
+            struct fmsynth_offline_job *job = &plan->jobs[live[j]];
+            if (job->part == part && job->note == data[1] &&
+                  job->state == FMSYNTH_VOICE_RUNNING)
+            {
+               if (parts[part].sustained)
+               {
+                  job->state = FMSYNTH_VOICE_SUSTAINED;
+               }
+               else
+               {
+                  fmsynth_offline_release(plan, job, frame, false);
+               }
+            }
+         }
       }
-
-      for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+      else if ((data[0] & 0xf0) == 0xb0 && data[1] == 64)
       {
-         voice->phases[o] += steps[o];
-         voice->phases[o] -= floorf(voice->phases[o]);
+         bool enable = data[2] >= 64;
+         if (parts[part].sustained && !enable)
+         {
+            for (size_t j = 0; j < num_live; j++)
+            {
+               struct fmsynth_offline_job *job = &plan->jobs[live[j]];
+               if (job->part == part && job->state == FMSYNTH_VOICE_SUSTAINED)
+               {
+                  fmsynth_offline_release(plan, job, frame, false);
+               }
+            }
+         }
+         parts[part].sustained = enable;
+      }
+      else if ((data[0] & 0xf0) == 0xb0 && data[1] == 1)
+      {
+         parts[part].wheel = data[2] * (1.0f / 127.0f);
+         if (!fmsynth_offline_push_event(plan, part, frame,
+                  FMSYNTH_OFFLINE_MOD_WHEEL, data[2]))
+         {
+            goto error;
+         }
+      }
+      else if ((data[0] & 0xf0) == 0xe0)
+      {
+         uint16_t bend = data[1] | (data[2] << 7);
+         parts[part].bend = pitch_bend_to_ratio(bend);
+         if (!fmsynth_offline_push_event(plan, part, frame,
+                  FMSYNTH_OFFLINE_PITCH_BEND, bend))
+         {
+            goto error;
+         }
+      }
+      else if ((data[0] & 0xf0) == 0xc0)
+      {
+         const fmsynth_patch_t *patch = fm->programs[data[1] & 0x7f];
+         parts[part].params = patch ? &patch->params : &fm->params;
+         parts[part].global_params = patch ? &patch->global_params : &fm->global_params;
       }
+      else if (data[0] == 0xff || data[0] == 0xfc ||
+            ((data[0] & 0xf0) == 0xb0 && (data[1] == 120 || data[1] == 123)))
+      {
+         bool all_parts = data[0] == 0xff || data[0] == 0xfc;
+         for (size_t j = 0; j < num_live; j++)
+         {
+            struct fmsynth_offline_job *job = &plan->jobs[live[j]];
+            if (all_parts || job->part == part)
+            {
+               fmsynth_offline_release(plan, job, frame, true);
+            }
+         }
 
-      for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+         for (unsigned p = 0; p < FMSYNTH_PARTS; p++)
+         {
+            if (all_parts || p == part)
+            {
+               parts[p].sustained = false;
+               if (!fmsynth_offline_push_event(plan, p, frame,
+                        FMSYNTH_OFFLINE_RELEASE_ALL, 0))
+               {
+                  goto error;
+               }
+            }
+         }
+      }
+
+      // Forget about jobs which cannot be affected by events anymore.
+      size_t kept = 0;
+      for (size_t j = 0; j < num_live; j++)
       {
-         left[f]  += cached[o] * voice->pan_amp[0][o];
-         right[f] += cached[o] * voice->pan_amp[1][o];
+         if (fmsynth_offline_is_live(&plan->jobs[live[j]], frame))
+         {
+            live[kept++] = live[j];
+         }
       }
+      num_live = kept;
    }
-}
-#endif
 
-static void fmsynth_render_voice(fmsynth_t *fm, struct fmsynth_voice *voice,
-      float *left, float *right, unsigned frames)
-{
-   while (frames)
+   for (size_t j = 0; j < plan->num_jobs; j++)
    {
-      unsigned to_render = min(FMSYNTH_FRAMES_PER_LFO - voice->count, frames);
+      struct fmsynth_offline_job *job = &plan->jobs[j];
+      if (job->state != FMSYNTH_VOICE_RELEASED)
+      {
+         fmsynth_offline_release(plan, job, frame, false);
+      }
+      job->end = job->last_release + job->tail;
+   }
 
-      fmsynth_process_frames(fm, voice, left, right, to_render);
+   free(live);
+   return plan;
 
-      left += to_render;
-      right += to_render;
-      frames -= to_render;
-      voice->count += to_render;
+error:
+   free(live);
+   fmsynth_offline_free(plan);
+   return NULL;
+}
 
-      if (voice->count == FMSYNTH_FRAMES_PER_LFO)
+void fmsynth_offline_free(fmsynth_offline_t *plan)
+{
+   if (plan)
+   {
+      for (unsigned p = 0; p < FMSYNTH_PARTS; p++)
       {
-         float lfo_value = fmsynth_oscillator(voice->lfo_phase);
-         voice->lfo_phase += voice->lfo_step;
-         voice->lfo_phase -= floorf(voice->lfo_phase);
-         voice->count = 0;
-
-         fmsynth_voice_set_lfo_value(voice, &fm->params, lfo_value);
-         fmsynth_update_target_envelope(voice);
+         free(plan->streams[p].events);
       }
+      free(plan->jobs);
+      free(plan);
    }
 }
 
-unsigned fmsynth_render(fmsynth_t *fm, float *left, float *right,
-      unsigned frames)
+size_t fmsynth_offline_num_jobs(const fmsynth_offline_t *plan)
 {
-   unsigned active_voices = 0;
-   for (unsigned i = 0; i < fm->max_voices; i++)
-   {
-      if (fm->voices[i].state != FMSYNTH_VOICE_INACTIVE)
+   return plan->num_jobs;
+}
+
+void fmsynth_offline_job_info(const fmsynth_offline_t *plan, size_t job,
+      uint64_t *start, uint64_t *frames)
+{
+   *start = plan->jobs[job].start;
+   *frames = plan->jobs[job].end - plan->jobs[job].start;
+}
+
+uint64_t fmsynth_offline_render_job(const fmsynth_offline_t *plan, size_t job_index,
+      float *left, float *right, uint64_t max_frames)
+{
+   const struct fmsynth_offline_job *job = &plan->jobs[job_index];
+   const struct fmsynth_offline_stream *stream = &plan->streams[job->part];
+
+   // A single voice instance on the stack, so jobs share no mutable state.
+   uint8_t memory[sizeof(fmsynth_t) + sizeof(struct fmsynth_voice) +
+      sizeof(struct fmsynth_voice_control) + 64];
+   fmsynth_t *fm = fmsynth_init_in_place(memory, sizeof(memory), plan->sample_rate, 1);
+   fm->operators = plan->operators;
+   fmsynth_set_kernel(fm, plan->kernel);
+
+   struct fmsynth_part *part = &fm->parts[job->part];
+   part->params = job->params;
+   part->global_params = job->global_params;
+   part->bend = job->bend;
+   part->wheel = job->wheel;
+   fmsynth_part_note_on(fm, job->part, job->note, job->velocity);
+
+   // Continue the global LFO as if the part had been rendered from frame 0.
+   fm->global_lfo = plan->global_lfo;
+   double lfo_phase = 0.25 + job->start * (double)job->global_params->lfo_freq / plan->sample_rate;
+   part->lfo_phase = (float)(lfo_phase - floor(lfo_phase));
+   unsigned block = plan->global_lfo ? FMSYNTH_OFFLINE_LFO_BLOCK : FMSYNTH_OFFLINE_BLOCK;
+
+   size_t event = job->first_event;
+   bool released = false;
+   uint64_t frame = 0;
+
+   while (frame < max_frames)
+   {
+      bool release = !released && event == job->release_event;
+      uint64_t next = UINT64_MAX;
+
+      if (release)
+      {
+         next = job->release - job->start;
+      }
+      else if (event < stream->count)
+      {
+         next = stream->events[event].frame - job->start;
+      }
+
+      if (next <= frame)
       {
-         fmsynth_render_voice(fm, &fm->voices[i], left, right, frames);
-         if (fmsynth_voice_update_active(&fm->voices[i]))
+         if (release)
          {
-            active_voices++;
+            fmsynth_release_voice(&fm->controls[0]);
+            released = true;
+            continue;
+         }
+
+         const struct fmsynth_offline_event *ev = &stream->events[event++];
+         switch (ev->type)
+         {
+            case FMSYNTH_OFFLINE_PITCH_BEND:
+               fmsynth_part_set_pitch_bend(fm, job->part, ev->value);
+               break;
+
+            case FMSYNTH_OFFLINE_MOD_WHEEL:
+               fmsynth_part_set_mod_wheel(fm, job->part, ev->value);
+               break;
+
+            case FMSYNTH_OFFLINE_RELEASE_ALL:
+               fmsynth_part_release_all(fm, job->part);
+               break;
          }
+         continue;
+      }
+
+      unsigned to_render = min(min(next, max_frames) - frame, block);
+      unsigned active = fmsynth_render(fm, left + frame, right + frame, to_render);
+      frame += to_render;
+
+      if (active == 0)
+      {
+         break;
       }
    }
 
-   return active_voices;
+   return frame;
 }
 
-size_t fmsynth_preset_size(void)
+// Presets with 8 operators use the original FMSYNTH1 format.
+// Other operator counts use FMSYNTH2, which stores the count after the magic.
+static size_t fmsynth_preset_size_operators(unsigned operators)
 {
    return
-      8 +
+      8 + (operators == 8 ? 0 : sizeof(uint32_t)) +
       sizeof(struct fmsynth_preset_metadata) +
-      FMSYNTH_PARAM_END * FMSYNTH_OPERATORS * sizeof(uint32_t) +
+      (FMSYNTH_PARAM_MOD_TO_CARRIERS0 + operators) * operators * sizeof(uint32_t) +
       FMSYNTH_GLOBAL_PARAM_END * sizeof(uint32_t);
 }
 
+size_t fmsynth_preset_size(void)
+{
+   return fmsynth_preset_size_operators(FMSYNTH_OPERATORS);
+}
+
 // We don't need full precision mantissa.
 // Allows packing floating point in 32-bit in a portable way.
 static uint32_t pack_float(float value)
@@ -987,6 +3523,32 @@ static uint32_t read_u32(const uint8_t *buffer)
    return (buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) | (buffer[3] << 0);
 }
 
+// Returns 0 if the buffer does not start with a preset header.
+static unsigned fmsynth_preset_operators(const uint8_t *buffer, size_t size)
+{
+   if (size >= 8 && memcmp(buffer, "FMSYNTH1", 8) == 0)
+   {
+      return 8;
+   }
+
+   if (size >= 12 && memcmp(buffer, "FMSYNTH2", 8) == 0)
+   {
+      uint32_t operators = read_u32(buffer + 8);
+      if (operators >= 1 && operators <= 16 && operators != 8)
+      {
+         return operators;
+      }
+   }
+
+   return 0;
+}
+
+size_t fmsynth_preset_stored_size(const void *buffer, size_t size)
+{
+   unsigned operators = fmsynth_preset_operators(buffer, size);
+   return operators ? fmsynth_preset_size_operators(operators) : 0;
+}
+
 fmsynth_status_t fmsynth_preset_save(fmsynth_t *fm, const struct fmsynth_preset_metadata *metadata,
       void *buffer, size_t size)
 {
@@ -1015,8 +3577,14 @@ fmsynth_status_t fmsynth_preset_save_private(struct fmsynth_global_parameters *g
       }
    }
 
+#if FMSYNTH_OPERATORS == 8
    memcpy(buffer, "FMSYNTH1", 8);
    buffer += 8;
+#else
+   memcpy(buffer, "FMSYNTH2", 8);
+   write_u32(buffer + 8, FMSYNTH_OPERATORS);
+   buffer += 12;
+#endif
 
    if (metadata)
    {
@@ -1050,7 +3618,20 @@ fmsynth_status_t fmsynth_preset_save_private(struct fmsynth_global_parameters *g
 fmsynth_status_t fmsynth_preset_load(fmsynth_t *fm, struct fmsynth_preset_metadata *metadata,
       const void *buffer, size_t size)
 {
-   return fmsynth_preset_load_private(&fm->global_params, &fm->params,
+   fmsynth_status_t status = fmsynth_preset_load_private(&fm->global_params, &fm->params,
+         metadata, buffer, size);
+   if (status == FMSYNTH_STATUS_OK)
+   {
+      fm->ramp_count = 0;
+      fmsynth_update_lfo_usage(fm, &fm->params);
+   }
+   return status;
+}
+
+fmsynth_status_t fmsynth_patch_load(fmsynth_patch_t *patch, struct fmsynth_preset_metadata *metadata,
+      const void *buffer, size_t size)
+{
+   return fmsynth_preset_load_private(&patch->global_params, &patch->params,
          metadata, buffer, size);
 }
 
@@ -1061,16 +3642,22 @@ fmsynth_status_t fmsynth_preset_load_private(struct fmsynth_global_parameters *g
 {
    const uint8_t *buffer = buffer_;
 
-   if (size < fmsynth_preset_size())
+   if (size < 8)
    {
       return FMSYNTH_STATUS_BUFFER_TOO_SMALL;
    }
 
-   if (memcmp(buffer, "FMSYNTH1", 8) != 0)
+   unsigned operators = fmsynth_preset_operators(buffer, size);
+   if (operators == 0)
    {
       return FMSYNTH_STATUS_INVALID_FORMAT;
    }
-   buffer += 8;
+
+   if (size < fmsynth_preset_size_operators(operators))
+   {
+      return FMSYNTH_STATUS_BUFFER_TOO_SMALL;
+   }
+   buffer += operators == 8 ? 8 : 12;
 
    if (buffer[FMSYNTH_PRESET_STRING_SIZE - 1] != '\0')
    {
@@ -1101,11 +3688,30 @@ fmsynth_status_t fmsynth_preset_load_private(struct fmsynth_global_parameters *g
       buffer += sizeof(uint32_t);
    }
 
+   // Operators missing from the preset are disabled, extra operators are dropped.
+   if (operators != FMSYNTH_OPERATORS)
+   {
+      fmsynth_set_default_parameters(voice_params);
+      for (unsigned o = operators; o < FMSYNTH_OPERATORS; o++)
+      {
+         voice_params->enable[o] = 0.0f;
+      }
+   }
+
+   // Every parameter is a row of one value per operator, and every modulator is a row of its own.
    float *params = voice_params->amp;
-   for (unsigned i = 0; i < FMSYNTH_PARAM_END * FMSYNTH_OPERATORS; i++)
+   for (unsigned row = 0; row < FMSYNTH_PARAM_MOD_TO_CARRIERS0 + operators; row++)
    {
-      params[i] = unpack_float(read_u32(buffer));
-      buffer += sizeof(uint32_t);
+      for (unsigned o = 0; o < operators; o++)
+      {
+         float value = unpack_float(read_u32(buffer));
+         buffer += sizeof(uint32_t);
+
+         if (row < FMSYNTH_PARAM_END && o < FMSYNTH_OPERATORS)
+         {
+            params[row * FMSYNTH_OPERATORS + o] = value;
+         }
+      }
    }
 
    return FMSYNTH_STATUS_OK;
@@ -1116,3 +3722,8 @@ unsigned fmsynth_get_version(void)
    return FMSYNTH_VERSION;
 }
 
+unsigned fmsynth_get_max_operators(void)
+{
+   return FMSYNTH_OPERATORS;
+}
+
@@ -0,0 +1,241 @@
+/* Copyright (C) 2014 Hans-Kristian Arntzen <maister@archlinux.us>
+ *
+ * Permission is hereby granted, free of charge,
+ * to any person obtaining a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Render-ahead. A background thread renders into a ring buffer ahead of the audio callback.
+// Only uses the public API, and is kept out of fmsynth.c so the core library needs no threads.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "fmsynth.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+// How long the render thread sleeps when the ring is full.
+#define FMSYNTH_AHEAD_POLL_NS 1000000
+
+// Counters are shared between threads without locks.
+// Each counter is only written by one thread, and readers use acquire loads.
+#define FMSYNTH_AHEAD_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define FMSYNTH_AHEAD_STORE(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_RELEASE)
+
+struct fmsynth_ahead
+{
+   fmsynth_t *fm;
+   pthread_t thread;
+   bool running;
+
+   // Ring of rendered audio. Render thread writes, reader consumes.
+   float *left;
+   float *right;
+   unsigned capacity;
+   unsigned block;
+   uint64_t written;
+   uint64_t read;
+
+   // Ring of scheduled events. Scheduling thread writes, render thread consumes.
+   struct fmsynth_event *events;
+   unsigned event_capacity;
+   uint64_t events_written;
+   uint64_t events_read;
+
+   uint64_t underrun_frames;
+   uint64_t late_events;
+};
+
+static inline unsigned min(unsigned a, unsigned b)
+{
+   return a < b ? a : b;
+}
+
+// Renders frames starting at frame into the ring, applying events at their frame.
+// Late events take effect at the first frame which has not been rendered yet.
+static void fmsynth_ahead_render(struct fmsynth_ahead *ahead, uint64_t frame, unsigned frames)
+{
+   while (frames)
+   {
+      uint64_t next = UINT64_MAX;
+      uint64_t events_written = FMSYNTH_AHEAD_LOAD(&ahead->events_written);
+
+      while (ahead->events_read != events_written)
+      {
+         const struct fmsynth_event *event =
+            &ahead->events[ahead->events_read % ahead->event_capacity];
+         if (event->frame > frame)
+         {
+            next = event->frame;
+            break;
+         }
+
+         if (event->frame < frame)
+         {
+            FMSYNTH_AHEAD_STORE(&ahead->late_events, ahead->late_events + 1);
+         }
+
+         fmsynth_parse_midi(ahead->fm, event->data);
+         FMSYNTH_AHEAD_STORE(&ahead->events_read, ahead->events_read + 1);
+      }
+
+      unsigned offset = frame % ahead->capacity;
+      unsigned to_render = min(frames, ahead->capacity - offset);
+      if (next - frame < to_render)
+      {
+         to_render = next - frame;
+      }
+
+      memset(ahead->left + offset, 0, to_render * sizeof(float));
+      memset(ahead->right + offset, 0, to_render * sizeof(float));
+      fmsynth_render(ahead->fm, ahead->left + offset, ahead->right + offset, to_render);
+
+      frame += to_render;
+      frames -= to_render;
+   }
+}
+
+static void *fmsynth_ahead_thread(void *data)
+{
+   struct fmsynth_ahead *ahead = data;
+   const struct timespec poll = { 0, FMSYNTH_AHEAD_POLL_NS };
+
+   while (FMSYNTH_AHEAD_LOAD(&ahead->running))
+   {
+      uint64_t written = ahead->written;
+      uint64_t read = FMSYNTH_AHEAD_LOAD(&ahead->read);
+
+      if (written - read + ahead->block > ahead->capacity)
+      {
+         nanosleep(&poll, NULL);
+         continue;
+      }
+
+      fmsynth_ahead_render(ahead, written, ahead->block);
+      FMSYNTH_AHEAD_STORE(&ahead->written, written + ahead->block);
+   }
+
+   return NULL;
+}
+
+fmsynth_ahead_t *fmsynth_ahead_new(fmsynth_t *fm, unsigned buffer_frames,
+      unsigned block_frames, unsigned max_events)
+{
+   if (block_frames == 0 || buffer_frames < block_frames || max_events == 0)
+   {
+      return NULL;
+   }
+
+   struct fmsynth_ahead *ahead = calloc(1, sizeof(*ahead));
+   if (ahead == NULL)
+   {
+      return NULL;
+   }
+
+   ahead->fm = fm;
+   ahead->capacity = buffer_frames;
+   ahead->block = block_frames;
+   ahead->event_capacity = max_events;
+   ahead->left = malloc(buffer_frames * sizeof(float));
+   ahead->right = malloc(buffer_frames * sizeof(float));
+   ahead->events = malloc(max_events * sizeof(*ahead->events));
+   ahead->running = true;
+
+   if (!ahead->left || !ahead->right || !ahead->events ||
+         pthread_create(&ahead->thread, NULL, fmsynth_ahead_thread, ahead) != 0)
+   {
+      free(ahead->left);
+      free(ahead->right);
+      free(ahead->events);
+      free(ahead);
+      return NULL;
+   }
+
+   return ahead;
+}
+
+void fmsynth_ahead_free(fmsynth_ahead_t *ahead)
+{
+   if (ahead == NULL)
+   {
+      return;
+   }
+
+   FMSYNTH_AHEAD_STORE(&ahead->running, false);
+   pthread_join(ahead->thread, NULL);
+
+   free(ahead->left);
+   free(ahead->right);
+   free(ahead->events);
+   free(ahead);
+}
+
+fmsynth_status_t fmsynth_ahead_schedule(fmsynth_ahead_t *ahead,
+      const struct fmsynth_event *event)
+{
+   uint64_t events_read = FMSYNTH_AHEAD_LOAD(&ahead->events_read);
+   if (ahead->events_written - events_read >= ahead->event_capacity)
+   {
+      return FMSYNTH_STATUS_BUSY;
+   }
+
+   ahead->events[ahead->events_written % ahead->event_capacity] = *event;
+   FMSYNTH_AHEAD_STORE(&ahead->events_written, ahead->events_written + 1);
+   return FMSYNTH_STATUS_OK;
+}
+
+unsigned fmsynth_ahead_read(fmsynth_ahead_t *ahead, float *left, float *right, unsigned frames)
+{
+   uint64_t read = ahead->read;
+   uint64_t written = FMSYNTH_AHEAD_LOAD(&ahead->written);
+   uint64_t buffered = written - read;
+   unsigned available = buffered < frames ? (unsigned)buffered : frames;
+
+   for (unsigned done = 0; done < available; )
+   {
+      unsigned offset = (read + done) % ahead->capacity;
+      unsigned chunk = min(available - done, ahead->capacity - offset);
+      for (unsigned i = 0; i < chunk; i++)
+      {
+         left[done + i] += ahead->left[offset + i];
+         right[done + i] += ahead->right[offset + i];
+      }
+      done += chunk;
+   }
+
+   FMSYNTH_AHEAD_STORE(&ahead->read, read + available);
+   if (available < frames)
+   {
+      FMSYNTH_AHEAD_STORE(&ahead->underrun_frames, ahead->underrun_frames + (frames - available));
+   }
+   return available;
+}
+
+uint64_t fmsynth_ahead_get_position(const fmsynth_ahead_t *ahead)
+{
+   return FMSYNTH_AHEAD_LOAD(&ahead->read);
+}
+
+void fmsynth_ahead_get_stats(const fmsynth_ahead_t *ahead, struct fmsynth_ahead_stats *stats)
+{
+   uint64_t read = FMSYNTH_AHEAD_LOAD(&ahead->read);
+   uint64_t written = FMSYNTH_AHEAD_LOAD(&ahead->written);
+
+   stats->buffered_frames = (unsigned)(written - read);
+   stats->underrun_frames = FMSYNTH_AHEAD_LOAD(&ahead->underrun_frames);
+   stats->late_events = FMSYNTH_AHEAD_LOAD(&ahead->late_events);
+}
@@ -0,0 +1,762 @@
+/* Copyright (C) 2014 Hans-Kristian Arntzen <maister@archlinux.us>
+ *
+ * Permission is hereby granted, free of charge,
+ * to any person obtaining a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Benchmark suite. Sweeps a scenario matrix and emits JSON.
+// The library is compiled into the benchmark directly,
+// so control-rate work can be timed separately from the audio-rate kernel.
+
+#define _GNU_SOURCE
+
+#include "fmsynth.c"
+#include <time.h>
+#include <float.h>
+#include <dirent.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define MAX_LIST 32
+#define MAX_TOPOLOGIES 64
+#define BENCH_SAMPLE_RATE 44100.0f
+
+struct topology
+{
+   char name[64];
+   fmsynth_patch_t *patch; // NULL for synthetic topologies.
+   bool dense;
+};
+
+struct list
+{
+   unsigned values[MAX_LIST];
+   unsigned count;
+};
+
+static struct list polyphonies = { { 1, 4, 16, 64, 256, 1024, 2048 }, 7 };
+static struct list block_sizes = { { 16, 64, 256, 1024, 4096 }, 5 };
+static struct list kernels = { { FMSYNTH_KERNEL_C, FMSYNTH_KERNEL_SIMD, FMSYNTH_KERNEL_JIT }, 3 };
+static struct list operator_counts = { { FMSYNTH_OPERATORS }, 1 };
+static struct topology topologies[MAX_TOPOLOGIES];
+static unsigned num_topologies;
+static const char *topology_filter;
+static uint64_t voice_frames_per_run = 1 << 22;
+static bool global_lfo;
+
+enum counter
+{
+   COUNTER_CYCLES = 0,
+   COUNTER_INSTRUCTIONS,
+   COUNTER_L1D_MISSES,
+   COUNTER_LLC_MISSES,
+   COUNTER_BRANCH_MISSES,
+   COUNTER_RAW,
+   COUNTER_COUNT
+};
+
+static const char *counter_names[COUNTER_COUNT] = {
+   "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses", "raw",
+};
+
+// Hardware counters for the calling thread. Any counter can be missing,
+// e.g. in containers or VMs, in which case only timing is reported.
+static int counter_fds[COUNTER_COUNT] = { -1, -1, -1, -1, -1, -1 };
+static uint64_t raw_event;
+
+struct phase
+{
+   uint64_t frames;
+   double seconds;
+   double start;
+   uint64_t values[COUNTER_COUNT];
+};
+
+#ifdef __linux__
+static int open_counter(uint32_t type, uint64_t config)
+{
+   struct perf_event_attr attr;
+   memset(&attr, 0, sizeof(attr));
+   attr.size = sizeof(attr);
+   attr.type = type;
+   attr.config = config;
+   attr.disabled = 1;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+   return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t cache_event(uint64_t cache)
+{
+   return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+static void open_counters(void)
+{
+   counter_fds[COUNTER_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+   counter_fds[COUNTER_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+   counter_fds[COUNTER_L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_L1D));
+   counter_fds[COUNTER_LLC_MISSES] = open_counter(PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_LL));
+   counter_fds[COUNTER_BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+   if (raw_event)
+   {
+      counter_fds[COUNTER_RAW] = open_counter(PERF_TYPE_RAW, raw_event);
+   }
+}
+
+static void close_counters(void)
+{
+   for (unsigned i = 0; i < COUNTER_COUNT; i++)
+   {
+      if (counter_fds[i] >= 0)
+      {
+         close(counter_fds[i]);
+         counter_fds[i] = -1;
+      }
+   }
+}
+
+static void start_counters(void)
+{
+   for (unsigned i = 0; i < COUNTER_COUNT; i++)
+   {
+      if (counter_fds[i] >= 0)
+      {
+         ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+         ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+      }
+   }
+}
+
+static void stop_counters(uint64_t *values)
+{
+   for (unsigned i = 0; i < COUNTER_COUNT; i++)
+   {
+      if (counter_fds[i] >= 0)
+      {
+         ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+      }
+   }
+
+   for (unsigned i = 0; i < COUNTER_COUNT; i++)
+   {
+      uint64_t data[3];
+      values[i] = 0;
+      if (counter_fds[i] >= 0 && read(counter_fds[i], data, sizeof(data)) == sizeof(data))
+      {
+         // Scale up if the counter was multiplexed.
+         values[i] = data[2] ? (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+      }
+   }
+}
+#else
+static void open_counters(void)
+{
+}
+
+static void close_counters(void)
+{
+}
+
+static void start_counters(void)
+{
+}
+
+static void stop_counters(uint64_t *values)
+{
+   memset(values, 0, COUNTER_COUNT * sizeof(*values));
+}
+#endif
+
+static double get_time(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void begin_phase(struct phase *phase)
+{
+   memset(phase, 0, sizeof(*phase));
+   start_counters();
+   phase->start = get_time();
+}
+
+static void end_phase(struct phase *phase, uint64_t frames)
+{
+   phase->seconds = get_time() - phase->start;
+   stop_counters(phase->values);
+   phase->frames = frames;
+}
+
+static void print_phase(FILE *out, const char *name, const struct phase *phase, bool last)
+{
+   fprintf(out, "\"%s\": { \"frames\": %llu, \"seconds\": %.6f",
+         name, (unsigned long long)phase->frames, phase->seconds);
+
+   for (unsigned i = 0; i < COUNTER_COUNT; i++)
+   {
+      if (counter_fds[i] >= 0)
+      {
+         fprintf(out, ", \"%s\": %llu", counter_names[i],
+               (unsigned long long)phase->values[i]);
+      }
+   }
+
+   if (counter_fds[COUNTER_CYCLES] >= 0 && counter_fds[COUNTER_INSTRUCTIONS] >= 0 &&
+         phase->values[COUNTER_CYCLES])
+   {
+      fprintf(out, ", \"ipc\": %.4f",
+            (double)phase->values[COUNTER_INSTRUCTIONS] / phase->values[COUNTER_CYCLES]);
+   }
+
+   fprintf(out, " }%s", last ? "" : ", ");
+}
+
+static bool parse_list(struct list *list, const char *arg)
+{
+   list->count = 0;
+   while (*arg && list->count < MAX_LIST)
+   {
+      char *end;
+      unsigned long value = strtoul(arg, &end, 0);
+      if (end == arg || value == 0)
+      {
+         return false;
+      }
+
+      list->values[list->count++] = value;
+      arg = *end == ',' ? end + 1 : end;
+   }
+   return list->count > 0;
+}
+
+static bool parse_kernels(const char *arg)
+{
+   static const struct
+   {
+      const char *name;
+      enum fmsynth_kernel kernel;
+   } names[] = {
+      { "c", FMSYNTH_KERNEL_C },
+      { "simd", FMSYNTH_KERNEL_SIMD },
+      { "jit", FMSYNTH_KERNEL_JIT },
+   };
+
+   kernels.count = 0;
+   while (*arg && kernels.count < MAX_LIST)
+   {
+      char token[8];
+      size_t len = strcspn(arg, ",");
+      if (len == 0 || len >= sizeof(token))
+      {
+         return false;
+      }
+      memcpy(token, arg, len);
+      token[len] = '\0';
+
+      unsigned i;
+      for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+      {
+         if (!strcmp(token, names[i].name))
+         {
+            kernels.values[kernels.count++] = names[i].kernel;
+            break;
+         }
+      }
+      if (i == sizeof(names) / sizeof(names[0]))
+      {
+         return false;
+      }
+
+      arg += len;
+      arg += *arg == ',';
+   }
+   return kernels.count > 0;
+}
+
+static void add_synthetic(const char *name, bool dense)
+{
+   struct topology *topo = &topologies[num_topologies++];
+   snprintf(topo->name, sizeof(topo->name), "%s", name);
+   topo->patch = NULL;
+   topo->dense = dense;
+}
+
+static void add_presets(const char *dir)
+{
+   DIR *d = opendir(dir);
+   if (!d)
+   {
+      return;
+   }
+
+   // Presets may have been saved with any number of operators.
+   size_t preset_size = fmsynth_preset_size_operators(16);
+   uint8_t *buffer = malloc(preset_size);
+
+   struct dirent *entry;
+   while (buffer && (entry = readdir(d)) && num_topologies < MAX_TOPOLOGIES)
+   {
+      const char *ext = strrchr(entry->d_name, '.');
+      if (!ext || strcmp(ext, ".fmp") != 0)
+      {
+         continue;
+      }
+
+      char path[1024];
+      snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+      FILE *file = fopen(path, "rb");
+      if (!file)
+      {
+         continue;
+      }
+
+      size_t read = fread(buffer, 1, preset_size, file);
+      fclose(file);
+
+      fmsynth_patch_t *patch = fmsynth_patch_new();
+      if (!patch || fmsynth_patch_load(patch, NULL, buffer, read) != FMSYNTH_STATUS_OK)
+      {
+         fprintf(stderr, "Skipping invalid preset %s.\n", path);
+         fmsynth_patch_free(patch);
+         continue;
+      }
+
+      struct topology *topo = &topologies[num_topologies++];
+      snprintf(topo->name, sizeof(topo->name), "%.*s",
+            (int)(ext - entry->d_name), entry->d_name);
+      topo->patch = patch;
+   }
+
+   free(buffer);
+   closedir(d);
+}
+
+static void set_modulation(fmsynth_t *fm, unsigned modulator, unsigned target, float value)
+{
+   fmsynth_set_parameter(fm, FMSYNTH_PARAM_MOD_TO_CARRIERS0 + modulator, target, value);
+}
+
+static void setup_topology(fmsynth_t *fm, const struct topology *topo)
+{
+   if (topo->patch)
+   {
+      fmsynth_set_program(fm, 0, topo->patch);
+      fmsynth_program_change(fm, 0);
+      return;
+   }
+
+   for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
+   {
+      fmsynth_set_parameter(fm, FMSYNTH_PARAM_FREQ_MOD, i, i + 1.0f);
+      fmsynth_set_parameter(fm, FMSYNTH_PARAM_PAN, i, (i & 1) ? -0.5f : +0.5f);
+      fmsynth_set_parameter(fm, FMSYNTH_PARAM_LFO_FREQ_MOD_DEPTH, i, 0.15f);
+   }
+
+   if (topo->dense)
+   {
+      // Every operator modulates every operator, all are carriers.
+      for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
+      {
+         fmsynth_set_parameter(fm, FMSYNTH_PARAM_CARRIERS, i, 1.0f);
+         for (unsigned j = 0; j < FMSYNTH_OPERATORS; j++)
+         {
+            set_modulation(fm, i, j, 0.1f);
+         }
+      }
+   }
+   else
+   {
+      // Two classic 2-op stacks, remaining operators disabled.
+      for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
+      {
+         fmsynth_set_parameter(fm, FMSYNTH_PARAM_ENABLE, i, i < 4 ? 1.0f : 0.0f);
+      }
+      fmsynth_set_parameter(fm, FMSYNTH_PARAM_CARRIERS, 0, 1.0f);
+      fmsynth_set_parameter(fm, FMSYNTH_PARAM_CARRIERS, 2, 1.0f);
+      set_modulation(fm, 1, 0, 1.0f);
+      set_modulation(fm, 3, 2, 2.0f);
+   }
+}
+
+// Replays the control-rate work of a render of the given length on a copy of the instance.
+static double time_control(const fmsynth_t *fm, unsigned frames, unsigned blocks)
+{
+   size_t size = fmsynth_instance_size(fm->max_voices);
+   void *memory = malloc(size);
+   if (!memory)
+   {
+      return 0.0;
+   }
+
+   fmsynth_t *copy = (fmsynth_t*)(((uintptr_t)memory + 63) & ~(uintptr_t)63);
+   memcpy(copy, fm, fmsynth_instance_size_unaligned(fm->max_voices));
+   copy->controls = (struct fmsynth_voice_control*)(copy->voices + copy->max_voices);
+
+   double start = get_time();
+   for (unsigned b = 0; b < blocks; b++)
+   {
+      for (unsigned i = 0; i < copy->max_voices; i++)
+      {
+         struct fmsynth_voice_control *ctrl = &copy->controls[i];
+         if (ctrl->state == FMSYNTH_VOICE_INACTIVE)
+         {
+            continue;
+         }
+
+         unsigned ticks = (ctrl->count + frames) / FMSYNTH_FRAMES_PER_LFO;
+         unsigned count = (ctrl->count + frames) % FMSYNTH_FRAMES_PER_LFO;
+         for (unsigned t = 0; t < ticks; t++)
+         {
+            fmsynth_voice_control_tick(copy, &copy->voices[i], ctrl, ctrl->control_shift);
+         }
+         ctrl->count = count;
+      }
+   }
+   double elapsed = get_time() - start;
+
+   free(memory);
+   return elapsed;
+}
+
+// Jumps ahead to deep release tails, as if every note had been released for a very long time.
+// Envelopes end up far below the normal range of floats, where denormals used to stall the FPU.
+static void start_release_tail(fmsynth_t *fm, unsigned polyphony)
+{
+   for (unsigned i = 0; i < fm->max_voices; i++)
+   {
+      fm->controls[i].state = FMSYNTH_VOICE_INACTIVE;
+   }
+   fm->active_voices = 0;
+
+   for (unsigned i = 0; i < polyphony; i++)
+   {
+      fmsynth_note_on(fm, 24 + (i * 7) % 72, 100);
+   }
+   fmsynth_release_all(fm);
+
+   for (unsigned i = 0; i < fm->max_voices; i++)
+   {
+      struct fmsynth_voice_control *ctrl = &fm->controls[i];
+      struct fmsynth_voice *voice = &fm->voices[i];
+      for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+      {
+         // Keep voices alive for the whole measurement.
+         ctrl->end_time[o] = FLT_MAX;
+         ctrl->target_env[o] = 1.0e-36f;
+         voice->env[o] = 1.0e-36f;
+         voice->target_env_step[o] = 0.0f;
+      }
+   }
+}
+
+static bool run_scenario(FILE *out, bool *first, enum fmsynth_kernel kernel, unsigned operators,
+      const struct topology *topo, unsigned polyphony, unsigned block_size)
+{
+   fmsynth_t *fm = fmsynth_new(BENCH_SAMPLE_RATE, polyphony);
+   float *left = malloc(block_size * sizeof(float));
+   float *right = malloc(block_size * sizeof(float));
+   bool ret = false;
+
+   if (!fm || !left || !right)
+   {
+      goto end;
+   }
+
+   if (fmsynth_set_operators(fm, operators) != FMSYNTH_STATUS_OK ||
+         fmsynth_set_kernel(fm, kernel) != FMSYNTH_STATUS_OK)
+   {
+      ret = true;
+      goto end;
+   }
+
+   fmsynth_set_global_lfo(fm, global_lfo);
+   setup_topology(fm, topo);
+
+   struct phase note_on, steady, release;
+   begin_phase(&note_on);
+   for (unsigned i = 0; i < polyphony; i++)
+   {
+      fmsynth_note_on(fm, 24 + (i * 7) % 72, 100);
+   }
+   end_phase(&note_on, 0);
+
+   uint64_t blocks = voice_frames_per_run / ((uint64_t)polyphony * block_size);
+   if (blocks == 0)
+   {
+      blocks = 1;
+   }
+
+   // Warm up caches and get past the attack phase.
+   memset(left, 0, block_size * sizeof(float));
+   memset(right, 0, block_size * sizeof(float));
+   fmsynth_render(fm, left, right, block_size);
+
+   double control_time = time_control(fm, block_size, blocks);
+
+   begin_phase(&steady);
+   for (uint64_t b = 0; b < blocks; b++)
+   {
+      memset(left, 0, block_size * sizeof(float));
+      memset(right, 0, block_size * sizeof(float));
+      fmsynth_render(fm, left, right, block_size);
+   }
+   end_phase(&steady, blocks * block_size);
+
+   // Release tails, up to the same amount of work as steady state.
+   fmsynth_release_all(fm);
+   uint64_t release_blocks = 0;
+   unsigned active = polyphony;
+   begin_phase(&release);
+   while (active && release_blocks < blocks)
+   {
+      memset(left, 0, block_size * sizeof(float));
+      memset(right, 0, block_size * sizeof(float));
+      active = fmsynth_render(fm, left, right, block_size);
+      release_blocks++;
+   }
+   end_phase(&release, release_blocks * block_size);
+
+   struct phase tail;
+   start_release_tail(fm, polyphony);
+   begin_phase(&tail);
+   for (uint64_t b = 0; b < blocks; b++)
+   {
+      memset(left, 0, block_size * sizeof(float));
+      memset(right, 0, block_size * sizeof(float));
+      fmsynth_render(fm, left, right, block_size);
+   }
+   end_phase(&tail, blocks * block_size);
+
+   double elapsed = steady.seconds;
+   uint64_t frames = steady.frames;
+   double voice_frames = (double)frames * polyphony;
+   double control_fraction = elapsed > 0.0 ? control_time / elapsed : 0.0;
+   if (control_fraction > 1.0)
+   {
+      control_fraction = 1.0;
+   }
+
+   fprintf(out, "%s\n    { \"kernel\": \"%s\", \"quality\": \"standard\", \"operators\": %u, \"topology\": \"%s\", "
+         "\"polyphony\": %u, \"block_size\": %u, \"frames\": %llu, \"seconds\": %.6f, "
+         "\"msamples_per_sec\": %.4f, \"ns_per_voice_frame\": %.4f, "
+         "\"control_fraction\": %.4f, \"audio_fraction\": %.4f,\n      \"phases\": { ",
+         *first ? "" : ",",
+         fmsynth_get_kernel_name(fm), operators, topo->name, polyphony, block_size,
+         (unsigned long long)frames, elapsed,
+         voice_frames / elapsed * 1e-6, elapsed * 1e9 / voice_frames,
+         control_fraction, 1.0 - control_fraction);
+   print_phase(out, "note_on", &note_on, false);
+   print_phase(out, "steady", &steady, false);
+   print_phase(out, "release", &release, false);
+   print_phase(out, "release_tail", &tail, true);
+   fprintf(out, " } }");
+   fflush(out);
+   *first = false;
+
+   fprintf(stderr, "%-5s %2u-op %-20s voices %5u block %5u: %8.3f ns/voice-frame, release tail %5.2fx\n",
+         fmsynth_get_kernel_name(fm), operators, topo->name, polyphony, block_size,
+         elapsed * 1e9 / voice_frames, elapsed > 0.0 ? tail.seconds / elapsed : 0.0);
+   ret = true;
+
+end:
+   if (fm)
+   {
+      fmsynth_free(fm);
+   }
+   free(left);
+   free(right);
+   return ret;
+}
+
+static void print_help(const char *name)
+{
+   fprintf(stderr, "Usage: %s [options]\n", name);
+   fprintf(stderr, "  -p <list>    Polyphony, comma separated (default: 1,4,16,64,256,1024,2048).\n");
+   fprintf(stderr, "  -b <list>    Block sizes, comma separated (default: 16,64,256,1024,4096).\n");
+   fprintf(stderr, "  -k <list>    Kernels, c, simd and/or jit (default: c,simd,jit).\n");
+   fprintf(stderr, "  -O <list>    Operators per instance, comma separated (default: %u).\n", FMSYNTH_OPERATORS);
+   fprintf(stderr, "  -t <name>    Only run topologies whose name contains <name>.\n");
+   fprintf(stderr, "  -d <dir>     Directory with presets to use as topologies (default: presets).\n");
+   fprintf(stderr, "  -n <frames>  Voice-frames to render per scenario (default: 4194304).\n");
+   fprintf(stderr, "  -o <path>    Write JSON to file instead of stdout.\n");
+   fprintf(stderr, "  -r <config>  Also count a raw PMU event, e.g. an FP assist event of the CPU.\n");
+   fprintf(stderr, "  -T           Timing only, do not use hardware counters.\n");
+   fprintf(stderr, "  -L           Use global LFO mode, see fmsynth_set_global_lfo().\n");
+}
+
+int main(int argc, char *argv[])
+{
+   const char *preset_dir = "presets";
+   const char *output = NULL;
+   bool use_counters = true;
+
+   for (int i = 1; i < argc; i++)
+   {
+      const char *arg = argv[i];
+      bool has_value = i + 1 < argc;
+      bool ok = true;
+
+      if (!strcmp(arg, "-p") && has_value)
+      {
+         ok = parse_list(&polyphonies, argv[++i]);
+      }
+      else if (!strcmp(arg, "-b") && has_value)
+      {
+         ok = parse_list(&block_sizes, argv[++i]);
+      }
+      else if (!strcmp(arg, "-k") && has_value)
+      {
+         ok = parse_kernels(argv[++i]);
+      }
+      else if (!strcmp(arg, "-O") && has_value)
+      {
+         ok = parse_list(&operator_counts, argv[++i]);
+      }
+      else if (!strcmp(arg, "-t") && has_value)
+      {
+         topology_filter = argv[++i];
+      }
+      else if (!strcmp(arg, "-d") && has_value)
+      {
+         preset_dir = argv[++i];
+      }
+      else if (!strcmp(arg, "-n") && has_value)
+      {
+         voice_frames_per_run = strtoull(argv[++i], NULL, 0);
+      }
+      else if (!strcmp(arg, "-o") && has_value)
+      {
+         output = argv[++i];
+      }
+      else if (!strcmp(arg, "-r") && has_value)
+      {
+         raw_event = strtoull(argv[++i], NULL, 0);
+      }
+      else if (!strcmp(arg, "-T"))
+      {
+         use_counters = false;
+      }
+      else if (!strcmp(arg, "-L"))
+      {
+         global_lfo = true;
+      }
+      else
+      {
+         ok = false;
+      }
+
+      if (!ok)
+      {
+         print_help(argv[0]);
+         return EXIT_FAILURE;
+      }
+   }
+
+#if defined(__SSE__)
+   // -Ofast executables enable flush-to-zero at startup. Turn it off like a typical host would,
+   // so the release tail scenario verifies that fmsynth_render() handles denormals by itself.
+   _mm_setcsr(_mm_getcsr() & ~0x8040u);
+#endif
+
+   add_synthetic("sparse", false);
+   add_synthetic("dense", true);
+   add_presets(preset_dir);
+
+   FILE *out = output ? fopen(output, "w") : stdout;
+   if (!out)
+   {
+      fprintf(stderr, "Failed to open %s.\n", output);
+      return EXIT_FAILURE;
+   }
+
+   fprintf(out, "{\n  \"version\": %u,\n", fmsynth_get_version());
+#ifdef __VERSION__
+   fprintf(out, "  \"compiler\": \"%s\",\n", __VERSION__);
+#endif
+   fprintf(out, "  \"sample_rate\": %.0f,\n", BENCH_SAMPLE_RATE);
+   fprintf(out, "  \"frames_per_control_update\": %u,\n", FMSYNTH_FRAMES_PER_LFO);
+   fprintf(out, "  \"global_lfo\": %s,\n", global_lfo ? "true" : "false");
+
+   if (use_counters)
+   {
+      open_counters();
+   }
+
+   fprintf(out, "  \"counters\": [");
+   bool first_counter = true;
+   for (unsigned i = 0; i < COUNTER_COUNT; i++)
+   {
+      if (counter_fds[i] >= 0)
+      {
+         fprintf(out, "%s\"%s\"", first_counter ? "" : ", ", counter_names[i]);
+         first_counter = false;
+      }
+   }
+   fprintf(out, "],\n");
+
+   if (first_counter && use_counters)
+   {
+      fprintf(stderr, "Hardware counters unavailable, reporting timing only.\n");
+   }
+   fprintf(out, "  \"results\": [");
+
+   bool first = true;
+   bool ok = true;
+   for (unsigned k = 0; k < kernels.count && ok; k++)
+   {
+      for (unsigned o = 0; o < operator_counts.count && ok; o++)
+      {
+         for (unsigned t = 0; t < num_topologies && ok; t++)
+         {
+            if (topology_filter && !strstr(topologies[t].name, topology_filter))
+            {
+               continue;
+            }
+
+            for (unsigned p = 0; p < polyphonies.count && ok; p++)
+            {
+               for (unsigned b = 0; b < block_sizes.count && ok; b++)
+               {
+                  ok = run_scenario(out, &first, kernels.values[k], operator_counts.values[o],
+                        &topologies[t], polyphonies.values[p], block_sizes.values[b]);
+               }
+            }
+         }
+      }
+   }
+
+   fprintf(out, "\n  ]\n}\n");
+   if (output)
+   {
+      fclose(out);
+   }
+
+   close_counters();
+   for (unsigned t = 0; t < num_topologies; t++)
+   {
+      fmsynth_patch_free(topologies[t].patch);
+   }
+
+   return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
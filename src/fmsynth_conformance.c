@@ -0,0 +1,678 @@
+/* Copyright (C) 2014 Hans-Kristian Arntzen <maister@archlinux.us>
+ *
+ * Permission is hereby granted, free of charge,
+ * to any person obtaining a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Conformance and performance regression harness.
+// Renders a corpus through every kernel in the build and compares against the C reference kernel.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "fmsynth.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+
+#define SAMPLE_RATE 44100.0f
+#define BLOCK_SIZE 256
+#define MAX_PRESETS 64
+
+// FM feedback is chaotic, so tiny rounding differences between kernels
+// eventually grow into completely different waveforms.
+// Renders are kept short enough that a correct kernel stays well above the threshold.
+#define DEFAULT_FRAMES 8192
+#define DEFAULT_SNR 40.0
+
+enum scenario
+{
+   SCENARIO_PLAIN = 0,
+   SCENARIO_PITCH_BEND,
+   SCENARIO_MOD_WHEEL,
+   SCENARIO_RELEASE,
+   SCENARIO_LFO,
+   SCENARIO_COUNT
+};
+
+static const char *scenario_names[SCENARIO_COUNT] = {
+   "plain", "pitch_bend", "mod_wheel", "release", "lfo",
+};
+
+struct note_range
+{
+   const char *name;
+   uint8_t first;
+   uint8_t count;
+   uint8_t step;
+};
+
+static const struct note_range note_ranges[] = {
+   { "low", 24, 4, 5 },
+   { "mid", 48, 6, 4 },
+   { "high", 84, 4, 3 },
+};
+
+struct preset
+{
+   char name[64];
+   uint8_t *data;
+   size_t size;
+};
+
+static struct preset presets[MAX_PRESETS];
+static unsigned num_presets;
+static unsigned frames = DEFAULT_FRAMES;
+static double snr_threshold = DEFAULT_SNR;
+static bool verbose;
+
+static double get_time(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void load_presets(const char *dir)
+{
+   DIR *d = opendir(dir);
+   if (!d)
+   {
+      fprintf(stderr, "Cannot open preset directory %s.\n", dir);
+      return;
+   }
+
+   struct dirent *entry;
+   while ((entry = readdir(d)) && num_presets < MAX_PRESETS)
+   {
+      const char *ext = strrchr(entry->d_name, '.');
+      if (!ext || strcmp(ext, ".fmp") != 0)
+      {
+         continue;
+      }
+
+      char path[1024];
+      snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+      FILE *file = fopen(path, "rb");
+      if (!file)
+      {
+         continue;
+      }
+
+      // Presets may have been saved with any number of operators.
+      fseek(file, 0, SEEK_END);
+      long size = ftell(file);
+      rewind(file);
+
+      struct preset *preset = &presets[num_presets];
+      preset->data = size > 0 ? malloc(size) : NULL;
+      preset->size = size;
+      if (preset->data && fread(preset->data, 1, size, file) == (size_t)size &&
+            fmsynth_preset_stored_size(preset->data, size))
+      {
+         snprintf(preset->name, sizeof(preset->name), "%.*s",
+               (int)(ext - entry->d_name), entry->d_name);
+         num_presets++;
+      }
+      else
+      {
+         free(preset->data);
+         preset->data = NULL;
+      }
+      fclose(file);
+   }
+
+   closedir(d);
+}
+
+static bool render_case(enum fmsynth_kernel kernel, const struct preset *preset,
+      const struct note_range *range, enum scenario scenario, float *left, float *right)
+{
+   fmsynth_t *fm = fmsynth_new(SAMPLE_RATE, 64);
+   if (!fm)
+   {
+      return false;
+   }
+
+   if (fmsynth_set_kernel(fm, kernel) != FMSYNTH_STATUS_OK ||
+         fmsynth_preset_load(fm, NULL, preset->data, preset->size) != FMSYNTH_STATUS_OK)
+   {
+      fmsynth_free(fm);
+      return false;
+   }
+
+   // Bundled presets only use small LFO depths, so make the LFO clearly audible within a case.
+   // Voices pick up the LFO at note-on.
+   if (scenario == SCENARIO_LFO)
+   {
+      fmsynth_set_global_parameter(fm, FMSYNTH_GLOBAL_PARAM_LFO_FREQ, 6.0f);
+      for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+      {
+         fmsynth_set_parameter(fm, FMSYNTH_PARAM_LFO_AMP_SENSITIVITY, o, 0.5f);
+         fmsynth_set_parameter(fm, FMSYNTH_PARAM_LFO_FREQ_MOD_DEPTH, o, 0.05f);
+      }
+   }
+
+   for (unsigned i = 0; i < range->count; i++)
+   {
+      fmsynth_note_on(fm, range->first + i * range->step, 64 + 16 * (i & 3));
+   }
+
+   memset(left, 0, frames * sizeof(float));
+   memset(right, 0, frames * sizeof(float));
+
+   for (unsigned f = 0, block = 0; f < frames; f += BLOCK_SIZE, block++)
+   {
+      switch (scenario)
+      {
+         case SCENARIO_PITCH_BEND:
+            fmsynth_set_pitch_bend(fm, (8192 + 1024 * block) & 0x3fff);
+            break;
+
+         case SCENARIO_MOD_WHEEL:
+            fmsynth_set_mod_wheel(fm, (block * 16) & 0x7f);
+            break;
+
+         case SCENARIO_RELEASE:
+            if (f >= frames / 2)
+            {
+               fmsynth_release_all(fm);
+            }
+            break;
+
+         default:
+            break;
+      }
+
+      unsigned to_render = frames - f < BLOCK_SIZE ? frames - f : BLOCK_SIZE;
+      fmsynth_render(fm, left + f, right + f, to_render);
+   }
+
+   fmsynth_free(fm);
+   return true;
+}
+
+static double compute_snr(const float *ref_left, const float *ref_right,
+      const float *left, const float *right)
+{
+   double signal = 0.0;
+   double noise = 0.0;
+
+   for (unsigned i = 0; i < frames; i++)
+   {
+      if (!isfinite(left[i]) || !isfinite(right[i]))
+      {
+         return -INFINITY;
+      }
+
+      double l = left[i] - ref_left[i];
+      double r = right[i] - ref_right[i];
+      signal += (double)ref_left[i] * ref_left[i] + (double)ref_right[i] * ref_right[i];
+      noise += l * l + r * r;
+   }
+
+   if (noise == 0.0)
+   {
+      return INFINITY;
+   }
+   if (signal == 0.0)
+   {
+      return -INFINITY;
+   }
+   return 10.0 * log10(signal / noise);
+}
+
+static bool run_conformance(void)
+{
+   float *buffers[4];
+   for (unsigned i = 0; i < 4; i++)
+   {
+      buffers[i] = malloc(frames * sizeof(float));
+      if (!buffers[i])
+      {
+         return false;
+      }
+   }
+
+   static const enum fmsynth_kernel kernels[] = { FMSYNTH_KERNEL_SIMD, FMSYNTH_KERNEL_JIT };
+   static const char *kernel_names[] = { "simd", "jit" };
+   unsigned cases = 0;
+   unsigned failures = 0;
+   double worst = INFINITY;
+
+   for (unsigned p = 0; p < num_presets; p++)
+   {
+      for (unsigned r = 0; r < sizeof(note_ranges) / sizeof(note_ranges[0]); r++)
+      {
+         for (unsigned s = 0; s < SCENARIO_COUNT; s++)
+         {
+            if (!render_case(FMSYNTH_KERNEL_C, &presets[p], &note_ranges[r], s,
+                     buffers[0], buffers[1]))
+            {
+               fprintf(stderr, "Failed to render reference for %s.\n", presets[p].name);
+               failures++;
+               continue;
+            }
+
+            // Only one SIMD kernel is compiled into a build. The JIT is optional.
+            for (unsigned k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+            {
+               if (!render_case(kernels[k], &presets[p], &note_ranges[r], s,
+                        buffers[2], buffers[3]))
+               {
+                  continue;
+               }
+
+               double snr = compute_snr(buffers[0], buffers[1], buffers[2], buffers[3]);
+               bool ok = snr >= snr_threshold;
+               cases++;
+               failures += !ok;
+               worst = snr < worst ? snr : worst;
+
+               if (!ok || verbose)
+               {
+                  printf("%s %s %s/%s/%s: SNR %.1f dB\n", ok ? "PASS" : "FAIL",
+                        kernel_names[k], presets[p].name, note_ranges[r].name, scenario_names[s], snr);
+               }
+            }
+         }
+      }
+   }
+
+   for (unsigned i = 0; i < 4; i++)
+   {
+      free(buffers[i]);
+   }
+
+   if (cases == 0)
+   {
+      printf("No SIMD kernel in this build, conformance not tested.\n");
+   }
+   else
+   {
+      printf("Conformance: %u/%u cases passed, worst SNR %.1f dB (threshold %.1f dB).\n",
+            cases - failures, cases, worst, snr_threshold);
+   }
+
+   return failures == 0;
+}
+
+// Notes which are only released by All Notes Off, rendered in real time and as offline jobs.
+// Room is left for the All Notes Off event after the notes.
+static unsigned release_all_events(const struct note_range *range,
+      struct fmsynth_event *events, unsigned max_events)
+{
+   unsigned count = 0;
+   for (unsigned i = 0; i < range->count && count + 1 < max_events; i++)
+   {
+      struct fmsynth_event *event = &events[count++];
+      event->frame = i * 100;
+      event->data[0] = 0x90;
+      event->data[1] = range->first + i * range->step;
+      event->data[2] = 64 + 16 * (i & 3);
+   }
+
+   struct fmsynth_event *event = &events[count++];
+   event->frame = frames / 2;
+   event->data[0] = 0xb0;
+   event->data[1] = 123;
+   event->data[2] = 0;
+   return count;
+}
+
+static bool render_release_all(const struct preset *preset, const struct note_range *range,
+      bool offline, float *left, float *right)
+{
+   fmsynth_t *fm = fmsynth_new(SAMPLE_RATE, 64);
+   if (!fm)
+   {
+      return false;
+   }
+
+   if (fmsynth_set_kernel(fm, FMSYNTH_KERNEL_C) != FMSYNTH_STATUS_OK ||
+         fmsynth_preset_load(fm, NULL, preset->data, preset->size) != FMSYNTH_STATUS_OK)
+   {
+      fmsynth_free(fm);
+      return false;
+   }
+
+   struct fmsynth_event events[16];
+   unsigned num_events = release_all_events(range, events, sizeof(events) / sizeof(events[0]));
+
+   memset(left, 0, frames * sizeof(float));
+   memset(right, 0, frames * sizeof(float));
+
+   if (!offline)
+   {
+      unsigned f = 0;
+      for (unsigned e = 0; e <= num_events; e++)
+      {
+         unsigned end = e < num_events && events[e].frame < frames ? events[e].frame : frames;
+         fmsynth_render(fm, left + f, right + f, end - f);
+         f = end;
+         if (e < num_events)
+         {
+            fmsynth_parse_midi(fm, events[e].data);
+         }
+      }
+
+      fmsynth_free(fm);
+      return true;
+   }
+
+   fmsynth_offline_t *plan = fmsynth_offline_new(fm, events, num_events);
+   float *job_left = malloc(frames * sizeof(float));
+   float *job_right = malloc(frames * sizeof(float));
+   bool ok = plan && job_left && job_right;
+
+   for (size_t j = 0; ok && j < fmsynth_offline_num_jobs(plan); j++)
+   {
+      uint64_t start, job_frames;
+      fmsynth_offline_job_info(plan, j, &start, &job_frames);
+      if (start >= frames)
+      {
+         continue;
+      }
+      job_frames = start + job_frames > frames ? frames - start : job_frames;
+
+      memset(job_left, 0, job_frames * sizeof(float));
+      memset(job_right, 0, job_frames * sizeof(float));
+      job_frames = fmsynth_offline_render_job(plan, j, job_left, job_right, job_frames);
+      for (uint64_t i = 0; i < job_frames; i++)
+      {
+         left[start + i] += job_left[i];
+         right[start + i] += job_right[i];
+      }
+   }
+
+   free(job_left);
+   free(job_right);
+   fmsynth_offline_free(plan);
+   fmsynth_free(fm);
+   return ok;
+}
+
+// Offline rendering must match real-time rendering, also for notes released by All Notes Off.
+static bool run_offline_conformance(void)
+{
+   float *buffers[4];
+   for (unsigned i = 0; i < 4; i++)
+   {
+      buffers[i] = malloc(frames * sizeof(float));
+      if (!buffers[i])
+      {
+         return false;
+      }
+   }
+
+   unsigned cases = 0;
+   unsigned failures = 0;
+   double worst = INFINITY;
+
+   for (unsigned p = 0; p < num_presets; p++)
+   {
+      for (unsigned r = 0; r < sizeof(note_ranges) / sizeof(note_ranges[0]); r++)
+      {
+         if (!render_release_all(&presets[p], &note_ranges[r], false, buffers[0], buffers[1]) ||
+               !render_release_all(&presets[p], &note_ranges[r], true, buffers[2], buffers[3]))
+         {
+            fprintf(stderr, "Failed to render %s offline.\n", presets[p].name);
+            failures++;
+            continue;
+         }
+
+         double snr = compute_snr(buffers[0], buffers[1], buffers[2], buffers[3]);
+         bool ok = snr >= snr_threshold;
+         cases++;
+         failures += !ok;
+         worst = snr < worst ? snr : worst;
+
+         if (!ok || verbose)
+         {
+            printf("%s offline %s/%s/release_all: SNR %.1f dB\n", ok ? "PASS" : "FAIL",
+                  presets[p].name, note_ranges[r].name, snr);
+         }
+      }
+   }
+
+   for (unsigned i = 0; i < 4; i++)
+   {
+      free(buffers[i]);
+   }
+
+   printf("Offline: %u/%u cases passed, worst SNR %.1f dB (threshold %.1f dB).\n",
+         cases - failures, cases, worst, snr_threshold);
+   return failures == 0;
+}
+
+// Throughput in voice samples per second, for a fixed saturated scenario.
+static double measure_throughput(enum fmsynth_kernel kernel, const char **name)
+{
+   fmsynth_t *fm = fmsynth_new(SAMPLE_RATE, 64);
+   if (!fm)
+   {
+      return 0.0;
+   }
+
+   if (fmsynth_set_kernel(fm, kernel) != FMSYNTH_STATUS_OK)
+   {
+      fmsynth_free(fm);
+      return 0.0;
+   }
+   *name = fmsynth_get_kernel_name(fm);
+
+   for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
+   {
+      fmsynth_set_parameter(fm, FMSYNTH_PARAM_MOD_TO_CARRIERS0 + i, (i + 1) % FMSYNTH_OPERATORS, 2.0f);
+      fmsynth_set_parameter(fm, FMSYNTH_PARAM_FREQ_MOD, i, i + 1.0f);
+      fmsynth_set_parameter(fm, FMSYNTH_PARAM_CARRIERS, i, 1.0f);
+      fmsynth_set_parameter(fm, FMSYNTH_PARAM_LFO_FREQ_MOD_DEPTH, i, 0.15f);
+   }
+
+   for (unsigned i = 0; i < 64; i++)
+   {
+      fmsynth_note_on(fm, i + 20, 127);
+   }
+
+   float left[BLOCK_SIZE];
+   float right[BLOCK_SIZE];
+
+   // Best of several runs to reduce noise from the rest of the system.
+   double best = 0.0;
+   for (unsigned run = 0; run < 5; run++)
+   {
+      unsigned blocks = 200;
+      double start = get_time();
+      for (unsigned b = 0; b < blocks; b++)
+      {
+         memset(left, 0, sizeof(left));
+         memset(right, 0, sizeof(right));
+         fmsynth_render(fm, left, right, BLOCK_SIZE);
+      }
+      double rate = 64.0 * blocks * BLOCK_SIZE / (get_time() - start);
+      best = rate > best ? rate : best;
+   }
+
+   fmsynth_free(fm);
+   return best;
+}
+
+static double read_baseline(const char *path, const char *kernel)
+{
+   FILE *file = fopen(path, "r");
+   if (!file)
+   {
+      return 0.0;
+   }
+
+   char name[64];
+   double value;
+   double ret = 0.0;
+   while (fscanf(file, "%63s %lf", name, &value) == 2)
+   {
+      if (!strcmp(name, kernel))
+      {
+         ret = value;
+      }
+   }
+
+   fclose(file);
+   return ret;
+}
+
+static bool run_performance(const char *baseline, const char *write_baseline, double tolerance)
+{
+   static const enum fmsynth_kernel kernels[] = { FMSYNTH_KERNEL_C, FMSYNTH_KERNEL_SIMD, FMSYNTH_KERNEL_JIT };
+   FILE *out = NULL;
+   bool ok = true;
+
+   if (write_baseline)
+   {
+      out = fopen(write_baseline, "w");
+      if (!out)
+      {
+         fprintf(stderr, "Failed to open %s.\n", write_baseline);
+         return false;
+      }
+   }
+
+   for (unsigned k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+   {
+      const char *name = NULL;
+      double rate = measure_throughput(kernels[k], &name);
+      if (rate == 0.0)
+      {
+         continue;
+      }
+
+      printf("Throughput %-5s %8.2f Msamples/s", name, rate * 1e-6);
+
+      double reference = baseline ? read_baseline(baseline, name) : 0.0;
+      if (reference > 0.0)
+      {
+         bool pass = rate >= reference * (1.0 - tolerance);
+         ok = ok && pass;
+         printf(", baseline %8.2f Msamples/s: %s (%+.1f %%)", reference * 1e-6,
+               pass ? "PASS" : "FAIL", 100.0 * (rate / reference - 1.0));
+      }
+      printf("\n");
+
+      if (out)
+      {
+         fprintf(out, "%s %.0f\n", name, rate);
+      }
+   }
+
+   if (out)
+   {
+      fclose(out);
+   }
+
+   return ok;
+}
+
+static void print_help(const char *name)
+{
+   fprintf(stderr, "Usage: %s [options]\n", name);
+   fprintf(stderr, "  -d <dir>       Preset corpus directory (default: presets).\n");
+   fprintf(stderr, "  -f <frames>    Frames to render per case (default: %u).\n", DEFAULT_FRAMES);
+   fprintf(stderr, "  -s <dB>        Minimum SNR versus the C reference kernel (default: %.0f).\n", DEFAULT_SNR);
+   fprintf(stderr, "  -b <file>      Check throughput against baseline file.\n");
+   fprintf(stderr, "  -w <file>      Write measured throughput as new baseline file.\n");
+   fprintf(stderr, "  -t <fraction>  Allowed throughput regression (default: 0.1).\n");
+   fprintf(stderr, "  -v             Print every case.\n");
+}
+
+int main(int argc, char *argv[])
+{
+   const char *preset_dir = "presets";
+   const char *baseline = NULL;
+   const char *write_baseline = NULL;
+   double tolerance = 0.1;
+
+   if (fmsynth_get_max_operators() != FMSYNTH_OPERATORS)
+   {
+      fprintf(stderr, "Library has %u operators, but this program was built for %u.\n",
+            fmsynth_get_max_operators(), FMSYNTH_OPERATORS);
+      return EXIT_FAILURE;
+   }
+
+   for (int i = 1; i < argc; i++)
+   {
+      const char *arg = argv[i];
+      bool has_value = i + 1 < argc;
+
+      if (!strcmp(arg, "-d") && has_value)
+      {
+         preset_dir = argv[++i];
+      }
+      else if (!strcmp(arg, "-f") && has_value)
+      {
+         frames = strtoul(argv[++i], NULL, 0);
+      }
+      else if (!strcmp(arg, "-s") && has_value)
+      {
+         snr_threshold = strtod(argv[++i], NULL);
+      }
+      else if (!strcmp(arg, "-b") && has_value)
+      {
+         baseline = argv[++i];
+      }
+      else if (!strcmp(arg, "-w") && has_value)
+      {
+         write_baseline = argv[++i];
+      }
+      else if (!strcmp(arg, "-t") && has_value)
+      {
+         tolerance = strtod(argv[++i], NULL);
+      }
+      else if (!strcmp(arg, "-v"))
+      {
+         verbose = true;
+      }
+      else
+      {
+         print_help(argv[0]);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (frames == 0)
+   {
+      print_help(argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   load_presets(preset_dir);
+   if (num_presets == 0)
+   {
+      fprintf(stderr, "No presets found in %s.\n", preset_dir);
+      return EXIT_FAILURE;
+   }
+
+   bool ok = run_conformance();
+   ok = run_offline_conformance() && ok;
+   ok = run_performance(baseline, write_baseline, tolerance) && ok;
+
+   for (unsigned p = 0; p < num_presets; p++)
+   {
+      free(presets[p].data);
+   }
+
+   return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
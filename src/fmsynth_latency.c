@@ -0,0 +1,641 @@
+/* Copyright (C) 2014 Hans-Kristian Arntzen <maister@archlinux.us>
+ *
+ * Permission is hereby granted, free of charge,
+ * to any person obtaining a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Simulated real-time audio callback. A periodic timer thread drives fmsynth_render()
+// like an audio driver would, and reports the distribution of callback times and deadline misses.
+// No audio hardware is needed.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "fmsynth.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+struct event_list
+{
+   struct fmsynth_event *events;
+   size_t count;
+   size_t capacity;
+};
+
+struct workload
+{
+   const char *name;
+   bool (*generate)(struct event_list *list, uint64_t frames);
+};
+
+struct options
+{
+   float sample_rate;
+   unsigned block_size;
+   unsigned max_voices;
+   double seconds;
+   unsigned chord_size;
+   unsigned ahead_frames;
+   bool realtime;
+   const char *preset;
+   const char *events;
+};
+
+static struct options opts = {
+   48000.0f, 64, 256, 10.0, 16, 0, true, NULL, NULL,
+};
+
+struct harness
+{
+   fmsynth_t *fm;
+   fmsynth_ahead_t *ahead;
+   const struct event_list *list;
+   size_t next_event;
+   uint64_t frame;
+
+   float *left;
+   float *right;
+
+   unsigned callbacks;
+   double *render_times;
+   double *wakeup_times;
+   unsigned render_misses;
+   unsigned late_callbacks;
+   bool realtime;
+};
+
+static double timespec_to_sec(const struct timespec *ts)
+{
+   return ts->tv_sec + ts->tv_nsec * 1e-9;
+}
+
+static double get_time(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return timespec_to_sec(&ts);
+}
+
+static bool push_event(struct event_list *list, uint64_t frame,
+      uint8_t status, uint8_t data1, uint8_t data2)
+{
+   if (list->count == list->capacity)
+   {
+      size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+      struct fmsynth_event *events = realloc(list->events, capacity * sizeof(*events));
+      if (!events)
+      {
+         return false;
+      }
+      list->events = events;
+      list->capacity = capacity;
+   }
+
+   struct fmsynth_event *event = &list->events[list->count++];
+   event->frame = frame;
+   event->data[0] = status;
+   event->data[1] = data1;
+   event->data[2] = data2;
+   return true;
+}
+
+static uint64_t seconds_to_frames(double seconds)
+{
+   return (uint64_t)(seconds * opts.sample_rate);
+}
+
+// Bursts of large chords, which start many voices in the same callback.
+// Like every workload, events are generated sorted by frame.
+static bool generate_chords(struct event_list *list, uint64_t frames)
+{
+   uint64_t period = seconds_to_frames(0.5);
+   uint64_t length = seconds_to_frames(0.4);
+   unsigned chord = 0;
+
+   for (uint64_t frame = period / 2; frame + length < frames; frame += period, chord++)
+   {
+      uint8_t root = 36 + (chord * 7) % 24;
+      for (unsigned i = 0; i < opts.chord_size; i++)
+      {
+         if (!push_event(list, frame, 0x90, (root + 3 * i) & 0x7f, 100))
+         {
+            return false;
+         }
+      }
+      for (unsigned i = 0; i < opts.chord_size; i++)
+      {
+         if (!push_event(list, frame + length, 0x80, (root + 3 * i) & 0x7f, 0))
+         {
+            return false;
+         }
+      }
+   }
+   return true;
+}
+
+static bool hold_notes(struct event_list *list, uint64_t frames, bool on)
+{
+   for (unsigned i = 0; i < 8; i++)
+   {
+      if (!push_event(list, on ? 0 : frames - 1, on ? 0x90 : 0x80, 48 + 5 * i, on ? 100 : 0))
+      {
+         return false;
+      }
+   }
+   return true;
+}
+
+// Held notes with a mod wheel message every 16 frames.
+static bool generate_cc(struct event_list *list, uint64_t frames)
+{
+   if (!hold_notes(list, frames, true))
+   {
+      return false;
+   }
+
+   unsigned step = 0;
+   for (uint64_t frame = 16; frame < frames - 1; frame += 16, step++)
+   {
+      unsigned value = step % 254;
+      if (!push_event(list, frame, 0xb0, 1, value < 128 ? value : 253 - value))
+      {
+         return false;
+      }
+   }
+
+   return hold_notes(list, frames, false);
+}
+
+// Held notes with a pitch bend message every 32 frames, sweeping the full range once per second.
+static bool generate_bend(struct event_list *list, uint64_t frames)
+{
+   if (!hold_notes(list, frames, true))
+   {
+      return false;
+   }
+
+   for (uint64_t frame = 32; frame < frames - 1; frame += 32)
+   {
+      double phase = (double)frame / opts.sample_rate;
+      unsigned value = (unsigned)(0x2000 + 0x1fff * sin(2.0 * 3.14159265358979 * phase));
+      if (!push_event(list, frame, 0xe0, value & 0x7f, (value >> 7) & 0x7f))
+      {
+         return false;
+      }
+   }
+
+   return hold_notes(list, frames, false);
+}
+
+// Recorded events, one per line: frame followed by three MIDI bytes in hex.
+static bool load_events(struct event_list *list, const char *path)
+{
+   FILE *file = fopen(path, "r");
+   if (!file)
+   {
+      fprintf(stderr, "Failed to open %s.\n", path);
+      return false;
+   }
+
+   unsigned long long frame;
+   unsigned status, data1, data2;
+   uint64_t last = 0;
+   bool ok = true;
+   int ret;
+
+   while ((ret = fscanf(file, "%llu %x %x %x", &frame, &status, &data1, &data2)) == 4)
+   {
+      if (frame < last)
+      {
+         fprintf(stderr, "Events in %s must be sorted by frame.\n", path);
+         ok = false;
+         break;
+      }
+      last = frame;
+
+      if (!push_event(list, frame, status, data1, data2))
+      {
+         ok = false;
+         break;
+      }
+   }
+
+   if (ok && ret != EOF)
+   {
+      fprintf(stderr, "Malformed event in %s.\n", path);
+      ok = false;
+   }
+
+   fclose(file);
+   return ok;
+}
+
+static const struct workload workloads[] = {
+   { "chords", generate_chords },
+   { "cc", generate_cc },
+   { "bend", generate_bend },
+};
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+// Event times are known in advance, so they are scheduled as early as the event queue allows.
+static void schedule_ahead(struct harness *h)
+{
+   while (h->next_event < h->list->count)
+   {
+      if (fmsynth_ahead_schedule(h->ahead, &h->list->events[h->next_event]) != FMSYNTH_STATUS_OK)
+      {
+         break;
+      }
+      h->next_event++;
+   }
+}
+
+// What a host does in its audio callback. Events are applied at their exact frame.
+static void callback(struct harness *h)
+{
+   memset(h->left, 0, opts.block_size * sizeof(float));
+   memset(h->right, 0, opts.block_size * sizeof(float));
+
+   if (h->ahead)
+   {
+      schedule_ahead(h);
+      fmsynth_ahead_read(h->ahead, h->left, h->right, opts.block_size);
+      return;
+   }
+
+   unsigned done = 0;
+   while (done < opts.block_size)
+   {
+      uint64_t frame = h->frame + done;
+      while (h->next_event < h->list->count && h->list->events[h->next_event].frame <= frame)
+      {
+         fmsynth_parse_midi(h->fm, h->list->events[h->next_event++].data);
+      }
+
+      unsigned to_render = opts.block_size - done;
+      if (h->next_event < h->list->count &&
+            h->list->events[h->next_event].frame - frame < to_render)
+      {
+         to_render = h->list->events[h->next_event].frame - frame;
+      }
+
+      fmsynth_render(h->fm, h->left + done, h->right + done, to_render);
+      done += to_render;
+   }
+   h->frame += opts.block_size;
+}
+
+static void *timer_thread(void *data)
+{
+   struct harness *h = data;
+   double period = opts.block_size / opts.sample_rate;
+   long period_ns = (long)(period * 1e9);
+
+   struct timespec wakeup;
+   clock_gettime(CLOCK_MONOTONIC, &wakeup);
+
+   for (unsigned i = 0; i < h->callbacks; i++)
+   {
+      wakeup.tv_nsec += period_ns;
+      while (wakeup.tv_nsec >= 1000000000)
+      {
+         wakeup.tv_nsec -= 1000000000;
+         wakeup.tv_sec++;
+      }
+
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL) != 0)
+         ;
+
+      double scheduled = timespec_to_sec(&wakeup);
+      double start = get_time();
+      callback(h);
+      double end = get_time();
+
+      h->wakeup_times[i] = start - scheduled;
+      h->render_times[i] = end - start;
+
+      // A driver would need the buffer before the next period starts.
+      if (end - start > period)
+      {
+         h->render_misses++;
+      }
+      if (end > scheduled + period)
+      {
+         h->late_callbacks++;
+      }
+   }
+
+   return NULL;
+}
+
+// Runs the timer thread with SCHED_FIFO if permitted, otherwise with normal priority.
+static bool run_timer(struct harness *h)
+{
+   pthread_t thread;
+   pthread_attr_t attr;
+   struct sched_param param;
+
+   h->realtime = false;
+   if (opts.realtime)
+   {
+      memset(&param, 0, sizeof(param));
+      param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+      pthread_attr_init(&attr);
+      pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+      pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+      pthread_attr_setschedparam(&attr, &param);
+      h->realtime = pthread_create(&thread, &attr, timer_thread, h) == 0;
+      pthread_attr_destroy(&attr);
+   }
+
+   if (!h->realtime && pthread_create(&thread, NULL, timer_thread, h) != 0)
+   {
+      return false;
+   }
+
+   pthread_join(thread, NULL);
+   return true;
+}
+
+static int compare_double(const void *a_, const void *b_)
+{
+   double a = *(const double*)a_;
+   double b = *(const double*)b_;
+   return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static double percentile(const double *sorted, unsigned count, double p)
+{
+   unsigned index = (unsigned)ceil(p * count);
+   return sorted[index ? index - 1 : 0];
+}
+
+static void print_distribution(const char *name, double *values, unsigned count)
+{
+   qsort(values, count, sizeof(*values), compare_double);
+   printf("  %-15s p50 %8.1f us, p99 %8.1f us, p99.9 %8.1f us, max %8.1f us\n", name,
+         1e6 * percentile(values, count, 0.5),
+         1e6 * percentile(values, count, 0.99),
+         1e6 * percentile(values, count, 0.999),
+         1e6 * values[count - 1]);
+}
+
+static bool run_workload(const char *name, const struct event_list *list, const void *preset, size_t preset_size)
+{
+   struct harness h;
+   memset(&h, 0, sizeof(h));
+
+   h.fm = fmsynth_new(opts.sample_rate, opts.max_voices);
+   h.left = malloc(opts.block_size * sizeof(float));
+   h.right = malloc(opts.block_size * sizeof(float));
+   h.callbacks = (unsigned)(seconds_to_frames(opts.seconds) / opts.block_size);
+   h.render_times = calloc(h.callbacks, sizeof(double));
+   h.wakeup_times = calloc(h.callbacks, sizeof(double));
+   h.list = list;
+   bool ok = false;
+
+   if (!h.fm || !h.left || !h.right || !h.render_times || !h.wakeup_times || h.callbacks == 0)
+   {
+      goto end;
+   }
+
+   if (preset && fmsynth_preset_load(h.fm, NULL, preset, preset_size) != FMSYNTH_STATUS_OK)
+   {
+      fprintf(stderr, "Failed to load preset %s.\n", opts.preset);
+      goto end;
+   }
+
+   if (opts.ahead_frames)
+   {
+      h.ahead = fmsynth_ahead_new(h.fm, opts.ahead_frames + opts.block_size, opts.block_size, 4096);
+      if (!h.ahead)
+      {
+         goto end;
+      }
+   }
+
+   if (!run_timer(&h))
+   {
+      fprintf(stderr, "Failed to start timer thread.\n");
+      goto end;
+   }
+
+   double period = opts.block_size / opts.sample_rate;
+   printf("%s: %u callbacks of %u frames (%.3f ms), %s%s\n", name, h.callbacks, opts.block_size,
+         1e3 * period, h.realtime ? "SCHED_FIFO" : "normal priority",
+         h.ahead ? ", render-ahead" : "");
+   print_distribution("callback", h.render_times, h.callbacks);
+   print_distribution("wakeup jitter", h.wakeup_times, h.callbacks);
+   printf("  deadline misses: %u callbacks took longer than a period, %u finished after their deadline\n",
+         h.render_misses, h.late_callbacks);
+
+   if (h.ahead)
+   {
+      struct fmsynth_ahead_stats stats;
+      fmsynth_ahead_get_stats(h.ahead, &stats);
+      printf("  render-ahead: %llu underrun frames, %llu late events\n",
+            (unsigned long long)stats.underrun_frames, (unsigned long long)stats.late_events);
+   }
+   ok = true;
+
+end:
+   fmsynth_ahead_free(h.ahead);
+   if (h.fm)
+   {
+      fmsynth_free(h.fm);
+   }
+   free(h.left);
+   free(h.right);
+   free(h.render_times);
+   free(h.wakeup_times);
+   return ok;
+}
+
+static void *read_file(const char *path, size_t *size)
+{
+   FILE *file = fopen(path, "rb");
+   if (!file)
+   {
+      return NULL;
+   }
+
+   fseek(file, 0, SEEK_END);
+   long len = ftell(file);
+   rewind(file);
+
+   void *buffer = len > 0 ? malloc(len) : NULL;
+   if (buffer && fread(buffer, 1, len, file) != (size_t)len)
+   {
+      free(buffer);
+      buffer = NULL;
+   }
+
+   fclose(file);
+   *size = buffer ? (size_t)len : 0;
+   return buffer;
+}
+
+static void print_help(const char *name)
+{
+   fprintf(stderr, "Usage: %s [options]\n", name);
+   fprintf(stderr, "  -w <list>    Workloads, comma separated, chords, cc and/or bend (default: all).\n");
+   fprintf(stderr, "  -e <path>    Recorded events instead of workloads. One event per line: frame and three MIDI bytes in hex.\n");
+   fprintf(stderr, "  -P <path>    Preset to play (default: initial parameters).\n");
+   fprintf(stderr, "  -s <rate>    Sample rate (default: 48000).\n");
+   fprintf(stderr, "  -b <frames>  Frames per callback (default: 64).\n");
+   fprintf(stderr, "  -p <voices>  Max voices (default: 256).\n");
+   fprintf(stderr, "  -d <secs>    Seconds to run each workload (default: 10).\n");
+   fprintf(stderr, "  -c <notes>   Notes per chord in the chords workload (default: 16).\n");
+   fprintf(stderr, "  -a <frames>  Render ahead this many frames on a background thread, see fmsynth_ahead_new().\n");
+   fprintf(stderr, "  -N           Do not try to use SCHED_FIFO.\n");
+}
+
+static bool parse_workloads(const char *arg, bool *enabled)
+{
+   memset(enabled, 0, NUM_WORKLOADS * sizeof(*enabled));
+   while (*arg)
+   {
+      size_t len = strcspn(arg, ",");
+      bool found = false;
+      for (unsigned i = 0; i < NUM_WORKLOADS; i++)
+      {
+         if (strlen(workloads[i].name) == len && !strncmp(arg, workloads[i].name, len))
+         {
+            enabled[i] = true;
+            found = true;
+         }
+      }
+
+      if (!found)
+      {
+         return false;
+      }
+
+      arg += len;
+      if (*arg == ',')
+      {
+         arg++;
+      }
+   }
+   return true;
+}
+
+int main(int argc, char *argv[])
+{
+   bool enabled[NUM_WORKLOADS];
+   for (unsigned i = 0; i < NUM_WORKLOADS; i++)
+   {
+      enabled[i] = true;
+   }
+
+   for (int i = 1; i < argc; i++)
+   {
+      const char *arg = argv[i];
+      bool has_value = i + 1 < argc;
+      bool ok = true;
+
+      if (!strcmp(arg, "-w") && has_value)
+      {
+         ok = parse_workloads(argv[++i], enabled);
+      }
+      else if (!strcmp(arg, "-e") && has_value)
+      {
+         opts.events = argv[++i];
+      }
+      else if (!strcmp(arg, "-P") && has_value)
+      {
+         opts.preset = argv[++i];
+      }
+      else if (!strcmp(arg, "-s") && has_value)
+      {
+         opts.sample_rate = strtod(argv[++i], NULL);
+      }
+      else if (!strcmp(arg, "-b") && has_value)
+      {
+         opts.block_size = strtoul(argv[++i], NULL, 0);
+      }
+      else if (!strcmp(arg, "-p") && has_value)
+      {
+         opts.max_voices = strtoul(argv[++i], NULL, 0);
+      }
+      else if (!strcmp(arg, "-d") && has_value)
+      {
+         opts.seconds = strtod(argv[++i], NULL);
+      }
+      else if (!strcmp(arg, "-c") && has_value)
+      {
+         opts.chord_size = strtoul(argv[++i], NULL, 0);
+      }
+      else if (!strcmp(arg, "-a") && has_value)
+      {
+         opts.ahead_frames = strtoul(argv[++i], NULL, 0);
+      }
+      else if (!strcmp(arg, "-N"))
+      {
+         opts.realtime = false;
+      }
+      else
+      {
+         ok = false;
+      }
+
+      if (!ok || opts.sample_rate <= 0.0f || opts.block_size == 0)
+      {
+         print_help(argv[0]);
+         return EXIT_FAILURE;
+      }
+   }
+
+   size_t preset_size = 0;
+   void *preset = NULL;
+   if (opts.preset && !(preset = read_file(opts.preset, &preset_size)))
+   {
+      fprintf(stderr, "Failed to read preset %s.\n", opts.preset);
+      return EXIT_FAILURE;
+   }
+
+   bool ok = true;
+   if (opts.events)
+   {
+      struct event_list list = { NULL, 0, 0 };
+      ok = load_events(&list, opts.events) &&
+         run_workload(opts.events, &list, preset, preset_size);
+      free(list.events);
+   }
+   else
+   {
+      uint64_t frames = seconds_to_frames(opts.seconds);
+      for (unsigned i = 0; i < NUM_WORKLOADS && ok; i++)
+      {
+         if (!enabled[i])
+         {
+            continue;
+         }
+
+         struct event_list list = { NULL, 0, 0 };
+         ok = workloads[i].generate(&list, frames) &&
+            run_workload(workloads[i].name, &list, preset, preset_size);
+         free(list.events);
+      }
+   }
+
+   free(preset);
+   return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
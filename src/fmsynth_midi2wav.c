@@ -0,0 +1,1074 @@
+/* Copyright (C) 2014 Hans-Kristian Arntzen <maister@archlinux.us>
+ *
+ * Permission is hereby granted, free of charge,
+ * to any person obtaining a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Offline renderer. Renders Standard MIDI Files to WAV or raw float.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "fmsynth.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define MAX_PATCHES FMSYNTH_PROGRAMS
+#define MAX_JOBS 4096
+
+struct midi_event
+{
+   uint64_t tick;
+   uint64_t frame;
+   uint32_t order;
+   uint16_t track;
+   uint8_t data[3];
+};
+
+struct tempo_event
+{
+   uint64_t tick;
+   uint32_t usec_per_quarter;
+   uint32_t order;
+};
+
+struct midi_file
+{
+   struct midi_event *events;
+   size_t num_events;
+   struct tempo_event *tempos;
+   size_t num_tempos;
+   unsigned tracks;
+   unsigned division;
+};
+
+struct job
+{
+   const char *input;
+   char output[1024];
+   int track; // -1 renders all tracks.
+};
+
+struct options
+{
+   float sample_rate;
+   unsigned max_voices;
+   unsigned block_size;
+   float max_tail;
+   bool raw;
+   bool split_tracks;
+   bool voice_parallel;
+   unsigned threads;
+   const char *output;
+
+   fmsynth_patch_t *patches[MAX_PATCHES];
+   unsigned num_patches;
+};
+
+static struct options opts = {
+   44100.0f, 256, 4096, 30.0f, false, false, false, 1, NULL, { NULL }, 0,
+};
+
+static struct job jobs[MAX_JOBS];
+static unsigned num_jobs;
+static unsigned next_job;
+static bool job_failed;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *read_file(const char *path, size_t *size)
+{
+   FILE *file = fopen(path, "rb");
+   if (!file)
+   {
+      return NULL;
+   }
+
+   fseek(file, 0, SEEK_END);
+   long len = ftell(file);
+   rewind(file);
+
+   void *buffer = len > 0 ? malloc(len) : NULL;
+   if (buffer && fread(buffer, 1, len, file) != (size_t)len)
+   {
+      free(buffer);
+      buffer = NULL;
+   }
+
+   fclose(file);
+   *size = buffer ? (size_t)len : 0;
+   return buffer;
+}
+
+static uint32_t read_be(const uint8_t *buffer, unsigned bytes)
+{
+   uint32_t value = 0;
+   for (unsigned i = 0; i < bytes; i++)
+   {
+      value = (value << 8) | buffer[i];
+   }
+   return value;
+}
+
+static bool read_varlen(const uint8_t **ptr, const uint8_t *end, uint32_t *value)
+{
+   uint32_t v = 0;
+   for (unsigned i = 0; i < 4; i++)
+   {
+      if (*ptr >= end)
+      {
+         return false;
+      }
+
+      uint8_t c = *(*ptr)++;
+      v = (v << 7) | (c & 0x7f);
+      if ((c & 0x80) == 0)
+      {
+         *value = v;
+         return true;
+      }
+   }
+   return false;
+}
+
+static bool push_event(struct midi_file *midi, size_t *capacity,
+      uint64_t tick, unsigned track, const uint8_t *data, unsigned len)
+{
+   if (midi->num_events >= *capacity)
+   {
+      size_t new_capacity = *capacity ? *capacity * 2 : 1024;
+      struct midi_event *events = realloc(midi->events, new_capacity * sizeof(*events));
+      if (!events)
+      {
+         return false;
+      }
+      midi->events = events;
+      *capacity = new_capacity;
+   }
+
+   struct midi_event *ev = &midi->events[midi->num_events];
+   memset(ev, 0, sizeof(*ev));
+   ev->tick = tick;
+   ev->track = track;
+   ev->order = midi->num_events++;
+   memcpy(ev->data, data, len);
+   return true;
+}
+
+static bool push_tempo(struct midi_file *midi, size_t *capacity,
+      uint64_t tick, uint32_t usec_per_quarter)
+{
+   if (midi->num_tempos >= *capacity)
+   {
+      size_t new_capacity = *capacity ? *capacity * 2 : 16;
+      struct tempo_event *tempos = realloc(midi->tempos, new_capacity * sizeof(*tempos));
+      if (!tempos)
+      {
+         return false;
+      }
+      midi->tempos = tempos;
+      *capacity = new_capacity;
+   }
+
+   struct tempo_event *ev = &midi->tempos[midi->num_tempos];
+   ev->tick = tick;
+   ev->usec_per_quarter = usec_per_quarter;
+   ev->order = midi->num_tempos++;
+   return true;
+}
+
+static bool parse_track(struct midi_file *midi, unsigned track,
+      const uint8_t *ptr, const uint8_t *end,
+      size_t *event_capacity, size_t *tempo_capacity)
+{
+   uint64_t tick = 0;
+   uint8_t status = 0;
+
+   while (ptr < end)
+   {
+      uint32_t delta;
+      if (!read_varlen(&ptr, end, &delta))
+      {
+         return false;
+      }
+      tick += delta;
+
+      if (ptr >= end)
+      {
+         return false;
+      }
+
+      uint8_t c = *ptr;
+      if (c == 0xff)
+      {
+         uint32_t len;
+         if (ptr + 2 > end)
+         {
+            return false;
+         }
+
+         uint8_t type = ptr[1];
+         ptr += 2;
+         if (!read_varlen(&ptr, end, &len) || ptr + len > end)
+         {
+            return false;
+         }
+
+         if (type == 0x51 && len == 3)
+         {
+            if (!push_tempo(midi, tempo_capacity, tick, read_be(ptr, 3)))
+            {
+               return false;
+            }
+         }
+         else if (type == 0x2f)
+         {
+            break;
+         }
+
+         ptr += len;
+      }
+      else if (c == 0xf0 || c == 0xf7)
+      {
+         // SysEx is skipped.
+         uint32_t len;
+         ptr++;
+         if (!read_varlen(&ptr, end, &len) || ptr + len > end)
+         {
+            return false;
+         }
+         ptr += len;
+      }
+      else
+      {
+         if (c & 0x80)
+         {
+            status = c;
+            ptr++;
+         }
+         else if (status == 0)
+         {
+            return false;
+         }
+
+         unsigned type = status & 0xf0;
+         unsigned len = (type == 0xc0 || type == 0xd0) ? 1 : 2;
+         if (ptr + len > end)
+         {
+            return false;
+         }
+
+         uint8_t data[3] = { status, ptr[0], len == 2 ? ptr[1] : 0 };
+         ptr += len;
+
+         if (!push_event(midi, event_capacity, tick, track, data, 3))
+         {
+            return false;
+         }
+      }
+   }
+
+   return true;
+}
+
+static int compare_events(const void *a_, const void *b_)
+{
+   const struct midi_event *a = a_;
+   const struct midi_event *b = b_;
+   if (a->tick != b->tick)
+   {
+      return a->tick < b->tick ? -1 : 1;
+   }
+   return a->order < b->order ? -1 : (a->order > b->order);
+}
+
+static int compare_tempos(const void *a_, const void *b_)
+{
+   const struct tempo_event *a = a_;
+   const struct tempo_event *b = b_;
+   if (a->tick != b->tick)
+   {
+      return a->tick < b->tick ? -1 : 1;
+   }
+   return a->order < b->order ? -1 : (a->order > b->order);
+}
+
+// Converts ticks to sample-accurate frame positions using the tempo map.
+static void assign_frames(struct midi_file *midi, float sample_rate)
+{
+   double seconds_per_tick;
+   bool smpte = midi->division & 0x8000;
+
+   if (smpte)
+   {
+      int fps = -(int8_t)(midi->division >> 8);
+      unsigned ticks_per_frame = midi->division & 0xff;
+      seconds_per_tick = 1.0 / ((fps == 29 ? 29.97 : fps) * ticks_per_frame);
+   }
+   else
+   {
+      seconds_per_tick = 0.5 / midi->division;
+   }
+
+   size_t tempo = 0;
+   uint64_t base_tick = 0;
+   double base_seconds = 0.0;
+
+   for (size_t i = 0; i < midi->num_events; i++)
+   {
+      struct midi_event *ev = &midi->events[i];
+
+      while (!smpte && tempo < midi->num_tempos && midi->tempos[tempo].tick <= ev->tick)
+      {
+         base_seconds += (midi->tempos[tempo].tick - base_tick) * seconds_per_tick;
+         base_tick = midi->tempos[tempo].tick;
+         seconds_per_tick = midi->tempos[tempo].usec_per_quarter * 1e-6 / midi->division;
+         tempo++;
+      }
+
+      double seconds = base_seconds + (ev->tick - base_tick) * seconds_per_tick;
+      ev->frame = (uint64_t)(seconds * sample_rate + 0.5);
+   }
+}
+
+static bool load_midi(struct midi_file *midi, const char *path, float sample_rate)
+{
+   size_t size;
+   uint8_t *buffer = read_file(path, &size);
+   if (!buffer)
+   {
+      fprintf(stderr, "Failed to read %s.\n", path);
+      return false;
+   }
+
+   memset(midi, 0, sizeof(*midi));
+   size_t event_capacity = 0;
+   size_t tempo_capacity = 0;
+   bool ret = false;
+
+   if (size < 14 || memcmp(buffer, "MThd", 4) != 0 || read_be(buffer + 4, 4) < 6)
+   {
+      fprintf(stderr, "%s is not a Standard MIDI File.\n", path);
+      goto end;
+   }
+
+   midi->tracks = read_be(buffer + 10, 2);
+   midi->division = read_be(buffer + 12, 2);
+   if (midi->division == 0)
+   {
+      fprintf(stderr, "%s has invalid time division.\n", path);
+      goto end;
+   }
+
+   const uint8_t *ptr = buffer + 8 + read_be(buffer + 4, 4);
+   const uint8_t *end = buffer + size;
+   unsigned track = 0;
+
+   while (track < midi->tracks && ptr + 8 <= end)
+   {
+      uint32_t len = read_be(ptr + 4, 4);
+      const uint8_t *chunk = ptr + 8;
+      if (len > (size_t)(end - chunk))
+      {
+         fprintf(stderr, "%s is truncated.\n", path);
+         goto end;
+      }
+
+      if (memcmp(ptr, "MTrk", 4) == 0)
+      {
+         if (!parse_track(midi, track, chunk, chunk + len,
+                  &event_capacity, &tempo_capacity))
+         {
+            fprintf(stderr, "%s: Failed to parse track %u.\n", path, track);
+            goto end;
+         }
+         track++;
+      }
+
+      ptr = chunk + len;
+   }
+
+   midi->tracks = track;
+   qsort(midi->events, midi->num_events, sizeof(*midi->events), compare_events);
+   qsort(midi->tempos, midi->num_tempos, sizeof(*midi->tempos), compare_tempos);
+   assign_frames(midi, sample_rate);
+   ret = true;
+
+end:
+   free(buffer);
+   if (!ret)
+   {
+      free(midi->events);
+      free(midi->tempos);
+   }
+   return ret;
+}
+
+static void write_u16_le(uint8_t *buffer, uint16_t value)
+{
+   buffer[0] = (uint8_t)(value >> 0);
+   buffer[1] = (uint8_t)(value >> 8);
+}
+
+static void write_u32_le(uint8_t *buffer, uint32_t value)
+{
+   write_u16_le(buffer + 0, (uint16_t)(value >>  0));
+   write_u16_le(buffer + 2, (uint16_t)(value >> 16));
+}
+
+static bool write_wav_header(FILE *file, float sample_rate, uint64_t frames)
+{
+   uint8_t header[44];
+   uint64_t data_size = frames * 2 * sizeof(float);
+   if (data_size > 0xffffffffu - 36)
+   {
+      data_size = 0xffffffffu - 36;
+   }
+
+   memcpy(header + 0, "RIFF", 4);
+   write_u32_le(header + 4, (uint32_t)(36 + data_size));
+   memcpy(header + 8, "WAVEfmt ", 8);
+   write_u32_le(header + 16, 16);
+   write_u16_le(header + 20, 3); // IEEE float
+   write_u16_le(header + 22, 2);
+   write_u32_le(header + 24, (uint32_t)sample_rate);
+   write_u32_le(header + 28, (uint32_t)sample_rate * 2 * sizeof(float));
+   write_u16_le(header + 32, 2 * sizeof(float));
+   write_u16_le(header + 34, 32);
+   memcpy(header + 36, "data", 4);
+   write_u32_le(header + 40, (uint32_t)data_size);
+
+   return fwrite(header, sizeof(header), 1, file) == 1;
+}
+
+static bool write_frames(FILE *file, const float *left, const float *right,
+      float *interleaved, unsigned frames)
+{
+   uint8_t *out = (uint8_t*)interleaved;
+   for (unsigned i = 0; i < frames; i++)
+   {
+      union { float f; uint32_t u; } l = { left[i] }, r = { right[i] };
+      write_u32_le(out + 8 * i + 0, l.u);
+      write_u32_le(out + 8 * i + 4, r.u);
+   }
+   return fwrite(out, 2 * sizeof(float), frames, file) == frames;
+}
+
+static bool render_stream(fmsynth_t *fm, const struct midi_file *midi,
+      const struct job *job, FILE *file, float *left, float *right, float *interleaved,
+      uint64_t *frames)
+{
+   uint64_t frame = 0;
+   unsigned busy = 0;
+
+   for (size_t i = 0; i <= midi->num_events; i++)
+   {
+      const struct midi_event *ev = i < midi->num_events ? &midi->events[i] : NULL;
+      if (ev && job->track >= 0 && ev->track != job->track)
+      {
+         continue;
+      }
+
+      // After the last event, render until voices have died or tail limit is reached.
+      uint64_t target = ev ? ev->frame :
+         frame + (uint64_t)(opts.max_tail * opts.sample_rate);
+
+      while (frame < target)
+      {
+         unsigned to_render = target - frame > opts.block_size ?
+            opts.block_size : (unsigned)(target - frame);
+
+         memset(left, 0, to_render * sizeof(float));
+         memset(right, 0, to_render * sizeof(float));
+         unsigned active = fmsynth_render(fm, left, right, to_render);
+
+         if (!write_frames(file, left, right, interleaved, to_render))
+         {
+            return false;
+         }
+
+         frame += to_render;
+         if (!ev && active == 0)
+         {
+            break;
+         }
+      }
+
+      if (ev && fmsynth_parse_midi(fm, ev->data) == FMSYNTH_STATUS_BUSY)
+      {
+         busy++;
+      }
+   }
+
+   if (busy)
+   {
+      fprintf(stderr, "%s: %u notes dropped, polyphony exhausted.\n", job->output, busy);
+   }
+
+   *frames = frame;
+   return true;
+}
+
+struct voice_context
+{
+   const fmsynth_offline_t *plan;
+   size_t next_job;
+   float *left;
+   float *right;
+   uint64_t frames;
+   uint64_t max_frames;
+   bool failed;
+   pthread_mutex_t lock;
+};
+
+static void *voice_worker(void *data)
+{
+   struct voice_context *ctx = data;
+   size_t num_jobs = fmsynth_offline_num_jobs(ctx->plan);
+   float *left = NULL;
+   float *right = NULL;
+   uint64_t capacity = 0;
+
+   for (;;)
+   {
+      pthread_mutex_lock(&ctx->lock);
+      size_t index = ctx->next_job++;
+      pthread_mutex_unlock(&ctx->lock);
+
+      if (index >= num_jobs)
+      {
+         break;
+      }
+
+      uint64_t start, frames;
+      fmsynth_offline_job_info(ctx->plan, index, &start, &frames);
+      frames = start + frames > ctx->max_frames ? ctx->max_frames - start : frames;
+
+      if (frames > capacity)
+      {
+         free(left);
+         free(right);
+         capacity = frames;
+         left = malloc(capacity * sizeof(float));
+         right = malloc(capacity * sizeof(float));
+         if (!left || !right)
+         {
+            capacity = 0;
+            pthread_mutex_lock(&ctx->lock);
+            ctx->failed = true;
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+         }
+      }
+
+      memset(left, 0, frames * sizeof(float));
+      memset(right, 0, frames * sizeof(float));
+      frames = fmsynth_offline_render_job(ctx->plan, index, left, right, frames);
+
+      pthread_mutex_lock(&ctx->lock);
+      for (uint64_t i = 0; i < frames; i++)
+      {
+         ctx->left[start + i] += left[i];
+         ctx->right[start + i] += right[i];
+      }
+      if (start + frames > ctx->frames)
+      {
+         ctx->frames = start + frames;
+      }
+      pthread_mutex_unlock(&ctx->lock);
+   }
+
+   free(left);
+   free(right);
+   return NULL;
+}
+
+// Renders every note as an independent job, and mixes the result in memory.
+static bool render_voices(fmsynth_t *fm, const struct midi_file *midi,
+      const struct job *job, FILE *file, float *interleaved, uint64_t *frames)
+{
+   struct fmsynth_event *events = calloc(midi->num_events + 1, sizeof(*events));
+   if (!events)
+   {
+      return false;
+   }
+
+   size_t num_events = 0;
+   for (size_t i = 0; i < midi->num_events; i++)
+   {
+      if (job->track < 0 || midi->events[i].track == job->track)
+      {
+         events[num_events].frame = midi->events[i].frame;
+         memcpy(events[num_events].data, midi->events[i].data, 3);
+         num_events++;
+      }
+   }
+
+   struct voice_context ctx;
+   memset(&ctx, 0, sizeof(ctx));
+   pthread_mutex_init(&ctx.lock, NULL);
+   ctx.plan = fmsynth_offline_new(fm, events, num_events);
+   free(events);
+
+   bool ret = false;
+   pthread_t *tids = NULL;
+   unsigned threads = 0;
+   if (!ctx.plan)
+   {
+      goto end;
+   }
+
+   uint64_t last_event = num_events ? midi->events[midi->num_events - 1].frame : 0;
+   ctx.max_frames = last_event + (uint64_t)(opts.max_tail * opts.sample_rate);
+
+   uint64_t length = 0;
+   for (size_t i = 0; i < fmsynth_offline_num_jobs(ctx.plan); i++)
+   {
+      uint64_t start, job_frames;
+      fmsynth_offline_job_info(ctx.plan, i, &start, &job_frames);
+      if (start + job_frames > length)
+      {
+         length = start + job_frames;
+      }
+   }
+   length = length < ctx.max_frames ? length : ctx.max_frames;
+
+   ctx.left = calloc(length + 1, sizeof(float));
+   ctx.right = calloc(length + 1, sizeof(float));
+   tids = calloc(opts.threads, sizeof(*tids));
+   if (!ctx.left || !ctx.right || !tids)
+   {
+      goto end;
+   }
+
+   for (threads = 0; threads + 1 < opts.threads; threads++)
+   {
+      if (pthread_create(&tids[threads], NULL, voice_worker, &ctx) != 0)
+      {
+         break;
+      }
+   }
+
+   voice_worker(&ctx);
+
+   for (unsigned i = 0; i < threads; i++)
+   {
+      pthread_join(tids[i], NULL);
+   }
+
+   if (ctx.failed)
+   {
+      goto end;
+   }
+
+   for (uint64_t frame = 0; frame < ctx.frames; frame += opts.block_size)
+   {
+      uint64_t to_write = ctx.frames - frame;
+      to_write = to_write > opts.block_size ? opts.block_size : to_write;
+      if (!write_frames(file, ctx.left + frame, ctx.right + frame, interleaved, to_write))
+      {
+         goto end;
+      }
+   }
+
+   *frames = ctx.frames;
+   ret = true;
+
+end:
+   fmsynth_offline_free((fmsynth_offline_t*)ctx.plan);
+   pthread_mutex_destroy(&ctx.lock);
+   free(ctx.left);
+   free(ctx.right);
+   free(tids);
+   return ret;
+}
+
+static bool render_job(const struct job *job, float *left, float *right, float *interleaved)
+{
+   struct midi_file midi;
+   if (!load_midi(&midi, job->input, opts.sample_rate))
+   {
+      return false;
+   }
+
+   bool ret = false;
+   FILE *file = NULL;
+   fmsynth_t *fm = fmsynth_new(opts.sample_rate, opts.max_voices);
+   if (!fm)
+   {
+      goto end;
+   }
+
+   fmsynth_set_multi_timbral(fm, true);
+   for (unsigned i = 0; i < opts.num_patches; i++)
+   {
+      fmsynth_set_program(fm, i, opts.patches[i]);
+   }
+
+   // Channels which never see a program change play the first patch.
+   for (unsigned c = 0; c < FMSYNTH_PARTS; c++)
+   {
+      uint8_t program_change[3] = { 0xc0 | c, 0, 0 };
+      fmsynth_parse_midi(fm, program_change);
+   }
+
+   file = fopen(job->output, "wb");
+   if (!file)
+   {
+      fprintf(stderr, "Failed to open %s for writing.\n", job->output);
+      goto end;
+   }
+
+   if (!opts.raw && !write_wav_header(file, opts.sample_rate, 0))
+   {
+      goto end;
+   }
+
+   uint64_t frame = 0;
+   bool ok = opts.voice_parallel ?
+      render_voices(fm, &midi, job, file, interleaved, &frame) :
+      render_stream(fm, &midi, job, file, left, right, interleaved, &frame);
+
+   if (!ok)
+   {
+      fprintf(stderr, "Failed to render %s.\n", job->output);
+      goto end;
+   }
+
+   if (!opts.raw)
+   {
+      fseek(file, 0, SEEK_SET);
+      if (!write_wav_header(file, opts.sample_rate, frame))
+      {
+         goto end;
+      }
+   }
+
+   fprintf(stderr, "Rendered %s (%.2f s).\n", job->output, frame / opts.sample_rate);
+   ret = true;
+
+end:
+   if (file)
+   {
+      fclose(file);
+   }
+   if (fm)
+   {
+      fmsynth_free(fm);
+   }
+   free(midi.events);
+   free(midi.tempos);
+   return ret;
+}
+
+static void *worker(void *data)
+{
+   (void)data;
+
+   float *left = malloc(opts.block_size * sizeof(float));
+   float *right = malloc(opts.block_size * sizeof(float));
+   float *interleaved = malloc(2 * opts.block_size * sizeof(float));
+
+   for (;;)
+   {
+      pthread_mutex_lock(&job_lock);
+      unsigned index = next_job++;
+      pthread_mutex_unlock(&job_lock);
+
+      if (index >= num_jobs)
+      {
+         break;
+      }
+
+      bool ok = left && right && interleaved &&
+         render_job(&jobs[index], left, right, interleaved);
+
+      if (!ok)
+      {
+         pthread_mutex_lock(&job_lock);
+         job_failed = true;
+         pthread_mutex_unlock(&job_lock);
+      }
+   }
+
+   free(left);
+   free(right);
+   free(interleaved);
+   return NULL;
+}
+
+static bool load_patches(const char *path)
+{
+   size_t size;
+   uint8_t *buffer = read_file(path, &size);
+
+   if (!buffer || fmsynth_preset_stored_size(buffer, size) == 0)
+   {
+      fprintf(stderr, "Failed to read preset %s.\n", path);
+      free(buffer);
+      return false;
+   }
+
+   // A bank is a concatenation of presets, which are assigned to consecutive programs.
+   // Presets saved with different numbers of operators have different sizes.
+   size_t preset_size;
+   for (size_t offset = 0; offset < size; offset += preset_size)
+   {
+      if (opts.num_patches >= MAX_PATCHES)
+      {
+         fprintf(stderr, "Too many presets, ignoring the rest of %s.\n", path);
+         break;
+      }
+
+      preset_size = fmsynth_preset_stored_size(buffer + offset, size - offset);
+      fmsynth_patch_t *patch = fmsynth_patch_new();
+      if (!patch || fmsynth_patch_load(patch, NULL, buffer + offset, size - offset) != FMSYNTH_STATUS_OK)
+      {
+         fprintf(stderr, "Invalid preset in %s.\n", path);
+         fmsynth_patch_free(patch);
+         free(buffer);
+         return false;
+      }
+
+      opts.patches[opts.num_patches++] = patch;
+   }
+
+   free(buffer);
+   return true;
+}
+
+static bool add_job(const char *input, int track, unsigned total_jobs)
+{
+   if (num_jobs >= MAX_JOBS)
+   {
+      fprintf(stderr, "Too many jobs.\n");
+      return false;
+   }
+
+   struct job *job = &jobs[num_jobs++];
+   job->input = input;
+   job->track = track;
+
+   if (opts.output && total_jobs == 1)
+   {
+      snprintf(job->output, sizeof(job->output), "%s", opts.output);
+      return true;
+   }
+
+   const char *ext = opts.raw ? "raw" : "wav";
+   const char *base = strrchr(input, '/');
+   base = base ? base + 1 : input;
+   const char *dot = strrchr(base, '.');
+   int base_len = dot ? (int)(dot - base) : (int)strlen(base);
+   const char *dir = opts.output ? opts.output : ".";
+
+   if (track >= 0)
+   {
+      snprintf(job->output, sizeof(job->output), "%s/%.*s_track%02d.%s",
+            dir, base_len, base, track, ext);
+   }
+   else
+   {
+      snprintf(job->output, sizeof(job->output), "%s/%.*s.%s",
+            dir, base_len, base, ext);
+   }
+   return true;
+}
+
+// Only tracks with channel messages are worth rendering separately.
+static unsigned track_mask(const char *path, uint64_t *mask)
+{
+   struct midi_file midi;
+   *mask = 0;
+   if (!load_midi(&midi, path, opts.sample_rate))
+   {
+      return 0;
+   }
+
+   for (size_t i = 0; i < midi.num_events; i++)
+   {
+      if (midi.events[i].track < 64 && (midi.events[i].data[0] & 0xf0) == 0x90)
+      {
+         *mask |= UINT64_C(1) << midi.events[i].track;
+      }
+   }
+
+   free(midi.events);
+   free(midi.tempos);
+
+   unsigned count = 0;
+   for (unsigned t = 0; t < 64; t++)
+   {
+      count += (*mask >> t) & 1;
+   }
+   return count;
+}
+
+static void print_help(const char *name)
+{
+   fprintf(stderr, "Usage: %s [options] input.mid...\n", name);
+   fprintf(stderr, "  -p <preset>  Preset or bank (concatenated presets). Can be repeated.\n");
+   fprintf(stderr, "               Presets are assigned to consecutive MIDI programs starting at 0.\n");
+   fprintf(stderr, "  -o <path>    Output file. With multiple outputs, output directory.\n");
+   fprintf(stderr, "  -r <rate>    Sample rate (default: 44100).\n");
+   fprintf(stderr, "  -v <voices>  Maximum polyphony (default: 256).\n");
+   fprintf(stderr, "  -b <frames>  Block size (default: 4096).\n");
+   fprintf(stderr, "  -l <seconds> Maximum release tail after last event (default: 30).\n");
+   fprintf(stderr, "  -j <threads> Render files or tracks in parallel (default: 1).\n");
+   fprintf(stderr, "  -t           Render every track to a separate file.\n");
+   fprintf(stderr, "  -V           Render notes in parallel instead of files or tracks.\n");
+   fprintf(stderr, "  -f           Write raw interleaved 32-bit float instead of WAV.\n");
+}
+
+int main(int argc, char *argv[])
+{
+   const char *inputs[MAX_JOBS];
+   unsigned num_inputs = 0;
+
+   for (int i = 1; i < argc; i++)
+   {
+      const char *arg = argv[i];
+      bool has_value = i + 1 < argc;
+
+      if (!strcmp(arg, "-p") && has_value)
+      {
+         if (!load_patches(argv[++i]))
+         {
+            return EXIT_FAILURE;
+         }
+      }
+      else if (!strcmp(arg, "-o") && has_value)
+      {
+         opts.output = argv[++i];
+      }
+      else if (!strcmp(arg, "-r") && has_value)
+      {
+         opts.sample_rate = strtof(argv[++i], NULL);
+      }
+      else if (!strcmp(arg, "-v") && has_value)
+      {
+         opts.max_voices = strtoul(argv[++i], NULL, 0);
+      }
+      else if (!strcmp(arg, "-b") && has_value)
+      {
+         opts.block_size = strtoul(argv[++i], NULL, 0);
+      }
+      else if (!strcmp(arg, "-l") && has_value)
+      {
+         opts.max_tail = strtof(argv[++i], NULL);
+      }
+      else if (!strcmp(arg, "-j") && has_value)
+      {
+         opts.threads = strtoul(argv[++i], NULL, 0);
+      }
+      else if (!strcmp(arg, "-t"))
+      {
+         opts.split_tracks = true;
+      }
+      else if (!strcmp(arg, "-V"))
+      {
+         opts.voice_parallel = true;
+      }
+      else if (!strcmp(arg, "-f"))
+      {
+         opts.raw = true;
+      }
+      else if (arg[0] == '-')
+      {
+         print_help(argv[0]);
+         return EXIT_FAILURE;
+      }
+      else if (num_inputs < MAX_JOBS)
+      {
+         inputs[num_inputs++] = arg;
+      }
+   }
+
+   if (num_inputs == 0 || opts.sample_rate <= 0.0f ||
+         opts.block_size == 0 || opts.threads == 0)
+   {
+      print_help(argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   unsigned total_jobs = 0;
+   uint64_t masks[MAX_JOBS];
+   for (unsigned i = 0; i < num_inputs; i++)
+   {
+      total_jobs += opts.split_tracks ? track_mask(inputs[i], &masks[i]) : 1;
+   }
+
+   for (unsigned i = 0; i < num_inputs; i++)
+   {
+      if (!opts.split_tracks)
+      {
+         if (!add_job(inputs[i], -1, total_jobs))
+         {
+            return EXIT_FAILURE;
+         }
+         continue;
+      }
+
+      for (unsigned t = 0; t < 64; t++)
+      {
+         if (((masks[i] >> t) & 1) && !add_job(inputs[i], t, total_jobs))
+         {
+            return EXIT_FAILURE;
+         }
+      }
+   }
+
+   if (num_jobs == 0)
+   {
+      fprintf(stderr, "Nothing to render.\n");
+      return EXIT_FAILURE;
+   }
+
+   // The main thread works on the queue as well.
+   // With voice parallel rendering, threads are used within each job instead.
+   // Never more threads than jobs, which also keeps this from wrapping around without jobs.
+   unsigned threads = opts.threads < num_jobs ? opts.threads : num_jobs;
+   threads = opts.voice_parallel || threads == 0 ? 0 : threads - 1;
+   pthread_t *tids = calloc(threads + 1, sizeof(*tids));
+   if (!tids)
+   {
+      return EXIT_FAILURE;
+   }
+
+   for (unsigned i = 0; i < threads; i++)
+   {
+      if (pthread_create(&tids[i], NULL, worker, NULL) != 0)
+      {
+         threads = i;
+         break;
+      }
+   }
+
+   worker(NULL);
+
+   for (unsigned i = 0; i < threads; i++)
+   {
+      pthread_join(tids[i], NULL);
+   }
+   free(tids);
+
+   for (unsigned i = 0; i < opts.num_patches; i++)
+   {
+      fmsynth_patch_free(opts.patches[i]);
+   }
+
+   return job_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
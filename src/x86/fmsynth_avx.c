@@ -18,76 +18,211 @@
 
 #include <immintrin.h>
 
-static void fmsynth_process_frames(fmsynth_t *fm,
-      struct fmsynth_voice *voice, float *oleft, float *oright, unsigned frames)
+// One frame of one voice, operators in blocks of 8.
+// Returns the left mix in lane 0 and the right mix in lane 2.
+static FMSYNTH_ALWAYS_INLINE __m128 fmsynth_step_avx(
+      const struct fmsynth_voice_parameters *params,
+      const struct fmsynth_voice *voice, const float *amp, __m256 *phases, __m256 *env,
+      unsigned operators, bool low_precision, enum fmsynth_mix mix)
 {
-   __m256 phases = _mm256_load_ps(voice->phases);
-   __m256 env = _mm256_load_ps(voice->env);
+   const unsigned blocks = operators / 8;
+   __m256 x[FMSYNTH_OPERATORS / 8];
+   __m256 xmod[FMSYNTH_OPERATORS / 8];
+   __m256 steps[FMSYNTH_OPERATORS / 8];
 
-   for (unsigned f = 0; f < frames; f++)
+   for (unsigned b = 0; b < blocks; b++)
    {
-      __m256 x = _mm256_sub_ps(phases, _mm256_set1_ps(0.25f));
-      __m256 cmp = _mm256_cmp_ps(phases, _mm256_set1_ps(0.5f), _CMP_LT_OS);
-      __m256 greater = _mm256_sub_ps(_mm256_set1_ps(0.75f), phases);
-      x = _mm256_or_ps(_mm256_and_ps(cmp, x), _mm256_andnot_ps(cmp, greater));
+      __m256 sub = _mm256_sub_ps(phases[b], _mm256_set1_ps(0.25f));
+      __m256 cmp = _mm256_cmp_ps(phases[b], _mm256_set1_ps(0.5f), _CMP_LT_OS);
+      __m256 greater = _mm256_sub_ps(_mm256_set1_ps(0.75f), phases[b]);
+      x[b] = _mm256_or_ps(_mm256_and_ps(cmp, sub), _mm256_andnot_ps(cmp, greater));
+   }
 
-      // Compute sine approximation.
-      {
-         __m256 x2 = _mm256_mul_ps(x, x);
-         __m256 x3 = _mm256_mul_ps(x, x2);
-         x = _mm256_mul_ps(x, _mm256_set1_ps(2.0f * PI));
+   // Compute sine approximation.
+   for (unsigned b = 0; b < blocks; b++)
+   {
+      __m256 x2 = _mm256_mul_ps(x[b], x[b]);
+      __m256 x3 = _mm256_mul_ps(x[b], x2);
+      x[b] = _mm256_mul_ps(x[b], _mm256_set1_ps(2.0f * PI));
 
-         x = _mm256_sub_ps(x, _mm256_mul_ps(x3, _mm256_set1_ps(INV_FACTORIAL_3_2PIPOW3)));
+      x[b] = _mm256_sub_ps(x[b], _mm256_mul_ps(x3, _mm256_set1_ps(INV_FACTORIAL_3_2PIPOW3)));
 
-         x3 = _mm256_mul_ps(x3, x2);
-         x = _mm256_add_ps(x, _mm256_mul_ps(x3, _mm256_set1_ps(INV_FACTORIAL_5_2PIPOW5)));
+      x3 = _mm256_mul_ps(x3, x2);
+      x[b] = _mm256_add_ps(x[b], _mm256_mul_ps(x3, _mm256_set1_ps(INV_FACTORIAL_5_2PIPOW5)));
 
+      if (!low_precision)
+      {
          x3 = _mm256_mul_ps(x3, x2);
-         x = _mm256_sub_ps(x, _mm256_mul_ps(x3, _mm256_set1_ps(INV_FACTORIAL_7_2PIPOW7)));
+         x[b] = _mm256_sub_ps(x[b], _mm256_mul_ps(x3, _mm256_set1_ps(INV_FACTORIAL_7_2PIPOW7)));
       }
+   }
 
-      x = _mm256_mul_ps(x, _mm256_mul_ps(env, _mm256_load_ps(voice->read_mod)));
+   for (unsigned b = 0; b < blocks; b++)
+   {
+      x[b] = _mm256_mul_ps(x[b], _mm256_mul_ps(env[b], _mm256_load_ps(voice->read_mod + 8 * b)));
 
-      env = _mm256_add_ps(env, _mm256_load_ps(voice->target_env_step));
+      env[b] = _mm256_add_ps(env[b], _mm256_load_ps(voice->target_env_step + 8 * b));
 
-      __m256 step_rate = _mm256_load_ps(voice->step_rate);
-      __m256 xmod = _mm256_mul_ps(x, step_rate);
-      __m256 steps = _mm256_mul_ps(step_rate, _mm256_load_ps(voice->lfo_freq_mod));
+      __m256 step_rate = _mm256_load_ps(voice->step_rate + 8 * b);
+      xmod[b] = _mm256_mul_ps(x[b], step_rate);
+      steps[b] = _mm256_mul_ps(step_rate, _mm256_load_ps(voice->lfo_freq_mod + 8 * b));
+   }
 
-      __m256 perm, lo, hi;
-#define MAT_ACCUMULATE(scalar, index) \
-      perm = _mm256_permute_ps(scalar, _MM_SHUFFLE(index, index, index, index)); \
-      lo = _mm256_permute2f128_ps(perm, perm, 0); \
-      hi = _mm256_permute2f128_ps(perm, perm, 17); \
-      phases = _mm256_add_ps(phases, \
-            _mm256_mul_ps(_mm256_load_ps(fm->params.mod_to_carriers[index + 0]), lo)); \
-      steps = _mm256_add_ps(steps, \
-            _mm256_mul_ps(_mm256_load_ps(fm->params.mod_to_carriers[index + 4]), hi)); \
+   // The low half of each block of modulators accumulates to phases and the high half to steps.
+   __m256 perm, lo, hi;
+#define MAT_ACCUMULATE(scalar, base, index) \
+   perm = _mm256_permute_ps(scalar, _MM_SHUFFLE(index, index, index, index)); \
+   lo = _mm256_permute2f128_ps(perm, perm, 0); \
+   hi = _mm256_permute2f128_ps(perm, perm, 17); \
+   for (unsigned o = 0; o < blocks; o++) \
+   { \
+      phases[o] = _mm256_add_ps(phases[o], \
+            _mm256_mul_ps(_mm256_load_ps(params->mod_to_carriers[base + index + 0] + 8 * o), lo)); \
+      steps[o] = _mm256_add_ps(steps[o], \
+            _mm256_mul_ps(_mm256_load_ps(params->mod_to_carriers[base + index + 4] + 8 * o), hi)); \
+   }
 
-      MAT_ACCUMULATE(xmod, 0);
-      MAT_ACCUMULATE(xmod, 1);
-      MAT_ACCUMULATE(xmod, 2);
-      MAT_ACCUMULATE(xmod, 3);
+   for (unsigned b = 0; b < blocks; b++)
+   {
+      MAT_ACCUMULATE(xmod[b], 8 * b, 0);
+      MAT_ACCUMULATE(xmod[b], 8 * b, 1);
+      MAT_ACCUMULATE(xmod[b], 8 * b, 2);
+      MAT_ACCUMULATE(xmod[b], 8 * b, 3);
+   }
 #undef MAT_ACCUMULATE
 
-      __m256 sleft  = _mm256_mul_ps(x, _mm256_load_ps(voice->pan_amp[0]));
-      __m256 sright = _mm256_mul_ps(x, _mm256_load_ps(voice->pan_amp[1]));
+   // Centered and mono voices only need one mix.
+   __m256 sleft = _mm256_mul_ps(x[0], _mm256_load_ps(amp));
+   __m256 sright = sleft;
+   if (mix == FMSYNTH_MIX_STEREO)
+   {
+      sright = _mm256_mul_ps(x[0], _mm256_load_ps(voice->pan_amp[1]));
+   }
+
+   for (unsigned b = 0; b < blocks; b++)
+   {
+      phases[b] = _mm256_add_ps(phases[b], steps[b]);
+      phases[b] = _mm256_sub_ps(phases[b], _mm256_floor_ps(phases[b]));
+   }
+
+   for (unsigned b = 1; b < blocks; b++)
+   {
+      sleft = _mm256_add_ps(sleft, _mm256_mul_ps(x[b], _mm256_load_ps(amp + 8 * b)));
+      if (mix == FMSYNTH_MIX_STEREO)
+      {
+         sright = _mm256_add_ps(sright, _mm256_mul_ps(x[b], _mm256_load_ps(voice->pan_amp[1] + 8 * b)));
+      }
+   }
+
+   __m128 left = _mm_add_ps(_mm256_extractf128_ps(sleft, 0), _mm256_extractf128_ps(sleft, 1));
+   __m128 right = left;
+   if (mix == FMSYNTH_MIX_STEREO)
+   {
+      right = _mm_add_ps(_mm256_extractf128_ps(sright, 0), _mm256_extractf128_ps(sright, 1));
+   }
+
+   __m128 out = _mm_add_ps(_mm_shuffle_ps(left, right,
+            _MM_SHUFFLE(1, 0, 1, 0)),
+         _mm_shuffle_ps(left, right, _MM_SHUFFLE(3, 2, 3, 2)));
+   out = _mm_add_ps(_mm_permute_ps(out, _MM_SHUFFLE(3, 3, 1, 1)), out);
+   return out;
+}
+
+static FMSYNTH_ALWAYS_INLINE void fmsynth_load_state_avx(const struct fmsynth_voice *voice,
+      __m256 *phases, __m256 *env, unsigned operators)
+{
+   for (unsigned b = 0; b < operators / 8; b++)
+   {
+      phases[b] = _mm256_load_ps(voice->phases + 8 * b);
+      env[b] = _mm256_load_ps(voice->env + 8 * b);
+   }
+}
+
+static FMSYNTH_ALWAYS_INLINE void fmsynth_store_state_avx(struct fmsynth_voice *voice,
+      const __m256 *phases, const __m256 *env, unsigned operators)
+{
+   for (unsigned b = 0; b < operators / 8; b++)
+   {
+      _mm256_store_ps(voice->phases + 8 * b, phases[b]);
+      _mm256_store_ps(voice->env + 8 * b, env[b]);
+   }
+}
 
-      phases = _mm256_add_ps(phases, steps);
-      phases = _mm256_sub_ps(phases, _mm256_floor_ps(phases));
+static FMSYNTH_ALWAYS_INLINE void fmsynth_process_frames_avx(
+      const struct fmsynth_voice_parameters *params,
+      struct fmsynth_voice *voice, float *oleft, float *oright, unsigned frames,
+      unsigned operators, bool low_precision, enum fmsynth_mix mix)
+{
+   // 4 and 12 operators do not fill 256-bit vectors.
+   if (operators % 8)
+   {
+      fmsynth_process_frames_sse(params, voice, oleft, oright, frames,
+            operators, low_precision, mix);
+      return;
+   }
 
-      __m128 left = _mm_add_ps(_mm256_extractf128_ps(sleft, 0), _mm256_extractf128_ps(sleft, 1));
-      __m128 right = _mm_add_ps(_mm256_extractf128_ps(sright, 0), _mm256_extractf128_ps(sright, 1));
+   __m256 phases[FMSYNTH_OPERATORS / 8];
+   __m256 env[FMSYNTH_OPERATORS / 8];
+   FMSYNTH_ALIGNED_CACHE_PRE float mono_amp[FMSYNTH_OPERATORS] FMSYNTH_ALIGNED_CACHE_POST;
+   const float *amp = fmsynth_voice_mix_amp(voice, mono_amp, operators, mix);
+   fmsynth_load_state_avx(voice, phases, env, operators);
 
-      __m128 out = _mm_add_ps(_mm_shuffle_ps(left, right,
-               _MM_SHUFFLE(1, 0, 1, 0)),
-            _mm_shuffle_ps(left, right, _MM_SHUFFLE(3, 2, 3, 2)));
-      out = _mm_add_ps(_mm_permute_ps(out, _MM_SHUFFLE(3, 3, 1, 1)), out);
+   for (unsigned f = 0; f < frames; f++)
+   {
+      __m128 out = fmsynth_step_avx(params, voice, amp, phases, env, operators, low_precision, mix);
       _mm_store_ss(oleft + f, _mm_add_ss(out, _mm_load_ss(oleft + f)));
-      _mm_store_ss(oright + f, _mm_add_ss(_mm_movehl_ps(out, out), _mm_load_ss(oright + f)));
+      if (mix != FMSYNTH_MIX_MONO)
+      {
+         _mm_store_ss(oright + f, _mm_add_ss(_mm_movehl_ps(out, out), _mm_load_ss(oright + f)));
+      }
+   }
+
+   fmsynth_store_state_avx(voice, phases, env, operators);
+}
+
+// Two independent voices in one loop, so each hides the latency of the other's
+// oscillator, modulation and phase update chain.
+// Voice a is mixed before voice b, exactly like rendering them one after another.
+static FMSYNTH_ALWAYS_INLINE void fmsynth_process_frames_pair_avx(
+      const struct fmsynth_voice_parameters *params_a, struct fmsynth_voice *voice_a,
+      const struct fmsynth_voice_parameters *params_b, struct fmsynth_voice *voice_b,
+      float *oleft, float *oright, unsigned frames,
+      unsigned operators, bool low_precision, enum fmsynth_mix mix)
+{
+   if (operators % 8)
+   {
+      fmsynth_process_frames_pair_sse(params_a, voice_a, params_b, voice_b,
+            oleft, oright, frames, operators, low_precision, mix);
+      return;
+   }
+
+   __m256 phases_a[FMSYNTH_OPERATORS / 8];
+   __m256 env_a[FMSYNTH_OPERATORS / 8];
+   __m256 phases_b[FMSYNTH_OPERATORS / 8];
+   __m256 env_b[FMSYNTH_OPERATORS / 8];
+   FMSYNTH_ALIGNED_CACHE_PRE float mono_amp_a[FMSYNTH_OPERATORS] FMSYNTH_ALIGNED_CACHE_POST;
+   FMSYNTH_ALIGNED_CACHE_PRE float mono_amp_b[FMSYNTH_OPERATORS] FMSYNTH_ALIGNED_CACHE_POST;
+   const float *amp_a = fmsynth_voice_mix_amp(voice_a, mono_amp_a, operators, mix);
+   const float *amp_b = fmsynth_voice_mix_amp(voice_b, mono_amp_b, operators, mix);
+   fmsynth_load_state_avx(voice_a, phases_a, env_a, operators);
+   fmsynth_load_state_avx(voice_b, phases_b, env_b, operators);
+
+   for (unsigned f = 0; f < frames; f++)
+   {
+      __m128 out_a = fmsynth_step_avx(params_a, voice_a, amp_a, phases_a, env_a, operators, low_precision, mix);
+      __m128 out_b = fmsynth_step_avx(params_b, voice_b, amp_b, phases_b, env_b, operators, low_precision, mix);
+
+      _mm_store_ss(oleft + f, _mm_add_ss(_mm_add_ss(_mm_load_ss(oleft + f), out_a), out_b));
+      if (mix != FMSYNTH_MIX_MONO)
+      {
+         _mm_store_ss(oright + f, _mm_add_ss(_mm_add_ss(_mm_load_ss(oright + f),
+                     _mm_movehl_ps(out_a, out_a)), _mm_movehl_ps(out_b, out_b)));
+      }
    }
 
-   _mm256_store_ps(voice->phases, phases);
-   _mm256_store_ps(voice->env, env);
+   fmsynth_store_state_avx(voice_a, phases_a, env_a, operators);
+   fmsynth_store_state_avx(voice_b, phases_b, env_b, operators);
 }
 
+FMSYNTH_KERNEL_VARIANTS(fmsynth_process_frames_avx, fmsynth_process_frames_simd)
+FMSYNTH_PAIR_KERNEL_VARIANTS(fmsynth_process_frames_pair_avx, fmsynth_process_frames_simd)
@@ -0,0 +1,721 @@
+/* Copyright (C) 2014 Hans-Kristian Arntzen <maister@archlinux.us>
+ *
+ * Permission is hereby granted, free of charge,
+ * to any person obtaining a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// x86-64 System V code generator for patch specialized kernels, using AVX2 and FMA.
+// The audio-rate loop is bound by the latency of the chain from one frame's phases to the next,
+// so the generated code is laid out to keep that chain short:
+//  - The sine polynomial is evaluated in Estrin form.
+//  - Envelope, LFO and step rate gains are folded into one multiplier off the chain.
+//  - The modulation matrix is applied along its diagonals, each a lane rotation of the modulator
+//    outputs times a constant vector, so a typical sparse patch needs one or two FMAs instead of
+//    eight broadcasts. All-zero diagonals are dropped.
+//  - Operators which are disabled, or neither carriers nor modulators, are skipped,
+//    and if only one half of the operator vector is left, the kernel runs at 128-bit width.
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define FMSYNTH_JIT_SLOTS 16
+#define FMSYNTH_JIT_SLOT_SIZE 4096
+
+// A patch has to be used for this many note-ons before it is compiled,
+// so parameter sweeps do not churn through the cache.
+#define FMSYNTH_JIT_SETTLE 2
+// Patches which are counted towards settling at the same time, so alternating patches still compile.
+#define FMSYNTH_JIT_PENDING 8
+
+// Constant pool at the start of every slot, one 256-bit vector per constant.
+#define FMSYNTH_JIT_POOL_QUARTER 0
+#define FMSYNTH_JIT_POOL_HALF 32
+#define FMSYNTH_JIT_POOL_THREE_QUARTERS 64
+#define FMSYNTH_JIT_POOL_TWO_PI 96
+#define FMSYNTH_JIT_POOL_C3 128
+#define FMSYNTH_JIT_POOL_C5 160
+#define FMSYNTH_JIT_POOL_C7 192
+#define FMSYNTH_JIT_POOL_ROTATE 224
+#define FMSYNTH_JIT_POOL_DIAGONAL (FMSYNTH_JIT_POOL_ROTATE + FMSYNTH_OPERATORS * 32)
+#define FMSYNTH_JIT_POOL_SIZE (FMSYNTH_JIT_POOL_DIAGONAL + FMSYNTH_OPERATORS * 32)
+
+// General purpose registers.
+#define FMSYNTH_JIT_RAX 0
+#define FMSYNTH_JIT_RCX 1
+#define FMSYNTH_JIT_RDX 2
+#define FMSYNTH_JIT_RSI 6
+#define FMSYNTH_JIT_R8 8
+#define FMSYNTH_JIT_R9 9
+
+// Vector registers. Temporaries are shared between the two voices of a pair.
+#define FMSYNTH_JIT_X 0
+#define FMSYNTH_JIT_A 1
+#define FMSYNTH_JIT_B 2
+#define FMSYNTH_JIT_C 3
+#define FMSYNTH_JIT_STEPS 4
+#define FMSYNTH_JIT_XMOD 5
+#define FMSYNTH_JIT_T 6
+#define FMSYNTH_JIT_U 7
+#define FMSYNTH_JIT_PHASES_A 8
+#define FMSYNTH_JIT_PHASES_B 9
+#define FMSYNTH_JIT_ENV_A 10
+#define FMSYNTH_JIT_ENV_B 11
+#define FMSYNTH_JIT_GAIN 12
+#define FMSYNTH_JIT_POLY 13
+#define FMSYNTH_JIT_X4 14
+#define FMSYNTH_JIT_INDEX 15
+
+// VEX opcodes. map: 1 = 0F, 2 = 0F38, 3 = 0F3A. pp: 0 = none, 1 = 66, 2 = F3.
+#define FMSYNTH_JIT_OP(map, pp, op) (((map) << 12) | ((pp) << 8) | (op))
+#define FMSYNTH_JIT_VMOVSS_STORE FMSYNTH_JIT_OP(1, 2, 0x11)
+#define FMSYNTH_JIT_VADDSS FMSYNTH_JIT_OP(1, 2, 0x58)
+#define FMSYNTH_JIT_VMOVHLPS FMSYNTH_JIT_OP(1, 0, 0x12)
+#define FMSYNTH_JIT_VMOVAPS_LOAD FMSYNTH_JIT_OP(1, 0, 0x28)
+#define FMSYNTH_JIT_VMOVAPS_STORE FMSYNTH_JIT_OP(1, 0, 0x29)
+#define FMSYNTH_JIT_VADDPS FMSYNTH_JIT_OP(1, 0, 0x58)
+#define FMSYNTH_JIT_VMULPS FMSYNTH_JIT_OP(1, 0, 0x59)
+#define FMSYNTH_JIT_VSUBPS FMSYNTH_JIT_OP(1, 0, 0x5c)
+#define FMSYNTH_JIT_VCMPPS FMSYNTH_JIT_OP(1, 0, 0xc2)
+#define FMSYNTH_JIT_VSHUFPS FMSYNTH_JIT_OP(1, 0, 0xc6)
+#define FMSYNTH_JIT_VPERMPS FMSYNTH_JIT_OP(2, 1, 0x16)
+#define FMSYNTH_JIT_VFMADD231PS FMSYNTH_JIT_OP(2, 1, 0xb8)
+#define FMSYNTH_JIT_VFNMADD231PS FMSYNTH_JIT_OP(2, 1, 0xbc)
+#define FMSYNTH_JIT_VPERMILPS FMSYNTH_JIT_OP(3, 1, 0x04)
+#define FMSYNTH_JIT_VROUNDPS FMSYNTH_JIT_OP(3, 1, 0x08)
+#define FMSYNTH_JIT_VEXTRACTF128 FMSYNTH_JIT_OP(3, 1, 0x19)
+#define FMSYNTH_JIT_VBLENDVPS FMSYNTH_JIT_OP(3, 1, 0x4a)
+
+// Everything which is baked into generated code.
+// Built with memset() first so that keys compare with memcmp().
+struct fmsynth_jit_key
+{
+   float mod_to_carriers[FMSYNTH_OPERATORS][FMSYNTH_OPERATORS];
+   uint8_t enable;
+   uint8_t carriers;
+   uint8_t centered;
+   uint8_t reserved;
+};
+
+struct fmsynth_jit_slot
+{
+   struct fmsynth_jit_key key;
+   uint32_t hash;
+   // Bumped when the slot is recompiled, so voices bound to old code fall back.
+   uint32_t generation;
+   uint64_t last_used;
+   bool valid;
+
+   fmsynth_process_frames_t process_frames;
+   fmsynth_process_pair_t process_pair;
+};
+
+struct fmsynth_jit_pending
+{
+   uint32_t hash;
+   unsigned count;
+   uint64_t last_used;
+};
+
+struct fmsynth_jit
+{
+   struct fmsynth_jit_slot slots[FMSYNTH_JIT_SLOTS];
+   uint8_t *code;
+   size_t size;
+   uint64_t clock;
+
+   struct fmsynth_jit_pending pending[FMSYNTH_JIT_PENDING];
+};
+
+// Which parts of the generic kernel a patch actually needs.
+struct fmsynth_jit_plan
+{
+   bool live[2];
+   // Both halves are live, so vectors are 256-bit.
+   bool wide;
+   // Byte offset of the live half in 128-bit mode.
+   size_t half;
+   unsigned lanes;
+
+   // diagonal[k][j] is the coefficient from operator (j + k) % lanes to operator j, within the live lanes.
+   float diagonal[FMSYNTH_OPERATORS][FMSYNTH_OPERATORS];
+   bool diagonals[FMSYNTH_OPERATORS];
+
+   bool carriers;
+   bool centered;
+};
+
+struct fmsynth_jit_emitter
+{
+   uint8_t *code;
+   size_t size;
+   size_t pos;
+   bool overflow;
+};
+
+static void fmsynth_jit_byte(struct fmsynth_jit_emitter *e, unsigned byte)
+{
+   if (e->pos < e->size)
+   {
+      e->code[e->pos++] = (uint8_t)byte;
+   }
+   else
+   {
+      e->overflow = true;
+   }
+}
+
+static void fmsynth_jit_u32(struct fmsynth_jit_emitter *e, uint32_t value)
+{
+   for (unsigned i = 0; i < 4; i++)
+   {
+      fmsynth_jit_byte(e, (value >> (8 * i)) & 0xff);
+   }
+}
+
+static void fmsynth_jit_patch_rel32(struct fmsynth_jit_emitter *e, size_t at, size_t target)
+{
+   uint32_t rel = (uint32_t)(target - (at + 4));
+   if (at + 4 <= e->size)
+   {
+      for (unsigned i = 0; i < 4; i++)
+      {
+         e->code[at + i] = (rel >> (8 * i)) & 0xff;
+      }
+   }
+}
+
+// Three byte VEX prefix and opcode. Unused vvvv operands are passed as register 0.
+static void fmsynth_jit_vex(struct fmsynth_jit_emitter *e, unsigned op, bool wide,
+      unsigned reg, unsigned vvvv, unsigned rm)
+{
+   fmsynth_jit_byte(e, 0xc4);
+   fmsynth_jit_byte(e, (((~reg >> 3) & 1) << 7) | (1 << 6) | (((~rm >> 3) & 1) << 5) | (op >> 12));
+   fmsynth_jit_byte(e, ((~vvvv & 15) << 3) | (wide << 2) | ((op >> 8) & 3));
+   fmsynth_jit_byte(e, op & 0xff);
+}
+
+// op reg, vvvv, rm
+static void fmsynth_jit_vrr(struct fmsynth_jit_emitter *e, unsigned op, bool wide,
+      unsigned reg, unsigned vvvv, unsigned rm)
+{
+   fmsynth_jit_vex(e, op, wide, reg, vvvv, rm);
+   fmsynth_jit_byte(e, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op reg, vvvv, [base + disp32]. The base must not be RSP or R12.
+static void fmsynth_jit_vrm(struct fmsynth_jit_emitter *e, unsigned op, bool wide,
+      unsigned reg, unsigned vvvv, unsigned base, size_t disp)
+{
+   fmsynth_jit_vex(e, op, wide, reg, vvvv, base);
+   fmsynth_jit_byte(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+   fmsynth_jit_u32(e, (uint32_t)disp);
+}
+
+// op reg, vvvv, [rip + constant], where the constant lives in the pool of the current slot.
+static void fmsynth_jit_vrp(struct fmsynth_jit_emitter *e, unsigned op, bool wide,
+      unsigned reg, unsigned vvvv, size_t constant, unsigned imm_bytes)
+{
+   fmsynth_jit_vex(e, op, wide, reg, vvvv, 0);
+   fmsynth_jit_byte(e, 0x05 | ((reg & 7) << 3));
+   fmsynth_jit_u32(e, (uint32_t)(constant - (e->pos + 4 + imm_bytes)));
+}
+
+static void fmsynth_jit_pool_splat(uint8_t *code, size_t offset, float value)
+{
+   for (unsigned i = 0; i < 8; i++)
+   {
+      memcpy(code + offset + i * sizeof(float), &value, sizeof(float));
+   }
+}
+
+static void fmsynth_jit_make_key(const struct fmsynth_voice *voice,
+      const struct fmsynth_voice_control *ctrl, struct fmsynth_jit_key *key)
+{
+   memset(key, 0, sizeof(*key));
+   memcpy(key->mod_to_carriers, ctrl->params->mod_to_carriers, sizeof(key->mod_to_carriers));
+   key->enable = ctrl->enable;
+   key->centered = ctrl->centered;
+   for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+   {
+      if (voice->pan_amp[0][o] != 0.0f || voice->pan_amp[1][o] != 0.0f)
+      {
+         key->carriers |= 1 << o;
+      }
+   }
+}
+
+// FNV-1a
+static uint32_t fmsynth_jit_hash(const struct fmsynth_jit_key *key)
+{
+   const uint8_t *data = (const uint8_t*)key;
+   uint32_t hash = 2166136261u;
+   for (size_t i = 0; i < sizeof(*key); i++)
+   {
+      hash ^= data[i];
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+// Disabled operators always output zero.
+// Enabled operators which neither reach the output nor modulate anything are inaudible.
+static void fmsynth_jit_make_plan(const struct fmsynth_jit_key *key, struct fmsynth_jit_plan *plan)
+{
+   bool live[FMSYNTH_OPERATORS];
+   memset(plan, 0, sizeof(*plan));
+   plan->centered = key->centered;
+
+   for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+   {
+      bool modulates = false;
+      for (unsigned t = 0; t < FMSYNTH_OPERATORS; t++)
+      {
+         modulates |= key->mod_to_carriers[o][t] != 0.0f;
+      }
+
+      bool carrier = (key->carriers >> o) & 1;
+      live[o] = ((key->enable >> o) & 1) && (carrier || modulates);
+      plan->live[o / 4] |= live[o];
+      plan->carriers |= live[o] && carrier;
+   }
+
+   plan->wide = plan->live[0] && plan->live[1];
+   plan->half = plan->live[0] ? 0 : 4 * sizeof(float);
+   plan->lanes = plan->wide ? 8 : 4;
+
+   // Dead modulators output zero, so their coefficients are dropped.
+   unsigned first = plan->half / sizeof(float);
+   for (unsigned k = 0; k < plan->lanes; k++)
+   {
+      for (unsigned j = 0; j < plan->lanes; j++)
+      {
+         unsigned i = first + (j + k) % plan->lanes;
+         float coeff = live[i] ? key->mod_to_carriers[i][first + j] : 0.0f;
+         plan->diagonal[k][j] = coeff;
+         plan->diagonals[k] |= coeff != 0.0f;
+      }
+   }
+}
+
+// One frame of one voice, with phases and envelopes held in registers.
+static void fmsynth_jit_emit_step(struct fmsynth_jit_emitter *e, const struct fmsynth_jit_plan *plan,
+      unsigned voice, unsigned phases, unsigned env, unsigned left, unsigned right)
+{
+   bool wide = plan->wide;
+   size_t half = plan->half;
+
+   // x = phases < 0.5 ? phases - 0.25 : 0.75 - phases
+   fmsynth_jit_vrp(e, FMSYNTH_JIT_VCMPPS, wide, FMSYNTH_JIT_A, phases, FMSYNTH_JIT_POOL_HALF, 1);
+   fmsynth_jit_byte(e, 1);
+   fmsynth_jit_vrp(e, FMSYNTH_JIT_VSUBPS, wide, FMSYNTH_JIT_X, phases, FMSYNTH_JIT_POOL_QUARTER, 0);
+   fmsynth_jit_vrp(e, FMSYNTH_JIT_VMOVAPS_LOAD, wide, FMSYNTH_JIT_B, 0, FMSYNTH_JIT_POOL_THREE_QUARTERS, 0);
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VSUBPS, wide, FMSYNTH_JIT_B, FMSYNTH_JIT_B, phases);
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VBLENDVPS, wide, FMSYNTH_JIT_X, FMSYNTH_JIT_B, FMSYNTH_JIT_X);
+   fmsynth_jit_byte(e, FMSYNTH_JIT_A << 4);
+
+   // Off the chain: amp = env * read_mod, gain = amp * step_rate,
+   // steps = phases + step_rate * lfo_freq_mod, env += target_env_step.
+   fmsynth_jit_vrm(e, FMSYNTH_JIT_VMULPS, wide, FMSYNTH_JIT_A, env, voice,
+         offsetof(struct fmsynth_voice, read_mod) + half);
+   fmsynth_jit_vrm(e, FMSYNTH_JIT_VADDPS, wide, env, env, voice,
+         offsetof(struct fmsynth_voice, target_env_step) + half);
+   fmsynth_jit_vrm(e, FMSYNTH_JIT_VMOVAPS_LOAD, wide, FMSYNTH_JIT_XMOD, 0, voice,
+         offsetof(struct fmsynth_voice, step_rate) + half);
+   fmsynth_jit_vrm(e, FMSYNTH_JIT_VMULPS, wide, FMSYNTH_JIT_STEPS, FMSYNTH_JIT_XMOD, voice,
+         offsetof(struct fmsynth_voice, lfo_freq_mod) + half);
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VADDPS, wide, FMSYNTH_JIT_STEPS, FMSYNTH_JIT_STEPS, phases);
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VMULPS, wide, FMSYNTH_JIT_GAIN, FMSYNTH_JIT_A, FMSYNTH_JIT_XMOD);
+
+   // sin(2 pi x) ~= x * ((2pi - c3 x^2) + x^4 (c5 - c7 x^2))
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VMULPS, wide, FMSYNTH_JIT_B, FMSYNTH_JIT_X, FMSYNTH_JIT_X);
+   fmsynth_jit_vrp(e, FMSYNTH_JIT_VMOVAPS_LOAD, wide, FMSYNTH_JIT_C, 0, FMSYNTH_JIT_POOL_C5, 0);
+   fmsynth_jit_vrp(e, FMSYNTH_JIT_VMOVAPS_LOAD, wide, FMSYNTH_JIT_POLY, 0, FMSYNTH_JIT_POOL_TWO_PI, 0);
+   fmsynth_jit_vrp(e, FMSYNTH_JIT_VFNMADD231PS, wide, FMSYNTH_JIT_C, FMSYNTH_JIT_B, FMSYNTH_JIT_POOL_C7, 0);
+   fmsynth_jit_vrp(e, FMSYNTH_JIT_VFNMADD231PS, wide, FMSYNTH_JIT_POLY, FMSYNTH_JIT_B, FMSYNTH_JIT_POOL_C3, 0);
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VMULPS, wide, FMSYNTH_JIT_X4, FMSYNTH_JIT_B, FMSYNTH_JIT_B);
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VFMADD231PS, wide, FMSYNTH_JIT_POLY, FMSYNTH_JIT_X4, FMSYNTH_JIT_C);
+
+   // xmod = (x * gain) * poly, x = (x * amp) * poly
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VMULPS, wide, FMSYNTH_JIT_XMOD, FMSYNTH_JIT_X, FMSYNTH_JIT_GAIN);
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VMULPS, wide, FMSYNTH_JIT_XMOD, FMSYNTH_JIT_XMOD, FMSYNTH_JIT_POLY);
+   if (plan->carriers)
+   {
+      fmsynth_jit_vrr(e, FMSYNTH_JIT_VMULPS, wide, FMSYNTH_JIT_X, FMSYNTH_JIT_X, FMSYNTH_JIT_A);
+      fmsynth_jit_vrr(e, FMSYNTH_JIT_VMULPS, wide, FMSYNTH_JIT_X, FMSYNTH_JIT_X, FMSYNTH_JIT_POLY);
+   }
+
+   // steps += diagonal[k] * rotate(xmod, k), alternating between two accumulators.
+   unsigned terms = 0;
+   for (unsigned k = 0; k < plan->lanes; k++)
+   {
+      if (!plan->diagonals[k])
+      {
+         continue;
+      }
+
+      unsigned rotated = FMSYNTH_JIT_XMOD;
+      if (k && wide)
+      {
+         rotated = (terms & 1) ? FMSYNTH_JIT_U : FMSYNTH_JIT_T;
+         fmsynth_jit_vrp(e, FMSYNTH_JIT_VMOVAPS_LOAD, true, FMSYNTH_JIT_INDEX, 0,
+               FMSYNTH_JIT_POOL_ROTATE + 32 * k, 0);
+         fmsynth_jit_vrr(e, FMSYNTH_JIT_VPERMPS, true, rotated, FMSYNTH_JIT_INDEX, FMSYNTH_JIT_XMOD);
+      }
+      else if (k)
+      {
+         unsigned imm = 0;
+         for (unsigned j = 0; j < 4; j++)
+         {
+            imm |= ((j + k) & 3) << (2 * j);
+         }
+         rotated = (terms & 1) ? FMSYNTH_JIT_U : FMSYNTH_JIT_T;
+         fmsynth_jit_vrr(e, FMSYNTH_JIT_VPERMILPS, false, rotated, 0, FMSYNTH_JIT_XMOD);
+         fmsynth_jit_byte(e, imm);
+      }
+
+      size_t diagonal = FMSYNTH_JIT_POOL_DIAGONAL + 32 * k;
+      if (terms == 1)
+      {
+         fmsynth_jit_vrp(e, FMSYNTH_JIT_VMULPS, wide, FMSYNTH_JIT_B, rotated, diagonal, 0);
+      }
+      else
+      {
+         fmsynth_jit_vrp(e, FMSYNTH_JIT_VFMADD231PS, wide,
+               (terms & 1) ? FMSYNTH_JIT_B : FMSYNTH_JIT_STEPS, rotated, diagonal, 0);
+      }
+      terms++;
+   }
+
+   // phases = fract(steps)
+   if (terms > 1)
+   {
+      fmsynth_jit_vrr(e, FMSYNTH_JIT_VADDPS, wide, FMSYNTH_JIT_STEPS, FMSYNTH_JIT_STEPS, FMSYNTH_JIT_B);
+   }
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VROUNDPS, wide, FMSYNTH_JIT_C, 0, FMSYNTH_JIT_STEPS);
+   fmsynth_jit_byte(e, 0x09);
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VSUBPS, wide, phases, FMSYNTH_JIT_STEPS, FMSYNTH_JIT_C);
+
+   unsigned sleft = FMSYNTH_JIT_A;
+   unsigned sright = plan->centered ? FMSYNTH_JIT_A : FMSYNTH_JIT_B;
+   if (plan->carriers)
+   {
+      fmsynth_jit_vrm(e, FMSYNTH_JIT_VMULPS, wide, sleft, FMSYNTH_JIT_X, voice,
+            offsetof(struct fmsynth_voice, pan_amp) + half);
+      if (!plan->centered)
+      {
+         fmsynth_jit_vrm(e, FMSYNTH_JIT_VMULPS, wide, sright, FMSYNTH_JIT_X, voice,
+               offsetof(struct fmsynth_voice, pan_amp) + FMSYNTH_OPERATORS * sizeof(float) + half);
+      }
+   }
+
+   if (!plan->carriers)
+   {
+      return;
+   }
+
+   // Fold to 128 bits. VEXTRACTF128 encodes the source in reg and the destination in rm.
+   if (wide)
+   {
+      fmsynth_jit_vrr(e, FMSYNTH_JIT_VEXTRACTF128, true, sleft, 0, FMSYNTH_JIT_T);
+      fmsynth_jit_byte(e, 1);
+      fmsynth_jit_vrr(e, FMSYNTH_JIT_VADDPS, false, sleft, sleft, FMSYNTH_JIT_T);
+      if (!plan->centered)
+      {
+         fmsynth_jit_vrr(e, FMSYNTH_JIT_VEXTRACTF128, true, sright, 0, FMSYNTH_JIT_U);
+         fmsynth_jit_byte(e, 1);
+         fmsynth_jit_vrr(e, FMSYNTH_JIT_VADDPS, false, sright, sright, FMSYNTH_JIT_U);
+      }
+   }
+
+   // Horizontal sums, left in lane 0 and right in lane 2.
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VSHUFPS, false, FMSYNTH_JIT_C, sleft, sright);
+   fmsynth_jit_byte(e, 0x44);
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VSHUFPS, false, FMSYNTH_JIT_T, sleft, sright);
+   fmsynth_jit_byte(e, 0xee);
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VADDPS, false, FMSYNTH_JIT_C, FMSYNTH_JIT_C, FMSYNTH_JIT_T);
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VPERMILPS, false, FMSYNTH_JIT_T, 0, FMSYNTH_JIT_C);
+   fmsynth_jit_byte(e, 0xf5);
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VADDPS, false, FMSYNTH_JIT_C, FMSYNTH_JIT_T, FMSYNTH_JIT_C);
+   fmsynth_jit_vrr(e, FMSYNTH_JIT_VMOVHLPS, false, FMSYNTH_JIT_T, FMSYNTH_JIT_C, FMSYNTH_JIT_C);
+
+   fmsynth_jit_vrm(e, FMSYNTH_JIT_VADDSS, false, FMSYNTH_JIT_C, FMSYNTH_JIT_C, left, 0);
+   fmsynth_jit_vrm(e, FMSYNTH_JIT_VMOVSS_STORE, false, FMSYNTH_JIT_C, 0, left, 0);
+   fmsynth_jit_vrm(e, FMSYNTH_JIT_VADDSS, false, FMSYNTH_JIT_T, FMSYNTH_JIT_T, right, 0);
+   fmsynth_jit_vrm(e, FMSYNTH_JIT_VMOVSS_STORE, false, FMSYNTH_JIT_T, 0, right, 0);
+}
+
+static void fmsynth_jit_emit_state(struct fmsynth_jit_emitter *e, const struct fmsynth_jit_plan *plan,
+      unsigned op, unsigned voice, unsigned phases, unsigned env)
+{
+   fmsynth_jit_vrm(e, op, plan->wide, phases, 0, voice,
+         offsetof(struct fmsynth_voice, phases) + plan->half);
+   fmsynth_jit_vrm(e, op, plan->wide, env, 0, voice,
+         offsetof(struct fmsynth_voice, env) + plan->half);
+}
+
+// add reg, 4
+static void fmsynth_jit_emit_advance(struct fmsynth_jit_emitter *e, unsigned reg)
+{
+   fmsynth_jit_byte(e, 0x48 | (reg >> 3));
+   fmsynth_jit_byte(e, 0x83);
+   fmsynth_jit_byte(e, 0xc0 | (reg & 7));
+   fmsynth_jit_byte(e, 4);
+}
+
+// Loop over frames in the 32-bit counter register.
+// voice_b is 0 for the single voice kernel, RAX is never a voice.
+static void fmsynth_jit_emit_loop(struct fmsynth_jit_emitter *e, const struct fmsynth_jit_plan *plan,
+      unsigned counter, unsigned voice_a, unsigned voice_b, unsigned left, unsigned right)
+{
+   if (plan->live[0] || plan->live[1])
+   {
+      fmsynth_jit_emit_state(e, plan, FMSYNTH_JIT_VMOVAPS_LOAD,
+            voice_a, FMSYNTH_JIT_PHASES_A, FMSYNTH_JIT_ENV_A);
+      if (voice_b)
+      {
+         fmsynth_jit_emit_state(e, plan, FMSYNTH_JIT_VMOVAPS_LOAD,
+               voice_b, FMSYNTH_JIT_PHASES_B, FMSYNTH_JIT_ENV_B);
+      }
+
+      // test counter, counter; jz end
+      if (counter >> 3)
+      {
+         fmsynth_jit_byte(e, 0x45);
+      }
+      fmsynth_jit_byte(e, 0x85);
+      fmsynth_jit_byte(e, 0xc0 | ((counter & 7) << 3) | (counter & 7));
+      fmsynth_jit_byte(e, 0x0f);
+      fmsynth_jit_byte(e, 0x84);
+      size_t skip = e->pos;
+      fmsynth_jit_u32(e, 0);
+
+      size_t loop = e->pos;
+      fmsynth_jit_emit_step(e, plan, voice_a, FMSYNTH_JIT_PHASES_A, FMSYNTH_JIT_ENV_A, left, right);
+      if (voice_b)
+      {
+         fmsynth_jit_emit_step(e, plan, voice_b, FMSYNTH_JIT_PHASES_B, FMSYNTH_JIT_ENV_B, left, right);
+      }
+      fmsynth_jit_emit_advance(e, left);
+      fmsynth_jit_emit_advance(e, right);
+
+      // dec counter; jnz loop
+      if (counter >> 3)
+      {
+         fmsynth_jit_byte(e, 0x41);
+      }
+      fmsynth_jit_byte(e, 0xff);
+      fmsynth_jit_byte(e, 0xc8 | (counter & 7));
+      fmsynth_jit_byte(e, 0x0f);
+      fmsynth_jit_byte(e, 0x85);
+      fmsynth_jit_u32(e, (uint32_t)(loop - (e->pos + 4)));
+      fmsynth_jit_patch_rel32(e, skip, e->pos);
+
+      fmsynth_jit_emit_state(e, plan, FMSYNTH_JIT_VMOVAPS_STORE,
+            voice_a, FMSYNTH_JIT_PHASES_A, FMSYNTH_JIT_ENV_A);
+      if (voice_b)
+      {
+         fmsynth_jit_emit_state(e, plan, FMSYNTH_JIT_VMOVAPS_STORE,
+               voice_b, FMSYNTH_JIT_PHASES_B, FMSYNTH_JIT_ENV_B);
+      }
+   }
+
+   // vzeroupper; ret
+   fmsynth_jit_byte(e, 0xc5);
+   fmsynth_jit_byte(e, 0xf8);
+   fmsynth_jit_byte(e, 0x77);
+   fmsynth_jit_byte(e, 0xc3);
+}
+
+static void fmsynth_jit_align(struct fmsynth_jit_emitter *e)
+{
+   while (e->pos & 31)
+   {
+      fmsynth_jit_byte(e, 0xcc);
+   }
+}
+
+static bool fmsynth_jit_compile(struct fmsynth_jit_slot *slot, uint8_t *code,
+      const struct fmsynth_jit_key *key)
+{
+   struct fmsynth_jit_plan plan;
+   fmsynth_jit_make_plan(key, &plan);
+
+   fmsynth_jit_pool_splat(code, FMSYNTH_JIT_POOL_QUARTER, 0.25f);
+   fmsynth_jit_pool_splat(code, FMSYNTH_JIT_POOL_HALF, 0.5f);
+   fmsynth_jit_pool_splat(code, FMSYNTH_JIT_POOL_THREE_QUARTERS, 0.75f);
+   fmsynth_jit_pool_splat(code, FMSYNTH_JIT_POOL_TWO_PI, 2.0f * PI);
+   fmsynth_jit_pool_splat(code, FMSYNTH_JIT_POOL_C3, INV_FACTORIAL_3_2PIPOW3);
+   fmsynth_jit_pool_splat(code, FMSYNTH_JIT_POOL_C5, INV_FACTORIAL_5_2PIPOW5);
+   fmsynth_jit_pool_splat(code, FMSYNTH_JIT_POOL_C7, INV_FACTORIAL_7_2PIPOW7);
+   for (unsigned k = 0; k < FMSYNTH_OPERATORS; k++)
+   {
+      for (unsigned j = 0; j < FMSYNTH_OPERATORS; j++)
+      {
+         int32_t index = (j + k) % FMSYNTH_OPERATORS;
+         memcpy(code + FMSYNTH_JIT_POOL_ROTATE + 32 * k + j * sizeof(index), &index, sizeof(index));
+      }
+   }
+   memcpy(code + FMSYNTH_JIT_POOL_DIAGONAL, plan.diagonal, sizeof(plan.diagonal));
+
+   struct fmsynth_jit_emitter e = { code, FMSYNTH_JIT_SLOT_SIZE, FMSYNTH_JIT_POOL_SIZE, false };
+
+   // (params, voice, left, right, frames)
+   size_t single = e.pos;
+   fmsynth_jit_emit_loop(&e, &plan, FMSYNTH_JIT_R8,
+         FMSYNTH_JIT_RSI, 0, FMSYNTH_JIT_RDX, FMSYNTH_JIT_RCX);
+   fmsynth_jit_align(&e);
+
+   // (params_a, voice_a, params_b, voice_b, left, right, frames), frames is on the stack.
+   size_t pair = e.pos;
+   fmsynth_jit_byte(&e, 0x8b); // mov eax, [rsp + 8]
+   fmsynth_jit_byte(&e, 0x44);
+   fmsynth_jit_byte(&e, 0x24);
+   fmsynth_jit_byte(&e, 0x08);
+   fmsynth_jit_emit_loop(&e, &plan, FMSYNTH_JIT_RAX,
+         FMSYNTH_JIT_RSI, FMSYNTH_JIT_RCX, FMSYNTH_JIT_R8, FMSYNTH_JIT_R9);
+
+   if (e.overflow)
+   {
+      return false;
+   }
+
+   void *single_ptr = code + single;
+   void *pair_ptr = code + pair;
+   memcpy(&slot->process_frames, &single_ptr, sizeof(single_ptr));
+   memcpy(&slot->process_pair, &pair_ptr, sizeof(pair_ptr));
+   return true;
+}
+
+static struct fmsynth_jit *fmsynth_jit_new(void)
+{
+   if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("fma"))
+   {
+      return NULL;
+   }
+
+   // Code is generated on the audio thread when a patch settles,
+   // so the arena is mapped writable and executable up front and no system calls happen afterwards.
+   size_t header = (sizeof(struct fmsynth_jit) + 4095) & ~(size_t)4095;
+   size_t size = header + FMSYNTH_JIT_SLOTS * FMSYNTH_JIT_SLOT_SIZE;
+   void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (memory == MAP_FAILED)
+   {
+      return NULL;
+   }
+
+   struct fmsynth_jit *jit = (struct fmsynth_jit*)memory;
+   memset(jit, 0, sizeof(*jit));
+   jit->code = (uint8_t*)memory + header;
+   jit->size = size;
+   return jit;
+}
+
+static void fmsynth_jit_free(struct fmsynth_jit *jit)
+{
+   munmap(jit, jit->size);
+}
+
+// Finds or compiles code for a voice which was just triggered.
+// Voices which cannot use generated code keep the static kernel.
+static void fmsynth_jit_bind(struct fmsynth_jit *jit, const struct fmsynth_voice *voice,
+      struct fmsynth_voice_control *ctrl)
+{
+   ctrl->jit_slot = 0;
+
+   struct fmsynth_jit_key key;
+   fmsynth_jit_make_key(voice, ctrl, &key);
+   uint32_t hash = fmsynth_jit_hash(&key);
+
+   struct fmsynth_jit_slot *slot = NULL;
+   struct fmsynth_jit_slot *victim = &jit->slots[0];
+   for (unsigned i = 0; i < FMSYNTH_JIT_SLOTS; i++)
+   {
+      struct fmsynth_jit_slot *s = &jit->slots[i];
+      if (s->valid && s->hash == hash && !memcmp(&s->key, &key, sizeof(key)))
+      {
+         slot = s;
+         break;
+      }
+
+      if (victim->valid && (!s->valid || s->last_used < victim->last_used))
+      {
+         victim = s;
+      }
+   }
+
+   if (!slot)
+   {
+      // Patches are only told apart by hash here, a collision merely compiles a patch early.
+      struct fmsynth_jit_pending *pending = &jit->pending[0];
+      for (unsigned i = 0; i < FMSYNTH_JIT_PENDING; i++)
+      {
+         struct fmsynth_jit_pending *p = &jit->pending[i];
+         if (p->count && p->hash == hash)
+         {
+            pending = p;
+            break;
+         }
+
+         if (pending->count && (!p->count || p->last_used < pending->last_used))
+         {
+            pending = p;
+         }
+      }
+
+      if (!pending->count || pending->hash != hash)
+      {
+         pending->hash = hash;
+         pending->count = 0;
+      }
+
+      pending->last_used = ++jit->clock;
+      if (++pending->count < FMSYNTH_JIT_SETTLE)
+      {
+         return;
+      }
+      pending->count = 0;
+
+      // Least recently used slot is recycled. Voices still bound to it notice the new generation.
+      slot = victim;
+      slot->valid = false;
+      slot->generation++;
+      if (!fmsynth_jit_compile(slot, jit->code + (slot - jit->slots) * FMSYNTH_JIT_SLOT_SIZE, &key))
+      {
+         return;
+      }
+
+      memcpy(&slot->key, &key, sizeof(key));
+      slot->hash = hash;
+      slot->valid = true;
+   }
+
+   slot->last_used = ++jit->clock;
+   ctrl->jit_slot = (uint8_t)(slot - jit->slots + 1);
+   ctrl->jit_generation = slot->generation;
+}
+
+// The modulation matrix is read live from the parameters, so a voice drops back to the
+// static kernel as soon as its patch is edited.
+static void fmsynth_jit_validate(const struct fmsynth_jit *jit, struct fmsynth_voice_control *ctrl)
+{
+   const struct fmsynth_jit_slot *slot = &jit->slots[ctrl->jit_slot - 1];
+   if (!slot->valid || slot->generation != ctrl->jit_generation ||
+         memcmp(slot->key.mod_to_carriers, ctrl->params->mod_to_carriers,
+            sizeof(slot->key.mod_to_carriers)))
+   {
+      ctrl->jit_slot = 0;
+   }
+}
@@ -34,112 +34,190 @@ static __m128 floor_sse(__m128 v)
 }
 #endif
 
-static void fmsynth_process_frames(fmsynth_t *fm,
-      struct fmsynth_voice *voice, float *oleft, float *oright, unsigned frames)
+// One frame of one voice, operators in blocks of 4.
+// Returns the left mix in lane 0 and the right mix in lane 2.
+static FMSYNTH_ALWAYS_INLINE __m128 fmsynth_step_sse(
+      const struct fmsynth_voice_parameters *params,
+      const struct fmsynth_voice *voice, const float *amp, __m128 *phases, __m128 *env,
+      unsigned operators, bool low_precision, enum fmsynth_mix mix)
 {
-   __m128 phases0 = _mm_load_ps(voice->phases + 0);
-   __m128 phases1 = _mm_load_ps(voice->phases + 4);
+   const unsigned blocks = operators / 4;
+   __m128 x[FMSYNTH_OPERATORS / 4];
+   __m128 xmod[FMSYNTH_OPERATORS / 4];
+   __m128 steps[FMSYNTH_OPERATORS / 4];
 
-   __m128 env0 = _mm_load_ps(voice->env + 0);
-   __m128 env1 = _mm_load_ps(voice->env + 4);
+   for (unsigned b = 0; b < blocks; b++)
+   {
+      __m128 sub = _mm_sub_ps(phases[b], _mm_set1_ps(0.25f));
+      __m128 cmp = _mm_cmplt_ps(phases[b], _mm_set1_ps(0.5f));
+      __m128 greater = _mm_sub_ps(_mm_set1_ps(0.75f), phases[b]);
+      x[b] = _mm_or_ps(_mm_and_ps(cmp, sub), _mm_andnot_ps(cmp, greater));
+   }
 
-   for (unsigned f = 0; f < frames; f++)
+   // Compute sine approximation.
+   for (unsigned b = 0; b < blocks; b++)
    {
-      __m128 x0 = _mm_sub_ps(phases0, _mm_set1_ps(0.25f));
-      __m128 x1 = _mm_sub_ps(phases1, _mm_set1_ps(0.25f));
-      __m128 cmp0 = _mm_cmplt_ps(phases0, _mm_set1_ps(0.5f));
-      __m128 cmp1 = _mm_cmplt_ps(phases1, _mm_set1_ps(0.5f));
-      __m128 greater0 = _mm_sub_ps(_mm_set1_ps(0.75f), phases0);
-      __m128 greater1 = _mm_sub_ps(_mm_set1_ps(0.75f), phases1);
-      x0 = _mm_or_ps(_mm_and_ps(cmp0, x0), _mm_andnot_ps(cmp0, greater0));
-      x1 = _mm_or_ps(_mm_and_ps(cmp1, x1), _mm_andnot_ps(cmp1, greater1));
-
-      // Compute sine approximation.
-      {
-         __m128 x20 = _mm_mul_ps(x0, x0);
-         __m128 x21 = _mm_mul_ps(x1, x1);
-         __m128 x30 = _mm_mul_ps(x0, x20);
-         __m128 x31 = _mm_mul_ps(x1, x21);
-
-         x0 = _mm_mul_ps(x0, _mm_set1_ps(2.0f * PI));
-         x1 = _mm_mul_ps(x1, _mm_set1_ps(2.0f * PI));
-
-         x0 = _mm_sub_ps(x0, _mm_mul_ps(x30, _mm_set1_ps(INV_FACTORIAL_3_2PIPOW3)));
-         x1 = _mm_sub_ps(x1, _mm_mul_ps(x31, _mm_set1_ps(INV_FACTORIAL_3_2PIPOW3)));
-
-         x30 = _mm_mul_ps(x30, x20);
-         x31 = _mm_mul_ps(x31, x21);
-         x0 = _mm_add_ps(x0, _mm_mul_ps(x30, _mm_set1_ps(INV_FACTORIAL_5_2PIPOW5)));
-         x1 = _mm_add_ps(x1, _mm_mul_ps(x31, _mm_set1_ps(INV_FACTORIAL_5_2PIPOW5)));
-
-         x30 = _mm_mul_ps(x30, x20);
-         x31 = _mm_mul_ps(x31, x21);
-         x0 = _mm_sub_ps(x0, _mm_mul_ps(x30, _mm_set1_ps(INV_FACTORIAL_7_2PIPOW7)));
-         x1 = _mm_sub_ps(x1, _mm_mul_ps(x31, _mm_set1_ps(INV_FACTORIAL_7_2PIPOW7)));
-      }
+      __m128 x2 = _mm_mul_ps(x[b], x[b]);
+      __m128 x3 = _mm_mul_ps(x[b], x2);
 
-      x0 = _mm_mul_ps(x0, _mm_mul_ps(env0, _mm_load_ps(voice->read_mod + 0)));
-      x1 = _mm_mul_ps(x1, _mm_mul_ps(env1, _mm_load_ps(voice->read_mod + 4)));
+      x[b] = _mm_mul_ps(x[b], _mm_set1_ps(2.0f * PI));
+      x[b] = _mm_sub_ps(x[b], _mm_mul_ps(x3, _mm_set1_ps(INV_FACTORIAL_3_2PIPOW3)));
 
-      env0 = _mm_add_ps(env0, _mm_load_ps(voice->target_env_step + 0));
-      env1 = _mm_add_ps(env1, _mm_load_ps(voice->target_env_step + 4));
+      x3 = _mm_mul_ps(x3, x2);
+      x[b] = _mm_add_ps(x[b], _mm_mul_ps(x3, _mm_set1_ps(INV_FACTORIAL_5_2PIPOW5)));
 
-      __m128 step_rate0 = _mm_load_ps(voice->step_rate + 0);
-      __m128 step_rate1 = _mm_load_ps(voice->step_rate + 4);
+      if (!low_precision)
+      {
+         x3 = _mm_mul_ps(x3, x2);
+         x[b] = _mm_sub_ps(x[b], _mm_mul_ps(x3, _mm_set1_ps(INV_FACTORIAL_7_2PIPOW7)));
+      }
+   }
 
-      __m128 xmod0 = _mm_mul_ps(x0, step_rate0);
-      __m128 xmod1 = _mm_mul_ps(x1, step_rate1);
+   for (unsigned b = 0; b < blocks; b++)
+   {
+      x[b] = _mm_mul_ps(x[b], _mm_mul_ps(env[b], _mm_load_ps(voice->read_mod + 4 * b)));
+      env[b] = _mm_add_ps(env[b], _mm_load_ps(voice->target_env_step + 4 * b));
 
-      __m128 steps0 = _mm_mul_ps(step_rate0, _mm_load_ps(voice->lfo_freq_mod + 0));
-      __m128 steps1 = _mm_mul_ps(step_rate1, _mm_load_ps(voice->lfo_freq_mod + 4));
-      const float *vec;
+      __m128 step_rate = _mm_load_ps(voice->step_rate + 4 * b);
+      xmod[b] = _mm_mul_ps(x[b], step_rate);
+      steps[b] = _mm_mul_ps(step_rate, _mm_load_ps(voice->lfo_freq_mod + 4 * b));
+   }
 
-#define MAT_ACCUMULATE(steps0, steps1, i, scalar, index) \
-      vec = fm->params.mod_to_carriers[i]; \
-      steps0 = _mm_add_ps(steps0, _mm_mul_ps(_mm_load_ps(vec + 0), \
+   // Even modulators accumulate to steps and odd ones to phases, to split the dependency chain.
+   const float *vec;
+#define MAT_ACCUMULATE(acc, i, scalar, index) \
+   vec = params->mod_to_carriers[i]; \
+   for (unsigned o = 0; o < blocks; o++) \
+   { \
+      acc[o] = _mm_add_ps(acc[o], _mm_mul_ps(_mm_load_ps(vec + 4 * o), \
                _mm_shuffle_ps(scalar, scalar, \
                   _MM_SHUFFLE(index, index, index, index)))); \
-      steps1 = _mm_add_ps(steps1, _mm_mul_ps(_mm_load_ps(vec + 4), \
-               _mm_shuffle_ps(scalar, scalar, \
-                  _MM_SHUFFLE(index, index, index, index))))
-
-      MAT_ACCUMULATE(steps0, steps1,   0, xmod0, 0);
-      MAT_ACCUMULATE(phases0, phases1, 1, xmod0, 1);
-      MAT_ACCUMULATE(steps0, steps1,   2, xmod0, 2);
-      MAT_ACCUMULATE(phases0, phases1, 3, xmod0, 3);
-      MAT_ACCUMULATE(steps0, steps1,   4, xmod1, 0);
-      MAT_ACCUMULATE(phases0, phases1, 5, xmod1, 1);
-      MAT_ACCUMULATE(steps0, steps1,   6, xmod1, 2);
-      MAT_ACCUMULATE(phases0, phases1, 7, xmod1, 3);
+   }
+
+   for (unsigned b = 0; b < blocks; b++)
+   {
+      MAT_ACCUMULATE(steps,  4 * b + 0, xmod[b], 0);
+      MAT_ACCUMULATE(phases, 4 * b + 1, xmod[b], 1);
+      MAT_ACCUMULATE(steps,  4 * b + 2, xmod[b], 2);
+      MAT_ACCUMULATE(phases, 4 * b + 3, xmod[b], 3);
+   }
 #undef MAT_ACCUMULATE
 
-      __m128 left  = _mm_mul_ps(x0, _mm_load_ps(voice->pan_amp[0] + 0));
-      __m128 right = _mm_mul_ps(x0, _mm_load_ps(voice->pan_amp[1] + 0));
+   // Centered and mono voices only need one mix.
+   __m128 left  = _mm_mul_ps(x[0], _mm_load_ps(amp + 0));
+   __m128 right = left;
+   if (mix == FMSYNTH_MIX_STEREO)
+   {
+      right = _mm_mul_ps(x[0], _mm_load_ps(voice->pan_amp[1] + 0));
+   }
 
-      phases0 = _mm_add_ps(phases0, steps0);
-      phases1 = _mm_add_ps(phases1, steps1);
+   for (unsigned b = 0; b < blocks; b++)
+   {
+      phases[b] = _mm_add_ps(phases[b], steps[b]);
 #ifdef __SSE4_1__
-      phases0 = _mm_sub_ps(phases0, _mm_floor_ps(phases0));
-      phases1 = _mm_sub_ps(phases1, _mm_floor_ps(phases1));
+      phases[b] = _mm_sub_ps(phases[b], _mm_floor_ps(phases[b]));
 #else
-      phases0 = _mm_sub_ps(phases0, floor_sse(phases0));
-      phases1 = _mm_sub_ps(phases1, floor_sse(phases1));
+      phases[b] = _mm_sub_ps(phases[b], floor_sse(phases[b]));
 #endif
+   }
 
-      left  = _mm_add_ps(left, _mm_mul_ps(x1, _mm_load_ps(voice->pan_amp[0] + 4)));
-      right = _mm_add_ps(right, _mm_mul_ps(x1, _mm_load_ps(voice->pan_amp[1] + 4)));
+   for (unsigned b = 1; b < blocks; b++)
+   {
+      left  = _mm_add_ps(left, _mm_mul_ps(x[b], _mm_load_ps(amp + 4 * b)));
+      if (mix == FMSYNTH_MIX_STEREO)
+      {
+         right = _mm_add_ps(right, _mm_mul_ps(x[b], _mm_load_ps(voice->pan_amp[1] + 4 * b)));
+      }
+   }
+   if (mix != FMSYNTH_MIX_STEREO)
+   {
+      right = left;
+   }
+
+   __m128 out = _mm_add_ps(_mm_shuffle_ps(left, right,
+            _MM_SHUFFLE(1, 0, 1, 0)),
+         _mm_shuffle_ps(left, right, _MM_SHUFFLE(3, 2, 3, 2)));
+   out = _mm_add_ps(_mm_shuffle_ps(out, out, _MM_SHUFFLE(3, 3, 1, 1)), out);
+   return out;
+}
 
-      __m128 out = _mm_add_ps(_mm_shuffle_ps(left, right,
-               _MM_SHUFFLE(1, 0, 1, 0)),
-            _mm_shuffle_ps(left, right, _MM_SHUFFLE(3, 2, 3, 2)));
-      out = _mm_add_ps(_mm_shuffle_ps(out, out, _MM_SHUFFLE(3, 3, 1, 1)), out);
+static FMSYNTH_ALWAYS_INLINE void fmsynth_load_state_sse(const struct fmsynth_voice *voice,
+      __m128 *phases, __m128 *env, unsigned operators)
+{
+   for (unsigned b = 0; b < operators / 4; b++)
+   {
+      phases[b] = _mm_load_ps(voice->phases + 4 * b);
+      env[b] = _mm_load_ps(voice->env + 4 * b);
+   }
+}
+
+static FMSYNTH_ALWAYS_INLINE void fmsynth_store_state_sse(struct fmsynth_voice *voice,
+      const __m128 *phases, const __m128 *env, unsigned operators)
+{
+   for (unsigned b = 0; b < operators / 4; b++)
+   {
+      _mm_store_ps(voice->phases + 4 * b, phases[b]);
+      _mm_store_ps(voice->env + 4 * b, env[b]);
+   }
+}
+
+static FMSYNTH_ALWAYS_INLINE void fmsynth_process_frames_sse(
+      const struct fmsynth_voice_parameters *params,
+      struct fmsynth_voice *voice, float *oleft, float *oright, unsigned frames,
+      unsigned operators, bool low_precision, enum fmsynth_mix mix)
+{
+   __m128 phases[FMSYNTH_OPERATORS / 4];
+   __m128 env[FMSYNTH_OPERATORS / 4];
+   FMSYNTH_ALIGNED_CACHE_PRE float mono_amp[FMSYNTH_OPERATORS] FMSYNTH_ALIGNED_CACHE_POST;
+   const float *amp = fmsynth_voice_mix_amp(voice, mono_amp, operators, mix);
+   fmsynth_load_state_sse(voice, phases, env, operators);
+
+   for (unsigned f = 0; f < frames; f++)
+   {
+      __m128 out = fmsynth_step_sse(params, voice, amp, phases, env, operators, low_precision, mix);
       _mm_store_ss(oleft + f, _mm_add_ss(out, _mm_load_ss(oleft + f)));
-      _mm_store_ss(oright + f, _mm_add_ss(_mm_movehl_ps(out, out), _mm_load_ss(oright + f)));
+      if (mix != FMSYNTH_MIX_MONO)
+      {
+         _mm_store_ss(oright + f, _mm_add_ss(_mm_movehl_ps(out, out), _mm_load_ss(oright + f)));
+      }
    }
 
-   _mm_store_ps(voice->phases + 0, phases0);
-   _mm_store_ps(voice->phases + 4, phases1);
-   _mm_store_ps(voice->env + 0, env0);
-   _mm_store_ps(voice->env + 4, env1);
+   fmsynth_store_state_sse(voice, phases, env, operators);
 }
 
+// Two independent voices in one loop, so each hides the latency of the other's
+// oscillator, modulation and phase update chain.
+// Voice a is mixed before voice b, exactly like rendering them one after another.
+static FMSYNTH_ALWAYS_INLINE void fmsynth_process_frames_pair_sse(
+      const struct fmsynth_voice_parameters *params_a, struct fmsynth_voice *voice_a,
+      const struct fmsynth_voice_parameters *params_b, struct fmsynth_voice *voice_b,
+      float *oleft, float *oright, unsigned frames,
+      unsigned operators, bool low_precision, enum fmsynth_mix mix)
+{
+   __m128 phases_a[FMSYNTH_OPERATORS / 4];
+   __m128 env_a[FMSYNTH_OPERATORS / 4];
+   __m128 phases_b[FMSYNTH_OPERATORS / 4];
+   __m128 env_b[FMSYNTH_OPERATORS / 4];
+   FMSYNTH_ALIGNED_CACHE_PRE float mono_amp_a[FMSYNTH_OPERATORS] FMSYNTH_ALIGNED_CACHE_POST;
+   FMSYNTH_ALIGNED_CACHE_PRE float mono_amp_b[FMSYNTH_OPERATORS] FMSYNTH_ALIGNED_CACHE_POST;
+   const float *amp_a = fmsynth_voice_mix_amp(voice_a, mono_amp_a, operators, mix);
+   const float *amp_b = fmsynth_voice_mix_amp(voice_b, mono_amp_b, operators, mix);
+   fmsynth_load_state_sse(voice_a, phases_a, env_a, operators);
+   fmsynth_load_state_sse(voice_b, phases_b, env_b, operators);
+
+   for (unsigned f = 0; f < frames; f++)
+   {
+      __m128 out_a = fmsynth_step_sse(params_a, voice_a, amp_a, phases_a, env_a, operators, low_precision, mix);
+      __m128 out_b = fmsynth_step_sse(params_b, voice_b, amp_b, phases_b, env_b, operators, low_precision, mix);
+
+      _mm_store_ss(oleft + f, _mm_add_ss(_mm_add_ss(_mm_load_ss(oleft + f), out_a), out_b));
+      if (mix != FMSYNTH_MIX_MONO)
+      {
+         _mm_store_ss(oright + f, _mm_add_ss(_mm_add_ss(_mm_load_ss(oright + f),
+                     _mm_movehl_ps(out_a, out_a)), _mm_movehl_ps(out_b, out_b)));
+      }
+   }
+
+   fmsynth_store_state_sse(voice_a, phases_a, env_a, operators);
+   fmsynth_store_state_sse(voice_b, phases_b, env_b, operators);
+}